@@ -0,0 +1,31 @@
+set -e
+
+# memory vs accuracy report of compressed precomputed files
+# PREFIX_QUERY is generated by script/extract_prefix.py; TRAIN optionally subdivides into seen vs unseen queries
+
+ENCODER=$1
+MODEL=$2
+PRECOMPUTED=$3
+PREFIX_QUERY=$4
+TRAIN=$5
+
+SEEN_OPTION=""
+if [ -n "$TRAIN" ]; then
+  SEEN_OPTION="--seen $TRAIN"
+fi
+
+cut -f1 $PREFIX_QUERY > $PREFIX_QUERY.prefix
+cut -f2 $PREFIX_QUERY > $PREFIX_QUERY.query
+
+for BITS in 32 16 8; do
+  if [ $BITS = 32 ]; then
+    FILE=$PRECOMPUTED
+  else
+    FILE=$PRECOMPUTED.$BITS
+    build/qbz_compress_precomputed $PRECOMPUTED $FILE $BITS
+  fi
+
+  echo "### $BITS-bit costs: `wc -c < $FILE` bytes"
+  build/qbz_test_queryblazer $ENCODER $MODEL $FILE $PREFIX_QUERY.prefix > $FILE.completions
+  python script/eval.py --query $PREFIX_QUERY.query --completions $FILE.completions $SEEN_OPTION
+done
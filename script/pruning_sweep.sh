@@ -0,0 +1,29 @@
+set -e
+
+# speed vs accuracy sweep of beam pruning, searching every prefix on demand (no precomputed file)
+# PREFIX_QUERY is generated by script/extract_prefix.py; TRAIN optionally subdivides into seen vs unseen queries
+# GAPS and STEPS override the beam gaps and stable steps swept, e.g., GAPS="0 3 6" STEPS="0 2"
+
+ENCODER=$1
+MODEL=$2
+PREFIX_QUERY=$3
+TRAIN=$4
+GAPS=${GAPS:-"0 2 4 6 8"}
+STEPS=${STEPS:-"0 1 2"}
+
+SEEN_OPTION=""
+if [ -n "$TRAIN" ]; then
+  SEEN_OPTION="--seen $TRAIN"
+fi
+
+cut -f1 $PREFIX_QUERY > $PREFIX_QUERY.prefix
+cut -f2 $PREFIX_QUERY > $PREFIX_QUERY.query
+
+for GAP in $GAPS; do
+  for STEP in $STEPS; do
+    COMPLETIONS=$PREFIX_QUERY.gap$GAP.steps$STEP.completions
+    echo "### beam_gap=$GAP stable_steps=$STEP"
+    build/qbz_test_queryblazer $ENCODER $MODEL - $PREFIX_QUERY.prefix $GAP $STEP 2>&1 > $COMPLETIONS | grep QPS
+    python script/eval.py --query $PREFIX_QUERY.query --completions $COMPLETIONS $SEEN_OPTION
+  done
+done
@@ -0,0 +1,27 @@
+set -e
+
+# precompute in NUM_SHARDS processes on this machine, the same way separate nodes would, and merge the partial files
+# THREADS is the # of precompute threads per process; extra flags (e.g., --topk=10) are passed to every process
+
+ENCODER=$1
+MODEL=$2
+PRECOMPUTED=$3
+NUM_SHARDS=$4
+THREADS=${5:-1}
+shift 5 || shift $#
+
+PIDS=""
+for ((INDEX = 0; INDEX < NUM_SHARDS; INDEX++)); do
+  build/qbz_build_queryblazer --shard_count=$NUM_SHARDS --shard_index=$INDEX --threads=$THREADS "$@" \
+    $ENCODER $MODEL $PRECOMPUTED.part$INDEX > $PRECOMPUTED.part$INDEX.log 2>&1 &
+  PIDS="$PIDS $!"
+done
+for PID in $PIDS; do
+  wait $PID
+done
+
+PARTIALS=""
+for ((INDEX = 0; INDEX < NUM_SHARDS; INDEX++)); do
+  PARTIALS="$PARTIALS $PRECOMPUTED.part$INDEX"
+done
+build/qbz_merge_precomputed --model=$MODEL $PRECOMPUTED $PARTIALS
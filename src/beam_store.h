@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_BEAMSTORE_H
+#define QUERYBLAZER_BEAMSTORE_H
+
+#include "common.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Arena of beam search hypotheses
+ * Hypotheses are flat records appended to a single array and refer to their
+ * parent by index, so extending a hypothesis never copies its olabels and
+ * the whole search is released at once by Clear, which keeps the capacity
+ * for the next search.
+ * Frontier holds the hypotheses of the current step and Next collects those
+ * of the following step.
+ */
+class BeamStore {
+  public:
+    struct Hypothesis {
+        uint32_t parent;
+        int olabel;
+        int state;
+        float cost;
+        // number of olabels
+        uint32_t depth;
+    };
+
+    static constexpr uint32_t NO_PARENT = UINT32_MAX;
+
+    void Clear() {
+        hypotheses.clear();
+        frontier.clear();
+        next.clear();
+    }
+
+    /**
+     * Append a hypothesis extending parent by olabel to the next step
+     * @param parent: NO_PARENT for the empty sequence
+     */
+    uint32_t Add(uint32_t parent, int olabel, int state, float cost) {
+        const auto depth =
+            parent == NO_PARENT ? 0 : hypotheses[parent].depth + 1;
+        hypotheses.push_back(Hypothesis{parent, olabel, state, cost, depth});
+        const auto idx = static_cast<uint32_t>(hypotheses.size() - 1);
+        next.push_back(idx);
+        return idx;
+    }
+
+    const Hypothesis &operator[](uint32_t idx) const {
+        return hypotheses[idx];
+    }
+
+    /**
+     * Make the next step current and keep only its best beam_size
+     * hypotheses, sorted by cost
+     * @return false if there is no hypothesis left
+     */
+    bool Advance(size_t beam_size) {
+        frontier.swap(next);
+        next.clear();
+        const auto compare = [this](uint32_t a, uint32_t b) {
+            return hypotheses[a].cost < hypotheses[b].cost;
+        };
+        if (frontier.size() > beam_size) {
+            std::nth_element(frontier.begin(), frontier.begin() + beam_size,
+                             frontier.end(), compare);
+            frontier.resize(beam_size);
+        }
+        std::sort(frontier.begin(), frontier.end(), compare);
+        return !frontier.empty();
+    }
+
+    const std::vector<uint32_t> &Frontier() const { return frontier; }
+
+    /**
+     * Olabels of a hypothesis, from the first
+     */
+    void Olabels(uint32_t idx, std::vector<int> *olabels) const {
+        olabels->resize(hypotheses[idx].depth);
+        for (auto it = olabels->rbegin(); it != olabels->rend(); ++it) {
+            *it = hypotheses[idx].olabel;
+            idx = hypotheses[idx].parent;
+        }
+    }
+
+  private:
+    std::vector<Hypothesis> hypotheses;
+    std::vector<uint32_t> frontier;
+    std::vector<uint32_t> next;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_BEAMSTORE_H
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "bench.h"
+#include "mpc.h"
+#include "queryblazer.h"
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <thread>
+
+DEFINE_string(engine, "queryblazer",
+              "completer to replay the prefixes against: queryblazer or mpc");
+DEFINE_int32(threads, 1, "# of client threads sharing the completer");
+DEFINE_bool(cold, false,
+            "measure the first pass right after loading separately, before "
+            "any warm-up");
+DEFINE_int32(warmup, 0, "# of unmeasured passes before the warm phase");
+DEFINE_int32(passes, 1, "# of measured passes of the warm phase");
+DEFINE_bool(session, false,
+            "replay each line keystroke by keystroke, one completion per "
+            "character typed");
+DEFINE_bool(mmap, false, "memory-map the model / trie");
+DEFINE_int64(cache_bytes, 0,
+             "queryblazer: on-demand result cache, requires --top_arcs; mpc: "
+             "completion cache");
+DEFINE_int64(completion_cache_bytes, 0, "queryblazer: completion cache");
+DEFINE_int32(branch_factor, 30, "queryblazer: branch factor");
+DEFINE_int32(beam_size, 30, "queryblazer: beam size");
+DEFINE_int32(topk, 10, "queryblazer: # of completions");
+DEFINE_int32(length_limit, 100, "queryblazer: maximum decoding length");
+DEFINE_string(top_arcs, "", "queryblazer: top arc file of the model");
+
+using namespace qbz;
+
+// a line of the prefix file and, in session mode, its keystrokes
+struct Line {
+    std::string text;
+    std::vector<std::string> keys;
+};
+
+double MicrosSince(std::chrono::steady_clock::time_point begin) {
+    return SecondsSince(begin) * 1e6;
+}
+
+/**
+ * Complete whole lines with a context of its own
+ */
+class QueryBlazerClient {
+  public:
+    explicit QueryBlazerClient(const QueryBlazer &queryBlazer)
+        : queryBlazer(queryBlazer),
+          context{queryBlazer} {}
+
+    void Replay(const Line &line, std::vector<double> *latencies) {
+        const auto begin = std::chrono::steady_clock::now();
+        queryBlazer.Complete(line.text, context, &completion);
+        latencies->push_back(MicrosSince(begin));
+    }
+
+  private:
+    const QueryBlazer &queryBlazer;
+    QueryBlazer::Context context;
+    QueryBlazer::Completion completion;
+};
+
+/**
+ * Type lines into a keystroke session, timing each append & completion
+ */
+class QueryBlazerSessionClient {
+  public:
+    explicit QueryBlazerSessionClient(const QueryBlazer &queryBlazer)
+        : session{queryBlazer} {}
+
+    void Replay(const Line &line, std::vector<double> *latencies) {
+        session.Reset();
+        for (const auto &key : line.keys) {
+            const auto begin = std::chrono::steady_clock::now();
+            session.Append(key);
+            session.Complete(&completion);
+            latencies->push_back(MicrosSince(begin));
+        }
+    }
+
+  private:
+    QueryBlazer::Session session;
+    QueryBlazer::Completion completion;
+};
+
+/**
+ * Complete whole lines, or every prefix of them in session mode
+ */
+class MpcClient {
+  public:
+    MpcClient(const Mpc &mpc, bool session) : mpc(mpc), session{session} {}
+
+    void Replay(const Line &line, std::vector<double> *latencies) {
+        if (!session) {
+            const auto begin = std::chrono::steady_clock::now();
+            completion = mpc.Complete(line.text);
+            latencies->push_back(MicrosSince(begin));
+            return;
+        }
+        prefix.clear();
+        for (const auto &key : line.keys) {
+            prefix += key;
+            const auto begin = std::chrono::steady_clock::now();
+            completion = mpc.Complete(prefix);
+            latencies->push_back(MicrosSince(begin));
+        }
+    }
+
+  private:
+    const Mpc &mpc;
+    const bool session;
+    std::string prefix;
+    Mpc::Completion completion;
+};
+
+struct PhaseReport {
+    double seconds = 0;
+    // per completion in us, sorted
+    std::vector<double> latencies;
+};
+
+/**
+ * Replay every line passes times, spread over one thread per client
+ * Clients outlive phases, so that contexts stay warm after the cold phase.
+ */
+template <typename Client>
+PhaseReport RunPhase(const std::vector<Line> &lines,
+                     std::vector<std::unique_ptr<Client>> &clients,
+                     size_t passes) {
+    const auto total = lines.size() * passes;
+    std::atomic<size_t> next{0};
+    std::vector<std::vector<double>> latencies(clients.size());
+    std::vector<std::thread> threads;
+    const auto begin = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx < clients.size(); ++idx) {
+        threads.emplace_back([&, idx]() {
+            auto &client = *clients[idx];
+            auto &thread_latencies = latencies[idx];
+            thread_latencies.reserve(total / clients.size() + 1);
+            for (auto line = next++; line < total; line = next++)
+                client.Replay(lines[line % lines.size()], &thread_latencies);
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    PhaseReport report;
+    report.seconds = SecondsSince(begin);
+    for (auto &thread_latencies : latencies)
+        report.latencies.insert(report.latencies.end(),
+                                thread_latencies.begin(),
+                                thread_latencies.end());
+    std::sort(report.latencies.begin(), report.latencies.end());
+    return report;
+}
+
+void Print(const std::string &name, const PhaseReport &report, bool last) {
+    const auto &latencies = report.latencies;
+    double sum = 0.0;
+    for (const auto latency : latencies) sum += latency;
+    std::cout << "    \"" << name
+              << "\": {\"completions\": " << latencies.size()
+              << ", \"seconds\": " << report.seconds << ", \"qps\": "
+              << latencies.size() / std::max(report.seconds, 1e-9)
+              << ", \"mean_us\": "
+              << sum / std::max<size_t>(latencies.size(), 1)
+              << ", \"p50_us\": " << Percentile(latencies, 50)
+              << ", \"p90_us\": " << Percentile(latencies, 90)
+              << ", \"p99_us\": " << Percentile(latencies, 99)
+              << ", \"p999_us\": " << Percentile(latencies, 99.9)
+              << ", \"max_us\": "
+              << (latencies.empty() ? 0.0 : latencies.back())
+              << "}" << (last ? "" : ",") << std::endl;
+}
+
+/**
+ * Run the cold, warm-up & warm phases and print the report
+ */
+template <typename Client>
+void Run(const std::vector<Line> &lines,
+         std::vector<std::unique_ptr<Client>> &clients, double load_seconds) {
+    const auto load_memory = GetMemoryUsage();
+    PhaseReport cold;
+    if (FLAGS_cold) cold = RunPhase(lines, clients, 1);
+    if (FLAGS_warmup > 0)
+        RunPhase(lines, clients, static_cast<size_t>(FLAGS_warmup));
+    const auto warm =
+        RunPhase(lines, clients, static_cast<size_t>(FLAGS_passes));
+    const auto memory = GetMemoryUsage();
+
+    std::cout << "{" << std::endl;
+    std::cout << "  \"engine\": \"" << FLAGS_engine
+              << "\", \"threads\": " << clients.size()
+              << ", \"session\": " << (FLAGS_session ? "true" : "false")
+              << ", \"lines\": " << lines.size()
+              << ", \"warmup\": " << FLAGS_warmup
+              << ", \"passes\": " << FLAGS_passes << "," << std::endl;
+    std::cout << "  \"load_seconds\": " << load_seconds
+              << ", \"load_rss_kb\": " << load_memory.rss
+              << ", \"rss_kb\": " << memory.rss
+              << ", \"peak_rss_kb\": " << memory.peak_rss << "," << std::endl;
+    std::cout << "  \"phases\": {" << std::endl;
+    if (FLAGS_cold) Print("cold", cold, false);
+    Print("warm", warm, true);
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+}
+
+std::vector<Line> ReadLines(const std::string &file) {
+    std::ifstream ifs{file};
+    QBZ_ASSERT(ifs, "Error reading " + file);
+    std::vector<Line> lines;
+    std::string text;
+    while (std::getline(ifs, text)) {
+        if (text.empty()) continue;
+        Line line{text, {}};
+        if (FLAGS_session) {
+            for (const auto c : ToUtf8(text)) {
+                line.keys.emplace_back();
+                utf8::append(c, std::back_inserter(line.keys.back()));
+            }
+        }
+        lines.push_back(std::move(line));
+    }
+    QBZ_ASSERT(!lines.empty(), "No prefix in " + file);
+    return lines;
+}
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Replay a prefix file against a completer with several client "
+        "threads and report latency percentiles, QPS & memory as JSON\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] ENCODER MODEL PRECOMPUTED PREFIX_FILE\n"
+        "       " +
+        std::string{argv[0]} +
+        " --engine=mpc [--flags] TRIE PRECOMPUTED PREFIX_FILE\n"
+        "\tENCODER: LPM encoder in FST\n"
+        "\tMODEL: ngram language model in FST\n"
+        "\tPRECOMPUTED: precomputed file; use '-' if not available for "
+        "queryblazer\n"
+        "\tTRIE: trie storing query history in FST\n"
+        "\tPREFIX_FILE: a prefix per line, or a query per line with "
+        "--session\n"
+        "Latencies are per completion; with --session, per character "
+        "appended and completed.\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    const auto mpc = FLAGS_engine == "mpc";
+    QBZ_ASSERT(mpc || FLAGS_engine == "queryblazer",
+               "Unknown engine " + FLAGS_engine);
+    if (argc != (mpc ? 4 : 5)) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    QBZ_ASSERT(FLAGS_threads > 0 && FLAGS_passes > 0 && FLAGS_warmup >= 0,
+               "--threads and --passes must be positive");
+    const auto lines = ReadLines(argv[argc - 1]);
+    const auto num_threads = static_cast<size_t>(FLAGS_threads);
+
+    const auto begin = std::chrono::steady_clock::now();
+    if (mpc) {
+        Mpc completer{argv[1], argv[2], FLAGS_mmap,
+                      static_cast<size_t>(FLAGS_cache_bytes)};
+        const auto load_seconds = SecondsSince(begin);
+        std::vector<std::unique_ptr<MpcClient>> clients;
+        for (size_t idx = 0; idx < num_threads; ++idx)
+            clients.emplace_back(new MpcClient{completer, FLAGS_session});
+        Run(lines, clients, load_seconds);
+        return 0;
+    }
+
+    Config config;
+    config.branch_factor = static_cast<size_t>(FLAGS_branch_factor);
+    config.beam_size = static_cast<size_t>(FLAGS_beam_size);
+    config.topk = static_cast<size_t>(FLAGS_topk);
+    config.length_limit = static_cast<size_t>(FLAGS_length_limit);
+    config.mmap = FLAGS_mmap;
+    config.cache_bytes = static_cast<size_t>(FLAGS_cache_bytes);
+    config.completion_cache_bytes =
+        static_cast<size_t>(FLAGS_completion_cache_bytes);
+    config.top_arcs = FLAGS_top_arcs;
+    QueryBlazer completer{argv[1], argv[2], config};
+    if (std::string{"-"} != argv[3])
+        QBZ_ASSERT(completer.LoadPrecomputed(argv[3]),
+                   "Error loading " + std::string{argv[3]});
+    const auto load_seconds = SecondsSince(begin);
+    if (FLAGS_session) {
+        std::vector<std::unique_ptr<QueryBlazerSessionClient>> clients;
+        for (size_t idx = 0; idx < num_threads; ++idx)
+            clients.emplace_back(new QueryBlazerSessionClient{completer});
+        Run(lines, clients, load_seconds);
+    } else {
+        std::vector<std::unique_ptr<QueryBlazerClient>> clients;
+        for (size_t idx = 0; idx < num_threads; ++idx)
+            clients.emplace_back(new QueryBlazerClient{completer});
+        Run(lines, clients, load_seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_BENCH_H
+#define QUERYBLAZER_BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Read a "key: value kB" field of a /proc status file, e.g., VmRSS
+ * @return value in kB, or 0 if not available on this platform
+ */
+inline size_t ReadProcKb(const std::string &file, const std::string &key) {
+    std::ifstream ifs{file};
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.compare(0, key.size() + 1, key + ":") != 0) continue;
+        std::istringstream iss{line.substr(key.size() + 1)};
+        size_t value = 0;
+        iss >> value;
+        return value;
+    }
+    return 0;
+}
+
+/**
+ * Memory usage of this process in kB
+ * rss_anon is private heap memory, rss_file is file-backed (e.g., mapped)
+ * memory and pss counts shared pages proportionally to the number of
+ * processes sharing them
+ */
+struct MemoryUsage {
+    size_t rss, peak_rss, rss_anon, rss_file, pss;
+};
+
+inline MemoryUsage GetMemoryUsage() {
+    return MemoryUsage{ReadProcKb("/proc/self/status", "VmRSS"),
+                       ReadProcKb("/proc/self/status", "VmHWM"),
+                       ReadProcKb("/proc/self/status", "RssAnon"),
+                       ReadProcKb("/proc/self/status", "RssFile"),
+                       ReadProcKb("/proc/self/smaps_rollup", "Pss")};
+}
+
+/**
+ * Seconds elapsed since begin
+ */
+inline double SecondsSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         begin)
+        .count();
+}
+
+/**
+ * Nearest-rank percentile of sorted values
+ * @param percentile: in [0, 100]
+ */
+template <typename T>
+T Percentile(const std::vector<T> &sorted, double percentile) {
+    if (sorted.empty()) return T{};
+    const auto rank =
+        static_cast<size_t>(std::ceil(percentile / 100 * sorted.size()));
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_BENCH_H
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "bench.h"
+#include "top_arcs.h"
+#include <iostream>
+#include <random>
+
+using namespace qbz;
+
+int Usage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [NUM_STATES [BRANCH_FACTOR [EXPANSIONS]]]" << std::endl;
+    std::cerr << "\tNUM_STATES: # of synthetic model states; default 100000"
+              << std::endl;
+    std::cerr << "\tBRANCH_FACTOR: # of top arcs per state; default 30"
+              << std::endl;
+    std::cerr << "\tEXPANSIONS: # of hypotheses expanded; default 10000000"
+              << std::endl;
+    std::cerr << "Times the arc expansion loop of beam search over synthetic "
+                 "top arcs, with arcs stored as records and scanned in full "
+                 "as before, as parallel arrays scanned in full, and as "
+                 "parallel arrays scanned until the first arc out of bounds, "
+                 "and reports ns per expansion of each as JSON"
+              << std::endl;
+    return EXIT_FAILURE;
+}
+
+// hypothesis expanded: state, cost & top k bound
+struct Expansion {
+    int state;
+    float cost, bound;
+};
+
+// stands in for BeamStore::Add
+struct Added {
+    int olabel, nextstate;
+    float weight;
+};
+
+struct Report {
+    double ns_per_expansion;
+    size_t arcs_added;
+    double weight_sum;
+};
+
+/**
+ * Run expand over every expansion, in batches whose added arcs are dropped
+ * as a beam store is cleared per search
+ */
+template <typename Expand>
+Report Time(const std::vector<Expansion> &expansions, Expand expand) {
+    const size_t batch_size = 1024;
+    std::vector<Added> added;
+    added.reserve(batch_size * 64);
+    Report report{0.0, 0, 0.0};
+    const auto begin = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < expansions.size(); first += batch_size) {
+        added.clear();
+        const auto last = std::min(first + batch_size, expansions.size());
+        for (auto idx = first; idx < last; ++idx)
+            expand(expansions[idx], &added);
+        report.arcs_added += added.size();
+        for (const auto &arc : added) report.weight_sum += arc.weight;
+    }
+    report.ns_per_expansion =
+        SecondsSince(begin) * 1e9 / std::max<size_t>(expansions.size(), 1);
+    return report;
+}
+
+void Print(const std::string &name, const Report &report, bool last) {
+    std::cout << "    \"" << name << "\": {\"ns_per_expansion\": "
+              << report.ns_per_expansion
+              << ", \"arcs_added\": " << report.arcs_added << "}"
+              << (last ? "" : ",") << std::endl;
+}
+
+int main(int argc, const char **argv) {
+    if (argc > 4) return Usage(argv[0]);
+    const size_t num_states = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const size_t branch_factor = argc > 2 ? std::stoul(argv[2]) : 30;
+    const size_t num_expansions = argc > 3 ? std::stoul(argv[3]) : 10000000;
+    QBZ_ASSERT(num_states > 0 && branch_factor > 0, "Invalid arguments");
+
+    // weights grow by exponential steps, like sorted backoff costs
+    std::mt19937 rng{12345};
+    std::exponential_distribution<float> step{1.0f};
+    std::uniform_int_distribution<int> label{2, 50000};
+    std::uniform_int_distribution<int> state{0,
+                                             static_cast<int>(num_states) - 1};
+    std::vector<std::vector<TopArc>> records(num_states);
+    std::vector<TopArcList> lists(num_states);
+    for (size_t idx = 0; idx < num_states; ++idx) {
+        float weight = 0.0f;
+        for (size_t arc = 0; arc < branch_factor; ++arc) {
+            weight += step(rng);
+            records[idx].emplace_back(label(rng), label(rng), state(rng),
+                                      weight);
+        }
+        lists[idx] = TopArcList{records[idx]};
+    }
+
+    // bounds admit from none to half of the arcs of a state
+    std::uniform_real_distribution<float> cost{0.0f, 10.0f};
+    std::uniform_real_distribution<float> margin{
+        0.0f, static_cast<float>(branch_factor) / 2};
+    std::vector<Expansion> expansions(num_expansions);
+    for (auto &expansion : expansions) {
+        expansion.state = state(rng);
+        expansion.cost = cost(rng);
+        expansion.bound = expansion.cost + margin(rng);
+    }
+
+    const auto records_scan = Time(
+        expansions, [&records](const Expansion &e, std::vector<Added> *added) {
+            for (const auto &arc : records[e.state]) {
+                const auto weight = e.cost + arc.weight;
+                if (weight >= e.bound) continue;
+                added->push_back(Added{arc.olabel, arc.nextstate, weight});
+            }
+        });
+    const auto arrays_scan = Time(
+        expansions, [&lists](const Expansion &e, std::vector<Added> *added) {
+            const auto arcs = lists[e.state].View();
+            for (size_t a = 0; a < arcs.Size(); ++a) {
+                const auto weight = e.cost + arcs.Weight(a);
+                if (weight >= e.bound) continue;
+                added->push_back(
+                    Added{arcs.OLabel(a), arcs.NextState(a), weight});
+            }
+        });
+    const auto arrays_break = Time(
+        expansions, [&lists](const Expansion &e, std::vector<Added> *added) {
+            const auto arcs = lists[e.state].View();
+            for (size_t a = 0; a < arcs.Size(); ++a) {
+                const auto weight = e.cost + arcs.Weight(a);
+                if (weight >= e.bound) break;
+                added->push_back(
+                    Added{arcs.OLabel(a), arcs.NextState(a), weight});
+            }
+        });
+    QBZ_ASSERT(records_scan.arcs_added == arrays_scan.arcs_added &&
+                   records_scan.arcs_added == arrays_break.arcs_added &&
+                   records_scan.weight_sum == arrays_break.weight_sum,
+               "Expansion loops disagree");
+
+    std::cout << "{" << std::endl;
+    std::cout << "  \"num_states\": " << num_states
+              << ", \"branch_factor\": " << branch_factor
+              << ", \"expansions\": " << num_expansions << "," << std::endl;
+    std::cout << "  \"loops\": {" << std::endl;
+    Print("records_scan", records_scan, false);
+    Print("arrays_scan", arrays_scan, false);
+    Print("arrays_break", arrays_break, true);
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "bench.h"
+#include "mpc.h"
+#include "queryblazer.h"
+#include <iostream>
+#include <limits>
+#include <random>
+#include <set>
+
+DEFINE_int32(branch_factor, 30, "# of top transitions to explore per beam");
+DEFINE_int32(beam_size, 30, "# of top beams to explore per iteration");
+DEFINE_int32(topk, 10, "# of top completion candidates");
+DEFINE_int32(length_limit, 100, "maximum # of subword tokens per candidate");
+DEFINE_int32(repeat, 5, "# of runs of each benchmark; the fastest is kept");
+DEFINE_int32(max_states, 1000,
+             "maximum # of distinct states benchmarked by the slow "
+             "components: CandidateOlabels, TopArcs fills & BeamSearch");
+
+namespace qbz {
+
+/**
+ * Access to the private stages of QueryBlazer for microbenchmarks
+ */
+class ComponentBench {
+  public:
+    static ArcSpan GetTopArcs(const QueryBlazer &queryBlazer, int state) {
+        return queryBlazer.GetTopArcs(state);
+    }
+
+    static size_t BeamSearch(const QueryBlazer &queryBlazer, int state,
+                             BeamStore &store) {
+        return queryBlazer.BeamSearch(state, store).size();
+    }
+};
+
+} // namespace qbz
+
+using namespace qbz;
+
+struct Report {
+    std::string name;
+    size_t ops;
+    double ns_per_op;
+};
+
+// keeps the results of the benchmarked calls alive
+volatile size_t sink;
+
+/**
+ * Run fn, which performs ops operations, FLAGS_repeat times and keep the
+ * fastest run
+ */
+template <typename Fn>
+Report Time(const std::string &name, size_t ops, Fn fn) {
+    double best = std::numeric_limits<double>::max();
+    for (auto run = 0; run < std::max(FLAGS_repeat, 1); ++run) {
+        const auto begin = std::chrono::steady_clock::now();
+        sink = sink + fn();
+        best = std::min(best, SecondsSince(begin));
+    }
+    return Report{name, ops, best * 1e9 / std::max<size_t>(ops, 1)};
+}
+
+/**
+ * First max_size distinct values, in order of appearance
+ */
+std::vector<int> Distinct(const std::vector<int> &values, size_t max_size) {
+    std::vector<int> distinct;
+    std::set<int> seen;
+    for (const auto value : values) {
+        if (distinct.size() >= max_size) break;
+        if (seen.insert(value).second) distinct.push_back(value);
+    }
+    return distinct;
+}
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Time the components of the completion path, e.g., on a synthetic "
+        "model from qbz_generate_synthetic, and report ns per operation as "
+        "JSON\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] ENCODER MODEL PREFIX_FILE [TRIE MPC]\n"
+        "\tENCODER: LPM encoder in FST\n"
+        "\tMODEL: ngram language model in FST\n"
+        "\tPREFIX_FILE: a prefix per line\n"
+        "\tTRIE & MPC: MPC trie & completions, to also time Mpc::Complete\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc != 4 && argc != 6) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    Config config;
+    config.branch_factor = static_cast<size_t>(FLAGS_branch_factor);
+    config.beam_size = static_cast<size_t>(FLAGS_beam_size);
+    config.topk = static_cast<size_t>(FLAGS_topk);
+    config.length_limit = static_cast<size_t>(FLAGS_length_limit);
+    const QueryBlazer queryBlazer{argv[1], argv[2], config};
+    std::unique_ptr<fst::StdExpandedFst> encoder{ReadFst(argv[1], false)};
+    std::unique_ptr<fst::StdExpandedFst> model{ReadFst(argv[2], false)};
+    QBZ_ASSERT(encoder && model, "Error reading the encoder or model");
+
+    std::vector<std::string> prefixes;
+    {
+        std::ifstream ifs{argv[3]};
+        QBZ_ASSERT(ifs, "Error reading " + std::string{argv[3]});
+        std::string prefix;
+        while (std::getline(ifs, prefix))
+            if (!prefix.empty()) prefixes.push_back(prefix);
+        QBZ_ASSERT(!prefixes.empty(), "No prefix in " + std::string{argv[3]});
+    }
+
+    fst::SortedMatcher<fst::StdExpandedFst> encoderMatcher{
+        encoder.get(), fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
+    fst::SortedMatcher<fst::StdExpandedFst> modelMatcher{
+        model.get(), fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
+    const CharMap charMap{*encoder->InputSymbols()};
+    encoderMatcher.SetState(encoder->Start());
+    QBZ_ASSERT(encoderMatcher.Find(charMap.Find(SPACE)),
+               "space char not found in the encoder");
+    const auto begin_state = encoderMatcher.Value().nextstate;
+
+    std::vector<std::vector<int>> ilabels(prefixes.size());
+    size_t num_chars = 0;
+    for (size_t idx = 0; idx < prefixes.size(); ++idx) {
+        ForEachChar(prefixes[idx], [&](char32_t c) {
+            if (c == static_cast<char32_t>(' ')) c = SPACE;
+            const auto ilabel = charMap.Find(c);
+            ilabels[idx].push_back(ilabel == fst::kNoLabel ? IDX_UNK : ilabel);
+        });
+        num_chars += ilabels[idx].size();
+    }
+
+    // stable olabels & encoder state at the end of each prefix
+    std::vector<std::vector<int>> olabels(prefixes.size());
+    std::vector<int> encoder_states(prefixes.size());
+    size_t num_olabels = 0;
+    for (size_t idx = 0; idx < prefixes.size(); ++idx) {
+        olabels[idx] = Encode(*encoder, encoderMatcher, begin_state,
+                              ilabels[idx], false, &encoder_states[idx]);
+        olabels[idx].erase(
+            std::remove(olabels[idx].begin(), olabels[idx].end(), IDX_UNK),
+            olabels[idx].end());
+        num_olabels += olabels[idx].size();
+    }
+
+    // model state reached by the stable olabels of each prefix
+    std::vector<int> model_states(prefixes.size());
+    for (size_t idx = 0; idx < prefixes.size(); ++idx) {
+        auto state = model->Start();
+        for (const auto olabel : olabels[idx])
+            MakeTransitions(*model, modelMatcher, state, olabel, nullptr,
+                            &state);
+        model_states[idx] = state;
+    }
+
+    const auto max_states = static_cast<size_t>(FLAGS_max_states);
+    const auto distinct_encoder_states = Distinct(encoder_states, max_states);
+    const auto distinct_model_states = Distinct(model_states, max_states);
+    std::vector<Report> reports;
+
+    reports.push_back(Time("Encode", num_chars, [&]() {
+        size_t sum = 0;
+        int state;
+        for (const auto &labels : ilabels)
+            sum += Encode(*encoder, encoderMatcher, begin_state, labels, false,
+                          &state)
+                       .size();
+        return sum;
+    }));
+    reports.push_back(
+        Time("CandidateOlabels", distinct_encoder_states.size(), [&]() {
+            size_t sum = 0;
+            for (const auto state : distinct_encoder_states)
+                sum += CandidateOlabels(*encoder, state).size();
+            return sum;
+        }));
+    reports.push_back(Time("MakeTransitions", num_olabels, [&]() {
+        size_t sum = 0;
+        for (const auto &labels : olabels) {
+            auto state = model->Start();
+            for (const auto olabel : labels)
+                MakeTransitions(*model, modelMatcher, state, olabel, nullptr,
+                                &state);
+            sum += static_cast<size_t>(state);
+        }
+        return sum;
+    }));
+    reports.push_back(
+        Time("MakeExitTransitions/encoder", encoder_states.size(), [&]() {
+            size_t sum = 0;
+            std::vector<int> exit_olabels;
+            for (const auto state : encoder_states) {
+                exit_olabels.clear();
+                MakeExitTransitions(*encoder, encoderMatcher, state,
+                                    &exit_olabels);
+                sum += exit_olabels.size();
+            }
+            return sum;
+        }));
+    reports.push_back(
+        Time("MakeExitTransitions/model", model_states.size(), [&]() {
+            float sum = 0.0f;
+            for (const auto state : model_states)
+                sum += MakeExitTransitions(*model, modelMatcher, state);
+            return static_cast<size_t>(sum);
+        }));
+    reports.push_back(
+        Time("TopArcs/fill", distinct_model_states.size(), [&]() {
+            size_t sum = 0;
+            for (const auto state : distinct_model_states)
+                sum += TopArcs<TopArc>(*model, state, config.branch_factor)
+                           .size();
+            return sum;
+        }));
+    reports.push_back(Time("GetTopArcs", model_states.size(), [&]() {
+        size_t sum = 0;
+        for (const auto state : model_states)
+            sum += ComponentBench::GetTopArcs(queryBlazer, state).Size();
+        return sum;
+    }));
+    reports.push_back(
+        Time("BeamSearch", distinct_model_states.size(), [&]() {
+            size_t sum = 0;
+            BeamStore store;
+            for (const auto state : distinct_model_states)
+                sum += ComponentBench::BeamSearch(queryBlazer, state, store);
+            return sum;
+        }));
+
+    // costs of the arcs expanded in a search step
+    std::mt19937 rng{12345};
+    std::exponential_distribution<float> step{1.0f};
+    const auto step_size = config.beam_size * config.branch_factor;
+    std::vector<float> costs(step_size * 1000);
+    for (auto &cost : costs) cost = step(rng) * 10;
+    reports.push_back(Time("TopK::Insert", costs.size(), [&]() {
+        size_t sum = 0;
+        TopK<float> topK{config.topk};
+        for (size_t first = 0; first < costs.size(); first += step_size) {
+            topK.Clear();
+            for (auto idx = first; idx < first + step_size; ++idx)
+                sum += topK.Insert(costs[idx]);
+        }
+        return sum;
+    }));
+
+    if (argc == 6) {
+        const Mpc mpc{argv[4], argv[5]};
+        reports.push_back(Time("Mpc::Complete", prefixes.size(), [&]() {
+            size_t sum = 0;
+            for (const auto &prefix : prefixes)
+                sum += mpc.Complete(prefix).size();
+            return sum;
+        }));
+    }
+
+    std::cout << "{" << std::endl;
+    std::cout << "  \"prefixes\": " << prefixes.size()
+              << ", \"chars\": " << num_chars
+              << ", \"model_states\": " << model->NumStates()
+              << ", \"distinct_model_states\": "
+              << distinct_model_states.size() << "," << std::endl;
+    std::cout << "  \"components\": {" << std::endl;
+    for (size_t idx = 0; idx < reports.size(); ++idx) {
+        const auto &report = reports[idx];
+        std::cout << "    \"" << report.name << "\": {\"ops\": " << report.ops
+                  << ", \"ns_per_op\": " << report.ns_per_op << "}"
+                  << (idx + 1 < reports.size() ? "," : "") << std::endl;
+    }
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+    return 0;
+}
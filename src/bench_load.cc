@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "bench.h"
+#include "queryblazer.h"
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace qbz;
+
+int Usage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " ENCODER MODEL PRECOMPUTED NUM_PROCESSES MODE" << std::endl;
+    std::cerr << "\tENCODER: LPM encoder in FST" << std::endl;
+    std::cerr << "\tMODEL: ngram language model in FST" << std::endl;
+    std::cerr << "\tPRECOMPUTED: precomputed file; use '-' if not available"
+              << std::endl;
+    std::cerr << "\tNUM_PROCESSES: number of worker processes loading the "
+                 "model at the same time"
+              << std::endl;
+    std::cerr << "\tMODE: read to read the model into the heap, or mmap to "
+                 "memory-map it"
+              << std::endl;
+    std::cerr << "Loads the model in NUM_PROCESSES worker processes and "
+                 "reports load time & memory usage as JSON; run each mode in "
+                 "its own invocation after dropping the page cache to compare "
+                 "cold starts"
+              << std::endl;
+    return EXIT_FAILURE;
+}
+
+struct WorkerReport {
+    double load_seconds;
+    MemoryUsage memory;
+};
+
+/**
+ * Load the model, signal the parent, wait until every worker is loaded and
+ * report; workers stay alive together so that shared pages are accounted
+ * for in pss
+ */
+void RunWorker(const char **argv, bool mmap, int report_fd, int barrier_fd) {
+    WorkerReport report;
+    const auto begin = std::chrono::steady_clock::now();
+    Config config;
+    config.mmap = mmap;
+    QueryBlazer queryBlazer{argv[1], argv[2], config};
+    if (std::string{"-"} != argv[3])
+        QBZ_ASSERT(queryBlazer.LoadPrecomputed(argv[3]),
+                   "Error loading " + std::string{argv[3]});
+    queryBlazer.Complete("a");
+    report.load_seconds = SecondsSince(begin);
+
+    char token = 0;
+    QBZ_ASSERT(write(report_fd, &token, 1) == 1, "pipe error");
+    QBZ_ASSERT(read(barrier_fd, &token, 1) == 1, "pipe error");
+    report.memory = GetMemoryUsage();
+    QBZ_ASSERT(write(report_fd, &report, sizeof report) == sizeof report,
+               "pipe error");
+}
+
+/**
+ * Read size bytes written by a worker, failing if a worker exits with an
+ * error first; the other workers hold the write end, so the pipe would never
+ * see EOF and a plain read would block forever
+ */
+void ReadFromWorkers(int fd, void *data, size_t size,
+                     const std::vector<pid_t> &pids) {
+    pollfd pfd{fd, POLLIN, 0};
+    while (true) {
+        const auto ready = poll(&pfd, 1, 100);
+        QBZ_ASSERT(ready >= 0 || errno == EINTR, "poll error");
+        if (ready > 0) {
+            QBZ_ASSERT(read(fd, data, size) == static_cast<ssize_t>(size),
+                       "worker failed");
+            return;
+        }
+        int status;
+        while (waitpid(-1, &status, WNOHANG) > 0) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+                continue;
+            for (const auto pid : pids) kill(pid, SIGKILL);
+            while (wait(nullptr) > 0) {}
+            QBZ_ASSERT(false, "worker failed");
+        }
+    }
+}
+
+void Run(const char **argv, bool mmap, int num_processes) {
+    int report_pipe[2], barrier_pipe[2];
+    QBZ_ASSERT(pipe(report_pipe) == 0 && pipe(barrier_pipe) == 0,
+               "pipe error");
+
+    std::vector<pid_t> pids;
+    for (auto idx = 0; idx < num_processes; ++idx) {
+        const auto pid = fork();
+        QBZ_ASSERT(pid >= 0, "fork error");
+        pids.push_back(pid);
+        if (pid == 0) {
+            close(report_pipe[0]);
+            close(barrier_pipe[1]);
+            auto status = EXIT_SUCCESS;
+            try {
+                RunWorker(argv, mmap, report_pipe[1], barrier_pipe[0]);
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                status = EXIT_FAILURE;
+            }
+            _exit(status);
+        }
+    }
+    close(report_pipe[1]);
+    close(barrier_pipe[0]);
+
+    char token = 0;
+    for (auto idx = 0; idx < num_processes; ++idx)
+        ReadFromWorkers(report_pipe[0], &token, 1, pids);
+    for (auto idx = 0; idx < num_processes; ++idx)
+        QBZ_ASSERT(write(barrier_pipe[1], &token, 1) == 1, "pipe error");
+
+    double max_load_seconds = 0.0, total_load_seconds = 0.0;
+    MemoryUsage total{0, 0, 0, 0, 0};
+    for (auto idx = 0; idx < num_processes; ++idx) {
+        WorkerReport report;
+        ReadFromWorkers(report_pipe[0], &report, sizeof report, pids);
+        max_load_seconds = std::max(max_load_seconds, report.load_seconds);
+        total_load_seconds += report.load_seconds;
+        total.rss += report.memory.rss;
+        total.rss_anon += report.memory.rss_anon;
+        total.rss_file += report.memory.rss_file;
+        total.pss += report.memory.pss;
+    }
+    while (wait(nullptr) > 0) {}
+    close(report_pipe[0]);
+    close(barrier_pipe[1]);
+
+    std::cout << "{\"mode\": \"" << (mmap ? "mmap" : "read")
+              << "\", \"processes\": " << num_processes
+              << ", \"mean_load_seconds\": "
+              << total_load_seconds / num_processes
+              << ", \"max_load_seconds\": " << max_load_seconds
+              << ", \"mean_rss_kb\": " << total.rss / num_processes
+              << ", \"mean_rss_anon_kb\": " << total.rss_anon / num_processes
+              << ", \"mean_rss_file_kb\": " << total.rss_file / num_processes
+              << ", \"total_pss_kb\": " << total.pss << "}" << std::endl;
+}
+
+int main(int argc, const char **argv) {
+    if (argc != 6) return Usage(argv[0]);
+    const auto num_processes = std::stoi(argv[4]);
+    QBZ_ASSERT(num_processes > 0, "NUM_PROCESSES must be positive");
+    const std::string mode{argv[5]};
+    QBZ_ASSERT(mode == "read" || mode == "mmap",
+               "MODE must be read or mmap");
+
+    // modes are not run back to back, or the second would find the model
+    // in the page cache the first warmed
+    Run(argv, mode == "mmap", num_processes);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_BUDGET_H
+#define QUERYBLAZER_BUDGET_H
+
+#include <chrono>
+#include <cstddef>
+
+namespace qbz {
+
+/**
+ * Counters of completions run within a budget
+ */
+struct BudgetStats {
+    // completions given a budget
+    size_t calls;
+    // completions that ran out of budget and returned partial results
+    size_t partial_calls;
+    // beam searches run on demand within a budget
+    size_t searches;
+    // beam searches stopped by the budget
+    size_t stopped_searches;
+};
+
+/**
+ * Time & expansion budget of a single completion, shared by the beam
+ * searches it runs on demand
+ * Once the budget is exhausted, searches stop where they are and keep the
+ * best completions found so far. Not thread-safe.
+ */
+class SearchBudget {
+  public:
+    /**
+     * Start a new budget from now
+     * @param time: wall time; zero for no limit
+     * @param expansions: # of hypotheses to expand; 0 for no limit
+     */
+    void Start(std::chrono::microseconds time, size_t expansions) {
+        timed = time.count() > 0;
+        deadline = std::chrono::steady_clock::now() + time;
+        expansions_left = expansions;
+        counted = expansions > 0;
+        spent = 0;
+        exhausted = false;
+    }
+
+    /**
+     * Remove all limits
+     */
+    void Disable() { Start(std::chrono::microseconds{0}, 0); }
+
+    bool Enabled() const { return timed || counted; }
+
+    bool Exhausted() const { return exhausted; }
+
+    /**
+     * Charge one expansion
+     * @return false if the budget is exhausted
+     */
+    bool Spend() {
+        if (exhausted) return false;
+        if (counted && expansions_left-- == 0) {
+            exhausted = true;
+        } else if (timed && spent++ % CLOCK_INTERVAL == 0 &&
+                   std::chrono::steady_clock::now() >= deadline) {
+            // the clock is read every few expansions only, as reading it
+            // costs about as much as an expansion
+            exhausted = true;
+        }
+        return !exhausted;
+    }
+
+  private:
+    static constexpr size_t CLOCK_INTERVAL = 16;
+
+    bool timed = false;
+    bool counted = false;
+    bool exhausted = false;
+    std::chrono::steady_clock::time_point deadline;
+    size_t expansions_left = 0;
+    size_t spent = 0;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_BUDGET_H
@@ -11,6 +11,7 @@
 #include "common.h"
 #include "encoder.h"
 #include "fst/fstlib.h"
+#include "mapped_file.h"
 #include "matcher.h"
 #include "transition.h"
 
@@ -42,125 +43,16 @@ std::vector<std::string> ReadVocabulary(const std::string &vocab_file) {
     return {vocabulary.begin(), vocabulary.end()};
 }
 
-void AddToken(fst::StdVectorFst *graph, const std::string &token, const Utf8 &utoken) {
-    auto src = graph->Start();
-    for (auto c : utoken) {
-        auto dst = graph->AddState();
-        graph->AddArc(src, fst::StdArc(graph->InputSymbols()->Find(ToString({c})),
-                                       IDX_EPSILON,
-                                       dst));
-        src = dst;
-    }
-    graph->AddArc(src, fst::StdArc(IDX_PHI,
-                                   graph->OutputSymbols()->Find(token),
-                                   graph->Start()));
-}
-
-void AddPhiTransitions(fst::StdVectorFst *graph) {
-    struct TraverseState {
-        explicit TraverseState(int state, int prev_state, int olabel = IDX_EPSILON) :
-                state{state}, prev_state{prev_state}, ilabel{olabel} {}
-
-        int state; // current state
-        int prev_state; // previous state (which must have transitions to every ilabel)
-        int ilabel; // ilabel from prev_state to state
-    };
-    std::set<int> visitedStates;
-    std::queue<TraverseState> queue;
-    queue.emplace(graph->Start(), graph->Start());
-    // use unsorted matcher (linear search)
-    UnsortedMatcher<fst::StdFst> matcher{graph};
-    while (!queue.empty()) {
-        auto traverseState = queue.front();
-        queue.pop();
-
-        const auto state = traverseState.state;
-        const auto prev_state = traverseState.prev_state;
-        const auto ilabel = traverseState.ilabel;
-
-        QBZ_ASSERT(visitedStates.find(state) == visitedStates.end(),
-                   "state " + std::to_string(state) + " visited again");
-        visitedStates.insert(state);
-
-        auto to_add_phi = state != graph->Start(); // no need to add phi at start state
-        fst::ArcIterator<fst::StdVectorFst> aiter{*graph, state};
-        for (; !aiter.Done(); aiter.Next()) {
-            const auto &arc = aiter.Value();
-            if (arc.ilabel == IDX_PHI) {
-                to_add_phi = false;
-                continue;
-            }
-            if (arc.nextstate == graph->Start()) continue;
-            queue.emplace(arc.nextstate, state, arc.ilabel);
-        }
-
-        if (to_add_phi) {
-            // take phi transition from previous state and append olabel
-            std::vector<int> olabels;
-            int dest;
-            MakeTransitions(*graph, matcher, prev_state, IDX_PHI, &olabels, &dest);
-            MakeTransitions(*graph, matcher, dest, ilabel, &olabels, &dest);
-            // create extra states if olabels is more than 1
-            auto s = state;
-            for (auto idx = 0; idx < olabels.size() - 1; ++idx) {
-                auto temp = graph->AddState();
-                graph->AddArc(s, fst::StdArc(IDX_PHI, olabels.at(idx), temp));
-                s = temp;
-            }
-            graph->AddArc(s, fst::StdArc(IDX_PHI, olabels.back(), dest));
-        }
-    }
-
-    fst::Minimize(graph);
-    fst::ArcSort(graph, fst::ILabelCompare<fst::StdArc>{});
-}
-
-void BuildPrefixTree(fst::StdVectorFst *graph,
-                     const std::vector<std::string> &vocab,
-                     const std::vector<Utf8> &utf8_vocab) {
-    for (auto i = 0; i < vocab.size(); ++i) {
-        AddToken(graph, vocab.at(i), utf8_vocab.at(i));
-    }
-
-    fst::Determinize(*graph, graph);
-    fst::ArcSort(graph, fst::ILabelCompare<fst::StdArc>{});
-}
-
 int main(int argc, const char **argv) {
     std::ios::sync_with_stdio(false);
     if (argc != 3) return Usage(argv[0]);
     auto vocabulary = ReadVocabulary(argv[1]);
 
-    auto isymtable = new fst::SymbolTable;
-    for (const auto &symbol : DEFAULT_SYMBOLS)
-        isymtable->AddSymbol(symbol);
-    auto osymtable = isymtable->Copy();
-
-    for (const auto &token : vocabulary)
-        osymtable->AddSymbol(token);
-
-    std::vector<Utf8> utf8_vocab;
-    utf8_vocab.reserve(vocabulary.size());
-    for (const auto &token : vocabulary)
-        utf8_vocab.push_back(ToUtf8(token));
-
-    auto characters = ExtractCharacters(utf8_vocab.begin(), utf8_vocab.end());
-    for (auto c : characters)
-        isymtable->AddSymbol(ToString({c}));
-
     fst::StdVectorFst encoder;
-    encoder.SetInputSymbols(isymtable);
-    encoder.SetOutputSymbols(osymtable);
-    encoder.SetStart(encoder.AddState());
-    encoder.SetFinal(encoder.Start());
-
-    BuildPrefixTree(&encoder, vocabulary, utf8_vocab);
-    AddPhiTransitions(&encoder);
+    BuildEncoder(vocabulary, &encoder);
 
     fst::StdConstFst const_encoder{encoder}; // convert to const fst for faster speed
-    QBZ_ASSERT(const_encoder.Write(argv[2]), "Write to " + std::string{argv[2]} + "failed");
-
-    delete isymtable;
-    delete osymtable;
+    // aligned so that it can be memory-mapped
+    QBZ_ASSERT(WriteAlignedFst(const_encoder, argv[2]), "Write to " + std::string{argv[2]} + "failed");
     return 0;
 }
@@ -8,25 +8,119 @@
 
 #include "queryblazer.h"
 
-using namespace qbz;
-
-int Usage(const char *program) {
-    std::cerr << "Usage: " << program << " ENCODER LM PRECOMPUTED" << std::endl;
-    std::cerr << "\tENCODER: subword encoder FST" << std::endl;
-    std::cerr << "\tLM: subword language model FST build from the query log"
-              << std::endl;
-    std::cerr << "\tPRECOMPUTED: beam search result output" << std::endl;
+DEFINE_int32(branch_factor, 30, "# of top transitions to explore per beam");
+DEFINE_int32(beam_size, 30, "# of top beams to explore per iteration");
+DEFINE_int32(topk, 10, "# of top completion candidates");
+DEFINE_int32(length_limit, 100, "maximum # of subword tokens per candidate");
+DEFINE_int32(threads, 0, "# of precompute threads; 0 for all cores");
+DEFINE_double(beam_gap, 0,
+              "drop hypotheses costing more than the best of their step plus "
+              "this gap; 0 disables");
+DEFINE_int32(stable_steps, 0,
+             "stop a search once its top k have not changed for this many "
+             "steps; 0 disables");
+DEFINE_string(top_arcs, "",
+              "top arc file of LM built by qbz_build_top_arcs with the same "
+              "--branch_factor; read instead of resolving backoffs per state");
+DEFINE_string(prefix_file, "",
+              "prefix log; if given, only the states reached by the prefixes "
+              "are precomputed, most frequent first");
+DEFINE_double(max_megabytes, 1024,
+              "size budget of the precomputed file with --prefix_file, "
+              "including 12 bytes per model state");
+DEFINE_string(shard_dir, "",
+              "if given, results are written to resumable shards in this "
+              "directory as they are done, and merged at the end");
+DEFINE_int64(states_per_shard, 1 << 18, "# of model states per shard");
+DEFINE_int32(shard_count, 1,
+             "# of processes splitting the model states; if more than 1, "
+             "PRECOMPUTED is a partial file of this process's slice, to be "
+             "merged with qbz_merge_precomputed");
+DEFINE_int32(shard_index, 0, "slice of this process, in [0, shard_count)");
+DEFINE_string(old_model, "",
+              "previous LM; with --old_precomputed, only the states whose "
+              "results may differ from the old ones are recomputed");
+DEFINE_string(old_precomputed, "", "flat precomputed file of --old_model");
 
-    return EXIT_FAILURE;
-}
+using namespace qbz;
 
-int main(int argc, const char **argv) {
-    if (argc != 4) return Usage(argv[0]);
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Precompute beam search results\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] ENCODER LM PRECOMPUTED\n"
+        "\tENCODER: subword encoder FST\n"
+        "\tLM: subword language model FST build from the query log\n"
+        "\tPRECOMPUTED: beam search result output\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc != 4) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    const auto partial = !FLAGS_prefix_file.empty();
+    const auto incremental = !FLAGS_old_model.empty();
+    QBZ_ASSERT(incremental == !FLAGS_old_precomputed.empty(),
+               "--old_model and --old_precomputed must be given together");
+    const auto sliced = FLAGS_shard_count > 1;
+    const auto sharded = !FLAGS_shard_dir.empty() || sliced;
+    QBZ_ASSERT(partial + sharded + incremental <= 1,
+               "--prefix_file, --old_model and sharding flags cannot be "
+               "combined");
+    QBZ_ASSERT(FLAGS_shard_count > 0 && FLAGS_shard_index >= 0 &&
+                   FLAGS_shard_index < FLAGS_shard_count,
+               "--shard_index must be in [0, --shard_count)");
 
-    Config config{30,  30,   10,
-                  100, true, false}; // TODO: get config from user input
+    Config config;
+    config.branch_factor = static_cast<size_t>(FLAGS_branch_factor);
+    config.beam_size = static_cast<size_t>(FLAGS_beam_size);
+    config.topk = static_cast<size_t>(FLAGS_topk);
+    config.length_limit = static_cast<size_t>(FLAGS_length_limit);
+    config.precompute = !partial && !sharded && !incremental;
+    config.num_threads = static_cast<size_t>(FLAGS_threads);
+    config.top_arcs = FLAGS_top_arcs;
+    config.beam_gap = static_cast<float>(FLAGS_beam_gap);
+    config.stable_steps = static_cast<size_t>(FLAGS_stable_steps);
+    if (!FLAGS_top_arcs.empty())
+        QBZ_ASSERT(TopArcTable{FLAGS_top_arcs}.ModelChecksum() ==
+                       FileChecksum(argv[2]),
+                   FLAGS_top_arcs + " was built from a different model");
     QueryBlazer queryBlazer{argv[1], argv[2], config};
-    QBZ_ASSERT(queryBlazer.SavePrecomputed(argv[3]), "Precomputation failed");
+    if (partial) {
+        const auto max_bytes =
+            static_cast<size_t>(FLAGS_max_megabytes * 1024 * 1024);
+        queryBlazer.PrecomputeFromLog(FLAGS_prefix_file, max_bytes, argv[3]);
+    } else if (incremental) {
+        queryBlazer.PrecomputeIncremental(FLAGS_old_model,
+                                          FLAGS_old_precomputed, argv[3]);
+    } else if (sharded) {
+        const std::string output{argv[3]};
+        const auto shard_dir =
+            FLAGS_shard_dir.empty() ? output + ".shards" : FLAGS_shard_dir;
+        const auto slice = ShardSlice(
+            queryBlazer.NumModelStates(),
+            static_cast<size_t>(FLAGS_shard_index),
+            static_cast<size_t>(FLAGS_shard_count));
+        queryBlazer.PrecomputeShards(
+            shard_dir, FileChecksum(argv[2]),
+            static_cast<size_t>(FLAGS_states_per_shard), slice.first,
+            slice.second);
+
+        // the shard dir may hold other slices' shards when shared
+        std::vector<std::string> files;
+        for (const auto &file : ListShards(shard_dir)) {
+            const auto header = Shard{file}.Header();
+            if (header.begin >= slice.first && header.end <= slice.second)
+                files.push_back(file);
+        }
+        if (sliced)
+            CombineShards(files, output);
+        else
+            MergeShards(files, output);
+    } else {
+        QBZ_ASSERT(queryBlazer.SavePrecomputed(argv[3]),
+                   "Precomputation failed");
+    }
 
     return 0;
-}
\ No newline at end of file
+}
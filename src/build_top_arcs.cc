@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "top_arcs.h"
+#include <iostream>
+
+DEFINE_int32(branch_factor, 30, "# of top transitions per state");
+DEFINE_int32(threads, 0, "# of threads; 0 for all cores");
+
+using namespace qbz;
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Precompile the phi-resolved top arcs & exit cost of every model "
+        "state\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] LM TOP_ARCS\n"
+        "\tLM: subword language model FST\n"
+        "\tTOP_ARCS: top arc file output, to be set as the top_arcs config "
+        "with the same branch_factor\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc != 3) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<fst::StdExpandedFst> model{ReadFst(argv[1], false)};
+    QBZ_ASSERT(model, "Invalid model: " + std::string{argv[1]});
+    WriteTopArcs(*model, static_cast<size_t>(FLAGS_branch_factor),
+                 FileChecksum(argv[1]), FileSize(argv[1]), argv[2],
+                 static_cast<size_t>(FLAGS_threads));
+
+    const TopArcTable table{argv[2]};
+    const MappedFile mapped{argv[2]};
+    std::cout << argv[2] << ": " << table.NumStates() << " states, "
+              << mapped.Size() << " bytes" << std::endl;
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_CACHE_H
+#define QUERYBLAZER_CACHE_H
+
+#include "common.h"
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace qbz {
+
+/**
+ * Cache counters, summed over shards
+ */
+struct CacheStats {
+    // lookups served from the cache
+    size_t hits;
+    // lookups that computed the value
+    size_t misses;
+    // lookups that waited for a concurrent computation of the same key
+    size_t coalesced;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+/**
+ * Thread-safe LRU cache bounded by a byte budget
+ * Keys are spread over shards, each with its own lock & an equal share of the
+ * budget, so that concurrent lookups rarely contend.
+ * Values are handed out as shared pointers, so an evicted value stays valid
+ * for as long as a reader holds it.
+ * GetOrCompute coalesces concurrent misses on the same key, so that a value
+ * is computed only once while other callers wait for it.
+ * Reset and Clear are not thread-safe.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+  public:
+    using Pointer = std::shared_ptr<const Value>;
+
+    /**
+     * @param max_bytes: total budget; 0 disables the cache
+     * @param num_shards: number of independently locked shards
+     */
+    explicit LruCache(size_t max_bytes = 0, size_t num_shards = 16) {
+        Reset(max_bytes, num_shards);
+    }
+
+    LruCache(const LruCache &) = delete;
+
+    LruCache &operator=(const LruCache &) = delete;
+
+    /**
+     * Drop all values and change the budget
+     */
+    void Reset(size_t max_bytes, size_t num_shards = 16) {
+        QBZ_ASSERT(num_shards > 0, "Number of shards must be positive");
+        this->max_bytes = max_bytes;
+        this->num_shards = num_shards;
+        shards.reset(new Shard[num_shards]);
+    }
+
+    void Clear() { Reset(max_bytes, num_shards); }
+
+    bool Enabled() const { return max_bytes > 0; }
+
+    size_t MaxBytes() const { return max_bytes; }
+
+    /**
+     * Bytes currently held, as reported on insertion
+     */
+    size_t Bytes() const { return Stats().bytes; }
+
+    CacheStats Stats() const {
+        CacheStats stats{0, 0, 0, 0, 0, 0};
+        for (size_t idx = 0; idx < num_shards; ++idx) {
+            const auto &shard = shards[idx];
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            stats.hits += shard.stats.hits;
+            stats.misses += shard.stats.misses;
+            stats.coalesced += shard.stats.coalesced;
+            stats.evictions += shard.stats.evictions;
+            stats.entries += shard.index.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+    /**
+     * @return cached value, marked as most recently used, or nullptr
+     */
+    Pointer Find(const Key &key) {
+        auto &shard = GetShard(key);
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        const auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            ++shard.stats.misses;
+            return nullptr;
+        }
+        ++shard.stats.hits;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return it->second->value;
+    }
+
+    /**
+     * Return the cached value or compute & insert it
+     * If another thread is already computing the key, wait for its value
+     * instead; an exception thrown by compute is rethrown to every waiter
+     * @param compute: returns Value
+     * @param bytes: returns memory held by a Value
+     */
+    template <typename Compute, typename Bytes>
+    Pointer GetOrCompute(const Key &key, Compute compute, Bytes bytes) {
+        auto &shard = GetShard(key);
+        std::promise<Pointer> promise;
+        {
+            std::unique_lock<std::mutex> lock{shard.mutex};
+            const auto it = shard.index.find(key);
+            if (it != shard.index.end()) {
+                ++shard.stats.hits;
+                shard.entries.splice(shard.entries.begin(), shard.entries,
+                                     it->second);
+                return it->second->value;
+            }
+            const auto pending = shard.pending.find(key);
+            if (pending != shard.pending.end()) {
+                ++shard.stats.coalesced;
+                const auto future = pending->second;
+                lock.unlock();
+                return future.get();
+            }
+            ++shard.stats.misses;
+            shard.pending.emplace(key, promise.get_future().share());
+        }
+
+        Pointer value;
+        try {
+            value = std::make_shared<const Value>(compute());
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock{shard.mutex};
+                shard.pending.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            InsertLocked(shard, key, value, bytes(*value));
+            shard.pending.erase(key);
+        }
+        promise.set_value(value);
+        return value;
+    }
+
+    /**
+     * Insert or replace a value, evicting least recently used values of the
+     * shard until it fits; values larger than a shard's budget are not kept
+     * @param bytes: memory held by the value
+     */
+    void Insert(const Key &key, Pointer value, size_t bytes) {
+        auto &shard = GetShard(key);
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        InsertLocked(shard, key, std::move(value), bytes);
+    }
+
+  private:
+    struct Entry {
+        Key key;
+        Pointer value;
+        size_t bytes;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // most recently used first
+        std::list<Entry> entries;
+        std::unordered_map<Key, typename std::list<Entry>::iterator, Hash>
+            index;
+        // keys being computed by GetOrCompute
+        std::unordered_map<Key, std::shared_future<Pointer>, Hash> pending;
+        size_t bytes = 0;
+        CacheStats stats{0, 0, 0, 0, 0, 0};
+    };
+
+    Shard &GetShard(const Key &key) const {
+        return shards[Hash{}(key) % num_shards];
+    }
+
+    void InsertLocked(Shard &shard, const Key &key, Pointer value,
+                      size_t bytes) {
+        const auto shard_bytes = max_bytes / num_shards;
+        const auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            shard.bytes -= it->second->bytes;
+            shard.entries.erase(it->second);
+            shard.index.erase(it);
+        }
+        if (bytes > shard_bytes) return;
+
+        while (shard.bytes + bytes > shard_bytes) {
+            const auto &last = shard.entries.back();
+            shard.bytes -= last.bytes;
+            shard.index.erase(last.key);
+            shard.entries.pop_back();
+            ++shard.stats.evictions;
+        }
+        shard.entries.push_front(Entry{key, std::move(value), bytes});
+        shard.index.emplace(key, shard.entries.begin());
+        shard.bytes += bytes;
+    }
+
+    size_t max_bytes;
+    size_t num_shards;
+    std::unique_ptr<Shard[]> shards;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_CACHE_H
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_CHARMAP_H
+#define QUERYBLAZER_CHARMAP_H
+
+#include "common.h"
+#include "fst/fstlib.h"
+#include <unordered_map>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Code point to ilabel lookup built from a character symbol table, so that
+ * the hot path does not need to build & hash a string per character
+ * Code points in the BMP are looked up in a dense array sized to the largest
+ * BMP character in the table; the rest go to a hash map
+ */
+class CharMap {
+  public:
+    CharMap() = default;
+
+    explicit CharMap(const fst::SymbolTable &symbols) {
+        std::vector<std::pair<char32_t, int>> chars;
+        char32_t max_dense = 0;
+        for (fst::SymbolTableIterator siter{symbols}; !siter.Done();
+             siter.Next()) {
+            // special symbols & multi-character tokens are not characters
+            const auto symbol = ToUtf8(siter.Symbol());
+            if (symbol.size() != 1) continue;
+            const auto c = symbol.front();
+            chars.emplace_back(c, static_cast<int>(siter.Value()));
+            if (c < MAX_DENSE) max_dense = std::max(max_dense, c);
+        }
+
+        dense.assign(chars.empty() ? 0 : max_dense + 1, fst::kNoLabel);
+        for (const auto &pair : chars) {
+            if (pair.first < dense.size())
+                dense[pair.first] = pair.second;
+            else
+                sparse.emplace(pair.first, pair.second);
+        }
+    }
+
+    /**
+     * @return ilabel of the character or fst::kNoLabel if not found
+     */
+    int Find(char32_t c) const {
+        if (c < dense.size()) return dense[c];
+        const auto it = sparse.find(c);
+        return it == sparse.end() ? fst::kNoLabel : it->second;
+    }
+
+  private:
+    static constexpr char32_t MAX_DENSE = 0x10000;
+
+    std::vector<int> dense;
+    std::unordered_map<char32_t, int> sparse;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_CHARMAP_H
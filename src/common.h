@@ -10,6 +10,8 @@
 
 #include "fst/fstlib.h"
 #include "utf8.h"
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
 #include <queue>
 #include <stdexcept>
@@ -95,6 +97,45 @@ Utf8 ToUtf8(const std::string &input) {
     return output;
 }
 
+/**
+ * Call fn(c) on each code point of input without building a Utf8 vector
+ * Pure ASCII input, the common case for queries, is decoded byte by byte
+ */
+template <typename Fn>
+void ForEachChar(const std::string &input, Fn fn) {
+    const auto ascii = std::all_of(input.begin(), input.end(), [](char c) {
+        return (static_cast<unsigned char>(c) & 0x80) == 0;
+    });
+    if (ascii) {
+        for (auto c : input) fn(static_cast<char32_t>(c));
+        return;
+    }
+
+    QBZ_ASSERT(utf8::find_invalid(input.begin(), input.end()) == input.end(),
+               "Invalid UTF8 string: " + input);
+    for (auto it = input.begin(); it != input.end();)
+        fn(static_cast<char32_t>(utf8::unchecked::next(it)));
+}
+
+/**
+ * Append input to output, dropping leading white spaces and merging
+ * consecutive ones into a single ' ', as Join(Split(...)) would
+ * @param space: whether a white space is pending; pass the same flag over
+ * consecutive calls for the same output
+ */
+inline void AppendMergingSpaces(const std::string &input, std::string *output,
+                                bool *space) {
+    for (auto c : input) {
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            *space = true;
+            continue;
+        }
+        if (*space && !output->empty()) output->push_back(' ');
+        *space = false;
+        output->push_back(c);
+    }
+}
+
 std::string ToString(const Utf8 &input) {
     std::string output(input.size() * sizeof(*input.data()), '\0');
     auto it = &output.at(0);
@@ -103,6 +144,35 @@ std::string ToString(const Utf8 &input) {
     return output;
 }
 
+/**
+ * Non-owning view over a contiguous array
+ */
+template <typename T>
+class Span {
+  public:
+    Span() : first{nullptr}, size{0} {}
+
+    Span(const T *first, size_t size) : first{first}, size{size} {}
+
+    Span(const std::vector<T> &values)
+        : first{values.data()},
+          size{values.size()} {}
+
+    const T *begin() const { return first; }
+
+    const T *end() const { return first + size; }
+
+    size_t Size() const { return size; }
+
+    bool Empty() const { return size == 0; }
+
+    const T &operator[](size_t idx) const { return first[idx]; }
+
+  private:
+    const T *first;
+    size_t size;
+};
+
 /**
  * Simple container holding top k, defined by compare
  * @tparam Value
@@ -121,9 +191,13 @@ class TopK {
      * @return true if value is within top k; else return false
      */
     bool Insert(Value value) {
-        if (queue.size() < k || compare(value, queue.top())) {
-            queue.push(std::move(value));
-            if (queue.size() > k) queue.pop();
+        if (heap.size() < k || compare(value, heap.front())) {
+            heap.push_back(std::move(value));
+            std::push_heap(heap.begin(), heap.end(), compare);
+            if (heap.size() > k) {
+                std::pop_heap(heap.begin(), heap.end(), compare);
+                heap.pop_back();
+            }
             return true;
         }
         return false;
@@ -134,14 +208,20 @@ class TopK {
      * @param value
      * @return
      */
-    bool WillInsert(const Value &value) {
-        return queue.size() < k || compare(value, queue.top());
+    bool WillInsert(const Value &value) const {
+        return heap.size() < k || compare(value, heap.front());
     }
 
+    /**
+     * Remove all values but keep the allocated memory for reuse
+     */
+    void Clear() { heap.clear(); }
+
   private:
     const size_t k;
     Compare compare;
-    std::priority_queue<Value, std::vector<Value>, Compare> queue;
+    // max-heap by compare, i.e., worst of top k at the front
+    std::vector<Value> heap;
 };
 
 } // namespace qbz
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "precomputed.h"
+#include <iostream>
+
+using namespace qbz;
+
+int Usage(const char *program) {
+    std::cerr << "Usage: " << program << " INPUT OUTPUT COST_BITS"
+              << std::endl;
+    std::cerr << "\tINPUT: precomputed file" << std::endl;
+    std::cerr << "\tOUTPUT: compressed precomputed file" << std::endl;
+    std::cerr << "\tCOST_BITS: 8 or 16 bits per quantized cost" << std::endl;
+    std::cerr << "Compresses a precomputed file, verifies it against the "
+                 "input and reports sizes & cost quantization error"
+              << std::endl;
+    return EXIT_FAILURE;
+}
+
+void Report(const std::string &name, const PrecomputedStats &stats) {
+    std::cout << name << ": version " << stats.version << ", "
+              << stats.cost_bits << "-bit costs, " << stats.num_states
+              << " states, " << stats.num_candidates << " candidates, "
+              << stats.num_olabels << " olabels, " << stats.file_bytes
+              << " bytes ("
+              << static_cast<double>(stats.file_bytes) /
+                     std::max<uint64_t>(stats.num_states, 1)
+              << " bytes/state)" << std::endl;
+}
+
+int main(int argc, const char **argv) {
+    if (argc != 4) return Usage(argv[0]);
+    const std::string input_file{argv[1]}, output_file{argv[2]};
+    const auto cost_bits = static_cast<unsigned>(std::stoi(argv[3]));
+
+    const PrecomputedResults input{input_file};
+    {
+        CompressedPrecomputedWriter writer{output_file, input.TopK(),
+                                           input.NumStates(), cost_bits};
+        for (size_t state = 0; state < input.NumStates(); ++state)
+            writer.Add(input.Get(state));
+        writer.Close();
+    }
+
+    const PrecomputedResults output{output_file};
+    std::vector<int> input_scratch, output_scratch;
+    double max_error = 0.0, total_error = 0.0;
+    for (size_t state = 0; state < input.NumStates(); ++state) {
+        const auto expected = input.Get(state);
+        const auto actual = output.Get(state);
+        QBZ_ASSERT(expected.Size() == actual.Size() &&
+                       expected.DecodeLength() == actual.DecodeLength(),
+                   "Mismatch at state " + std::to_string(state));
+        for (size_t idx = 0; idx < expected.Size(); ++idx) {
+            const auto a = expected.Olabels(idx, &input_scratch);
+            const auto b = actual.Olabels(idx, &output_scratch);
+            QBZ_ASSERT(a.Size() == b.Size() &&
+                           std::equal(a.begin(), a.end(), b.begin()),
+                       "Olabel mismatch at state " + std::to_string(state));
+            const double error =
+                std::abs(expected.Cost(idx) - actual.Cost(idx));
+            max_error = std::max(max_error, error);
+            total_error += error;
+        }
+    }
+
+    Report(input_file, input.Stats());
+    Report(output_file, output.Stats());
+    std::cout << "compression ratio: "
+              << static_cast<double>(input.Stats().file_bytes) /
+                     output.Stats().file_bytes
+              << std::endl;
+    std::cout << "cost error: max " << max_error << ", mean "
+              << total_error /
+                     std::max<uint64_t>(input.Stats().num_candidates, 1)
+              << std::endl;
+
+    return 0;
+}
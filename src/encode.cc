@@ -6,6 +6,7 @@
  */
 
 #include <iostream>
+#include "char_map.h"
 #include "common.h"
 #include "encoder.h"
 #include "fst/fstlib.h"
@@ -30,8 +31,9 @@ int main(int argc, const char **argv) {
     QBZ_ASSERT(ifs, "Failed to read input " + std::string{argv[2]});
 
     fst::SortedMatcher<fst::StdFst> matcher{encoder, fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
+    const CharMap charMap{*encoder->InputSymbols()};
     matcher.SetState(encoder->Start());
-    QBZ_ASSERT(matcher.Find(encoder->InputSymbols()->Find(ToString({SPACE}))),
+    QBZ_ASSERT(matcher.Find(charMap.Find(SPACE)),
                "space char not found in the encoder");
     // start state (initial space transition)
     const auto start = matcher.Value().nextstate;
@@ -39,20 +41,18 @@ int main(int argc, const char **argv) {
     while (std::getline(ifs, line)) {
         // join multi-space into one
         line = Join(Split(line), " ");
-        auto utf8_line = ToUtf8(line);
-        std::replace(utf8_line.begin(), utf8_line.end(), static_cast<char32_t>(' '), SPACE);
         std::vector<int> ilabels;
-        ilabels.reserve(utf8_line.size());
+        ilabels.reserve(line.size());
         std::vector<std::string> oovs;
-        for (auto utf8_char : utf8_line) {
-            auto c = ToString({utf8_char});
-            auto ilabel = encoder->InputSymbols()->Find(c);
+        ForEachChar(line, [&](char32_t c) {
+            if (c == static_cast<char32_t>(' ')) c = SPACE;
+            auto ilabel = charMap.Find(c);
             if (ilabel == fst::kNoLabel) {
                 ilabel = IDX_UNK;
-                oovs.push_back(std::move(c));
+                oovs.push_back(ToString({c}));
             }
             ilabels.push_back(ilabel);
-        }
+        });
 
         auto olabels = Encode(*encoder, matcher, start, ilabels, true);
 
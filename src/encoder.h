@@ -10,10 +10,32 @@
 
 #include "common.h"
 #include "fst/fstlib.h"
+#include "matcher.h"
 #include "transition.h"
+#include <memory>
+#include <set>
 
 namespace qbz {
 
+/**
+ * Transduce a single ilabel using encoder FST; see Encode
+ *
+ * @param olabels: olabel vector to which emitted olabels are appended
+ * @param out_state: state after the transition
+ */
+template <typename FST, typename Matcher>
+void EncodeStep(const FST &encoder, Matcher &matcher, int in_state, int ilabel,
+                std::vector<int> *olabels, int *out_state) {
+    QBZ_ASSERT(ilabel >= IDX_UNK,
+               "Unexpected ilabel: " + std::to_string(ilabel));
+    if (ilabel == IDX_UNK) {
+        MakeExitTransitions(encoder, matcher, in_state, olabels, out_state);
+        olabels->push_back(IDX_UNK);
+    } else
+        MakeTransitions(encoder, matcher, in_state, ilabel, olabels,
+                        out_state);
+}
+
 /**
  * Transduce ilabels into olabels using encoder FST
  *
@@ -34,17 +56,8 @@ std::vector<int> Encode(const FST &encoder, Matcher &matcher, int in_state,
                         int *out_state = nullptr) {
 
     std::vector<int> olabels;
-    for (auto ilabel : ilabels) {
-        QBZ_ASSERT(ilabel >= IDX_UNK,
-                   "Unexpected ilabel: " + std::to_string(ilabel));
-        if (ilabel == IDX_UNK) {
-            MakeExitTransitions(encoder, matcher, in_state, &olabels,
-                                &in_state);
-            olabels.push_back(IDX_UNK);
-        } else
-            MakeTransitions(encoder, matcher, in_state, ilabel, &olabels,
-                            &in_state);
-    }
+    for (auto ilabel : ilabels)
+        EncodeStep(encoder, matcher, in_state, ilabel, &olabels, &in_state);
 
     if (complete)
         MakeExitTransitions(encoder, matcher, in_state, &olabels, &in_state);
@@ -154,6 +167,127 @@ auto ExtractCharacters(Iterator begin, Iterator end)
     return characters;
 }
 
+inline void AddToken(fst::StdVectorFst *graph, const std::string &token,
+                     const Utf8 &utoken) {
+    auto src = graph->Start();
+    for (auto c : utoken) {
+        auto dst = graph->AddState();
+        graph->AddArc(src, fst::StdArc(graph->InputSymbols()->Find(ToString({c})),
+                                       IDX_EPSILON,
+                                       dst));
+        src = dst;
+    }
+    graph->AddArc(src, fst::StdArc(IDX_PHI,
+                                   graph->OutputSymbols()->Find(token),
+                                   graph->Start()));
+}
+
+inline void AddPhiTransitions(fst::StdVectorFst *graph) {
+    struct TraverseState {
+        explicit TraverseState(int state, int prev_state, int olabel = IDX_EPSILON) :
+                state{state}, prev_state{prev_state}, ilabel{olabel} {}
+
+        int state; // current state
+        int prev_state; // previous state (which must have transitions to every ilabel)
+        int ilabel; // ilabel from prev_state to state
+    };
+    std::set<int> visitedStates;
+    std::queue<TraverseState> queue;
+    queue.emplace(graph->Start(), graph->Start());
+    // use unsorted matcher (linear search)
+    UnsortedMatcher<fst::StdFst> matcher{graph};
+    while (!queue.empty()) {
+        auto traverseState = queue.front();
+        queue.pop();
+
+        const auto state = traverseState.state;
+        const auto prev_state = traverseState.prev_state;
+        const auto ilabel = traverseState.ilabel;
+
+        QBZ_ASSERT(visitedStates.find(state) == visitedStates.end(),
+                   "state " + std::to_string(state) + " visited again");
+        visitedStates.insert(state);
+
+        auto to_add_phi = state != graph->Start(); // no need to add phi at start state
+        fst::ArcIterator<fst::StdVectorFst> aiter{*graph, state};
+        for (; !aiter.Done(); aiter.Next()) {
+            const auto &arc = aiter.Value();
+            if (arc.ilabel == IDX_PHI) {
+                to_add_phi = false;
+                continue;
+            }
+            if (arc.nextstate == graph->Start()) continue;
+            queue.emplace(arc.nextstate, state, arc.ilabel);
+        }
+
+        if (to_add_phi) {
+            // take phi transition from previous state and append olabel
+            std::vector<int> olabels;
+            int dest;
+            MakeTransitions(*graph, matcher, prev_state, IDX_PHI, &olabels, &dest);
+            MakeTransitions(*graph, matcher, dest, ilabel, &olabels, &dest);
+            // create extra states if olabels is more than 1
+            auto s = state;
+            for (auto idx = 0; idx < olabels.size() - 1; ++idx) {
+                auto temp = graph->AddState();
+                graph->AddArc(s, fst::StdArc(IDX_PHI, olabels.at(idx), temp));
+                s = temp;
+            }
+            graph->AddArc(s, fst::StdArc(IDX_PHI, olabels.back(), dest));
+        }
+    }
+
+    fst::Minimize(graph);
+    fst::ArcSort(graph, fst::ILabelCompare<fst::StdArc>{});
+}
+
+inline void BuildPrefixTree(fst::StdVectorFst *graph,
+                            const std::vector<std::string> &vocab,
+                            const std::vector<Utf8> &utf8_vocab) {
+    for (auto i = 0; i < vocab.size(); ++i) {
+        AddToken(graph, vocab.at(i), utf8_vocab.at(i));
+    }
+
+    fst::Determinize(*graph, graph);
+    fst::ArcSort(graph, fst::ILabelCompare<fst::StdArc>{});
+}
+
+/**
+ * Build an LPM encoder from a subword vocabulary
+ * Every character of the vocabulary, including the sentencepiece space, must
+ * also be a token on its own, as sentencepiece's character coverage ensures
+ *
+ * @param vocabulary: subword tokens without special symbols
+ * @param encoder: empty graph to build the encoder into
+ */
+inline void BuildEncoder(const std::vector<std::string> &vocabulary,
+                         fst::StdVectorFst *encoder) {
+    fst::SymbolTable isymtable;
+    for (const auto &symbol : DEFAULT_SYMBOLS)
+        isymtable.AddSymbol(symbol);
+    std::unique_ptr<fst::SymbolTable> osymtable{isymtable.Copy()};
+
+    for (const auto &token : vocabulary)
+        osymtable->AddSymbol(token);
+
+    std::vector<Utf8> utf8_vocab;
+    utf8_vocab.reserve(vocabulary.size());
+    for (const auto &token : vocabulary)
+        utf8_vocab.push_back(ToUtf8(token));
+
+    auto characters = ExtractCharacters(utf8_vocab.begin(), utf8_vocab.end());
+    for (auto c : characters)
+        isymtable.AddSymbol(ToString({c}));
+
+    encoder->SetInputSymbols(&isymtable);
+    encoder->SetOutputSymbols(osymtable.get());
+    encoder->SetStart(encoder->AddState());
+    encoder->SetFinal(encoder->Start());
+
+    BuildPrefixTree(encoder, vocabulary, utf8_vocab);
+    AddPhiTransitions(encoder);
+}
+
 } // namespace qbz
 
 #endif // QUERYBLAZER_ENCODER_H
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_ENCODERTRIE_H
+#define QUERYBLAZER_ENCODERTRIE_H
+
+#include "common.h"
+#include "fst/fstlib.h"
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Candidate olabel sequences of every encoder state stored as one trie per
+ * state in a flat array, so that sequences sharing leading olabels can be
+ * scored once per shared prefix
+ * Children of a node are contiguous (CSR layout), and a node that ends a
+ * sequence refers to the full sequence in a flat olabel pool.
+ */
+class EncoderTrie {
+  public:
+    struct Node {
+        int olabel;
+        uint32_t first_child;
+        uint32_t num_children;
+        // index of the sequence ending at this node, or NO_SEQUENCE
+        uint32_t sequence;
+    };
+
+    static constexpr uint32_t NO_SEQUENCE = UINT32_MAX;
+
+    /**
+     * Add the candidate sequences of the next encoder state
+     */
+    void Add(std::vector<std::vector<int>> sequences) {
+        std::sort(sequences.begin(), sequences.end());
+        sequences.erase(std::unique(sequences.begin(), sequences.end()),
+                        sequences.end());
+
+        roots.push_back(NewNode(fst::kNoLabel));
+        // (node, first sequence, last sequence, depth); children of a node
+        // are allocated at once, so that they are contiguous
+        using Range = std::tuple<uint32_t, size_t, size_t, size_t>;
+        std::queue<Range> queue;
+        queue.emplace(roots.back(), 0, sequences.size(), 0);
+        while (!queue.empty()) {
+            uint32_t node;
+            size_t first, last, depth;
+            std::tie(node, first, last, depth) = queue.front();
+            queue.pop();
+
+            // sorted, so a sequence ending here comes first
+            if (first < last && sequences[first].size() == depth) {
+                nodes[node].sequence = AddSequence(sequences[first]);
+                ++first;
+            }
+
+            nodes[node].first_child = static_cast<uint32_t>(nodes.size());
+            for (auto begin = first; begin < last;) {
+                const auto olabel = sequences[begin][depth];
+                auto end = begin;
+                while (end < last && sequences[end][depth] == olabel) ++end;
+                queue.emplace(NewNode(olabel), begin, end, depth + 1);
+                ++nodes[node].num_children;
+                begin = end;
+            }
+        }
+    }
+
+    void Reserve(size_t num_states) { roots.reserve(num_states); }
+
+    size_t NumStates() const { return roots.size(); }
+
+    uint32_t Root(int state) const { return roots.at(state); }
+
+    const Node &GetNode(uint32_t node) const { return nodes[node]; }
+
+    Span<Node> Children(const Node &node) const {
+        return {nodes.data() + node.first_child, node.num_children};
+    }
+
+    /**
+     * Full olabel sequence ending at node; must be a sequence node
+     */
+    Span<int> Sequence(const Node &node) const {
+        const auto begin = sequence_offsets[node.sequence];
+        return {olabels.data() + begin,
+                sequence_offsets[node.sequence + 1] - begin};
+    }
+
+  private:
+    uint32_t NewNode(int olabel) {
+        nodes.push_back(Node{olabel, 0, 0, NO_SEQUENCE});
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    uint32_t AddSequence(const std::vector<int> &sequence) {
+        if (sequence_offsets.empty()) sequence_offsets.push_back(0);
+        olabels.insert(olabels.end(), sequence.begin(), sequence.end());
+        sequence_offsets.push_back(olabels.size());
+        return static_cast<uint32_t>(sequence_offsets.size() - 2);
+    }
+
+    std::vector<uint32_t> roots;
+    std::vector<Node> nodes;
+    std::vector<size_t> sequence_offsets;
+    std::vector<int> olabels;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_ENCODERTRIE_H
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "mapped_file.h"
+#include "mpc.h"
+#include "synthetic.h"
+#include <iostream>
+
+DEFINE_int32(alphabet, 26, "# of lowercase letters words are made of");
+DEFINE_int32(num_words, 5000, "# of distinct words");
+DEFINE_int32(max_words, 4, "maximum # of words per query");
+DEFINE_int32(num_queries, 20000, "# of distinct queries");
+DEFINE_int32(num_lines, 100000, "# of lines of the query log");
+DEFINE_double(word_zipf, 1.0, "Zipf exponent of word frequencies");
+DEFINE_double(query_zipf, 1.0, "Zipf exponent of query frequencies");
+DEFINE_int32(vocab_size, 2048, "# of subword tokens of the encoder");
+DEFINE_int32(order, 4, "n-gram order of the model");
+DEFINE_int32(num_prefixes, 10000, "# of prefixes of logged queries");
+DEFINE_int32(seed, 1, "random seed");
+
+using namespace qbz;
+
+void WriteLines(const std::string &file,
+                const std::vector<std::string> &lines) {
+    std::ofstream ofs{file};
+    QBZ_ASSERT(ofs, "Error writing " + file);
+    for (const auto &line : lines) ofs << line << '\n';
+    QBZ_ASSERT(ofs, "Error writing " + file);
+}
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Generate a synthetic encoder, n-gram model, MPC trie & query log "
+        "for benchmarks\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] OUTPUT_DIR\n"
+        "\tOUTPUT_DIR: existing directory to write into:\n"
+        "\t\tvocab.txt: subword vocabulary\n"
+        "\t\tencoder.fst: LPM encoder of the vocabulary\n"
+        "\t\ttrain.txt: query log, most popular queries drawn most often\n"
+        "\t\ttest.prefix: prefixes of queries drawn from the same log\n"
+        "\t\tngram.fst: backoff n-gram model of the encoded log\n"
+        "\t\ttrie.fst & mpc.bin: MPC trie & completions of the log\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc != 2) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    QBZ_ASSERT(FLAGS_num_words > 0 && FLAGS_num_queries > 0 &&
+                   FLAGS_num_lines > 0 && FLAGS_vocab_size > 0 &&
+                   FLAGS_num_prefixes >= 0,
+               "Sizes must be positive");
+    const std::string dir{argv[1]};
+    std::mt19937 rng{static_cast<std::mt19937::result_type>(FLAGS_seed)};
+
+    const auto words = SyntheticWords(static_cast<size_t>(FLAGS_num_words),
+                                      static_cast<size_t>(FLAGS_alphabet),
+                                      rng);
+    const auto queries = SyntheticQueries(
+        static_cast<size_t>(FLAGS_num_queries), words,
+        static_cast<size_t>(FLAGS_max_words), FLAGS_word_zipf, rng);
+    const auto log = ZipfQueryLog(
+        queries, static_cast<size_t>(FLAGS_num_lines), FLAGS_query_zipf, rng);
+    WriteLines(dir + "/train.txt", log);
+    QBZ_LOG(std::to_string(words.size()) + " words, " +
+            std::to_string(queries.size()) + " distinct queries");
+
+    std::vector<std::string> prefixes;
+    prefixes.reserve(static_cast<size_t>(FLAGS_num_prefixes));
+    std::uniform_int_distribution<size_t> line{0, log.size() - 1};
+    for (auto idx = 0; idx < FLAGS_num_prefixes; ++idx) {
+        const auto &query = log[line(rng)];
+        std::uniform_int_distribution<size_t> length{1, query.size()};
+        prefixes.push_back(query.substr(0, length(rng)));
+    }
+    WriteLines(dir + "/test.prefix", prefixes);
+
+    const auto vocabulary = SyntheticVocabulary(
+        words, static_cast<size_t>(FLAGS_vocab_size), FLAGS_word_zipf, rng);
+    WriteLines(dir + "/vocab.txt", vocabulary);
+    fst::StdVectorFst encoder;
+    BuildEncoder(vocabulary, &encoder);
+    const fst::StdConstFst const_encoder{encoder};
+    QBZ_ASSERT(WriteAlignedFst(const_encoder, dir + "/encoder.fst"),
+               "Error writing " + dir + "/encoder.fst");
+    QBZ_LOG(std::to_string(vocabulary.size()) + " subword tokens");
+
+    fst::StdVectorFst model;
+    BuildBackoffModel(EncodeQueries(const_encoder, log),
+                      *const_encoder.OutputSymbols(),
+                      static_cast<size_t>(FLAGS_order), &model);
+    QBZ_ASSERT(WriteAlignedFst(fst::StdConstFst{model}, dir + "/ngram.fst"),
+               "Error writing " + dir + "/ngram.fst");
+    QBZ_LOG(std::to_string(model.NumStates()) + " model states");
+
+    std::vector<std::string> distinct;
+    std::vector<size_t> counts;
+    std::tie(distinct, counts) = CountQueries(dir + "/train.txt");
+    BuildMpc(std::move(distinct), std::move(counts), dir + "/trie.fst",
+             dir + "/mpc.bin");
+
+    return 0;
+}
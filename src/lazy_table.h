@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_LAZYTABLE_H
+#define QUERYBLAZER_LAZYTABLE_H
+
+#include "common.h"
+#include <atomic>
+#include <memory>
+
+namespace qbz {
+
+/**
+ * Fixed-size table of lazily computed values that can be read and filled from
+ * multiple threads without locking.
+ * Each slot is published at most once with compare-and-swap; a thread that
+ * loses the race discards its own value and returns the published one.
+ * Resize and Clear are not thread-safe.
+ */
+template <typename Value>
+class LazyTable {
+  public:
+    explicit LazyTable(size_t size = 0) { Resize(size); }
+
+    LazyTable(const LazyTable &) = delete;
+
+    LazyTable &operator=(const LazyTable &) = delete;
+
+    ~LazyTable() { Clear(); }
+
+    /**
+     * Drop all values and reset the table to the given number of empty slots
+     */
+    void Resize(size_t size) {
+        Clear();
+        slots.reset(size ? new std::atomic<const Value *>[size] : nullptr);
+        for (size_t idx = 0; idx < size; ++idx)
+            slots[idx].store(nullptr, std::memory_order_relaxed);
+        num_slots = size;
+    }
+
+    void Clear() {
+        for (size_t idx = 0; idx < num_slots; ++idx)
+            delete slots[idx].exchange(nullptr, std::memory_order_relaxed);
+    }
+
+    size_t Size() const { return num_slots; }
+
+    /**
+     * @return published value or nullptr if the slot is not filled yet
+     */
+    const Value *Get(size_t idx) const {
+        return slots[idx].load(std::memory_order_acquire);
+    }
+
+    /**
+     * Return the value at idx, computing it with fn() if not filled yet
+     * fn may be run concurrently by several threads for the same slot but
+     * only one result is ever published
+     */
+    template <typename Fn>
+    const Value &GetOrCompute(size_t idx, Fn fn) const {
+        QBZ_ASSERT(idx < num_slots, "LazyTable index out of range");
+        auto value = Get(idx);
+        if (value) return *value;
+
+        std::unique_ptr<const Value> computed{new Value(fn())};
+        const Value *expected = nullptr;
+        if (slots[idx].compare_exchange_strong(expected, computed.get(),
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire))
+            return *computed.release();
+        return *expected;
+    }
+
+  private:
+    std::unique_ptr<std::atomic<const Value *>[]> slots;
+    size_t num_slots = 0;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_LAZYTABLE_H
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_MAPPEDFILE_H
+#define QUERYBLAZER_MAPPEDFILE_H
+
+#include "common.h"
+#include "fst/fstlib.h"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qbz {
+
+/**
+ * Read-only memory mapping of a whole file
+ * Pages are mapped shared, so every process mapping the same file uses the
+ * same page cache instead of a private heap copy
+ */
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &file) : size{0}, data{nullptr} {
+        const auto fd = open(file.c_str(), O_RDONLY);
+        QBZ_ASSERT(fd >= 0, "Error opening " + file);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            QBZ_ASSERT(false, "Error reading size of " + file);
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            QBZ_ASSERT(addr != MAP_FAILED, "Error mapping " + file);
+            data = static_cast<const char *>(addr);
+        } else {
+            close(fd);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<char *>(data), size);
+    }
+
+    const char *Data() const { return data; }
+
+    size_t Size() const { return size; }
+
+  private:
+    size_t size;
+    const char *data;
+};
+
+/**
+ * Size of a file in bytes, read without opening it
+ */
+inline uint64_t FileSize(const std::string &file) {
+    struct stat st;
+    QBZ_ASSERT(stat(file.c_str(), &st) == 0,
+               "Error reading size of " + file);
+    return static_cast<uint64_t>(st.st_size);
+}
+
+/**
+ * 64-bit FNV-1a hash of a file's contents, taken a word at a time
+ * Identifies the exact model that precomputed results were built from
+ */
+inline uint64_t FileChecksum(const std::string &file) {
+    const MappedFile mapped{file};
+    const auto data = reinterpret_cast<const unsigned char *>(mapped.Data());
+    uint64_t hash = 14695981039346656037ull;
+    size_t idx = 0;
+    for (; idx + sizeof(uint64_t) <= mapped.Size(); idx += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + idx, sizeof word);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; idx < mapped.Size(); ++idx)
+        hash = (hash ^ data[idx]) * 1099511628211ull;
+    return hash ^ mapped.Size();
+}
+
+/**
+ * Read an FST, optionally memory-mapping it
+ * Only ConstFst files written aligned (e.g., with --fst_align) are mapped;
+ * anything else silently falls back to reading into the heap
+ * @return nullptr on failure
+ */
+inline fst::StdExpandedFst *ReadFst(const std::string &file, bool map) {
+    if (!map) return fst::StdExpandedFst::Read(file);
+
+    std::ifstream ifs{file, std::ios::binary};
+    if (!ifs) return nullptr;
+    fst::FstReadOptions opts{file};
+    opts.mode = fst::FstReadOptions::MAP;
+    return fst::StdExpandedFst::Read(ifs, opts);
+}
+
+/**
+ * Write a ConstFst aligned, so that it can be memory-mapped by ReadFst
+ */
+inline bool WriteAlignedFst(const fst::StdConstFst &graph,
+                            const std::string &file) {
+    std::ofstream ofs{file, std::ios::binary};
+    if (!ofs) return false;
+    const fst::FstWriteOptions opts{file, true, true, true, true};
+    return graph.Write(ofs, opts) && ofs;
+}
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_MAPPEDFILE_H
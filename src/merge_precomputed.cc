@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "shard.h"
+#include <iostream>
+
+DEFINE_string(model, "",
+              "LM the partials must have been built from; checked against "
+              "their model checksum if given");
+DEFINE_int32(topk, 0, "expected topk; 0 to accept any");
+DEFINE_int32(beam_size, 0, "expected beam_size; 0 to accept any");
+DEFINE_int32(branch_factor, 0, "expected branch_factor; 0 to accept any");
+DEFINE_int32(cost_bits, 0,
+             "0 for a flat output, or 8 / 16 to compress it on the way");
+
+using namespace qbz;
+
+/**
+ * Check a config value of a partial against its flag, unless the flag is 0
+ */
+void CheckConfig(const Shard &shard, const std::string &name, int expected,
+                 uint32_t actual) {
+    QBZ_ASSERT(expected == 0 || static_cast<uint32_t>(expected) == actual,
+               shard.File() + " has " + name + " " + std::to_string(actual) +
+                   " instead of " + std::to_string(expected));
+}
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Merge partial precomputed files into one precomputed file\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] PRECOMPUTED PARTIAL...\n"
+        "\tPRECOMPUTED: merged output\n"
+        "\tPARTIAL: output of qbz_build_queryblazer --shard_count, or a "
+        "directory of shards\n"
+        "Partials may be given in any order, but must cover every model "
+        "state exactly once\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc < 3) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> files;
+    for (int idx = 2; idx < argc; ++idx) {
+        struct stat st;
+        if (stat(argv[idx], &st) == 0 && S_ISDIR(st.st_mode)) {
+            const auto shards = ListShards(argv[idx]);
+            files.insert(files.end(), shards.begin(), shards.end());
+        } else {
+            files.emplace_back(argv[idx]);
+        }
+    }
+
+    const auto model_checksum =
+        FLAGS_model.empty() ? 0 : FileChecksum(FLAGS_model);
+    for (const auto &shard : OpenShards(files)) {
+        const auto &header = shard->Header();
+        std::cerr << shard->File() << ": states " << header.begin << " to "
+                  << header.end << " of " << header.num_states << std::endl;
+        QBZ_ASSERT(FLAGS_model.empty() ||
+                       header.model_checksum == model_checksum,
+                   shard->File() + " was not built from " + FLAGS_model);
+        CheckConfig(*shard, "topk", FLAGS_topk, header.topk);
+        CheckConfig(*shard, "beam_size", FLAGS_beam_size, header.beam_size);
+        CheckConfig(*shard, "branch_factor", FLAGS_branch_factor,
+                    header.branch_factor);
+    }
+
+    MergeShards(files, argv[1], static_cast<unsigned>(FLAGS_cost_bits));
+    const PrecomputedResults merged{argv[1]};
+    const auto stats = merged.Stats();
+    std::cout << argv[1] << ": " << stats.num_states << " states, "
+              << stats.num_candidates << " candidates, " << stats.file_bytes
+              << " bytes, checksum " << std::hex << FileChecksum(argv[1])
+              << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_METRICS_H
+#define QUERYBLAZER_METRICS_H
+
+#include "common.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Latency histogram as of a snapshot
+ * Bucket 0 counts zero durations and bucket b > 0 counts durations in
+ * [2^(b-1), 2^b) ns
+ */
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    std::vector<uint64_t> buckets;
+
+    double MeanMicros() const {
+        return count ? total_ns / 1e3 / count : 0.0;
+    }
+
+    /**
+     * Upper bound of the bucket holding the given percentile, so at most 2x
+     * the actual value
+     * @param percentile: in [0, 100]
+     */
+    double PercentileMicros(double percentile) const {
+        if (!count) return 0.0;
+        const auto rank = static_cast<uint64_t>(percentile / 100 * count);
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+            seen += buckets[bucket];
+            if (seen > rank || seen == count)
+                return bucket ? static_cast<double>(1ull << bucket) / 1e3
+                              : 0.0;
+        }
+        return 0.0;
+    }
+};
+
+/**
+ * Stage latencies & counters of a completer as of a snapshot, by name
+ */
+struct MetricsSnapshot {
+    bool enabled = false;
+    std::map<std::string, HistogramSnapshot> stages;
+    std::map<std::string, uint64_t> counters;
+};
+
+/**
+ * Lock-free latency histogram with power-of-two buckets in ns
+ * Recording is a couple of relaxed atomic adds.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr size_t NUM_BUCKETS = 48;
+
+    LatencyHistogram() { Reset(); }
+
+    void Record(uint64_t ns) {
+        const auto bucket = std::min<size_t>(
+            ns ? 64 - __builtin_clzll(ns) : 0, NUM_BUCKETS - 1);
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    HistogramSnapshot Snapshot() const {
+        HistogramSnapshot snapshot;
+        snapshot.buckets.resize(NUM_BUCKETS);
+        for (size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+            snapshot.buckets[bucket] =
+                buckets[bucket].load(std::memory_order_relaxed);
+            snapshot.count += snapshot.buckets[bucket];
+        }
+        snapshot.total_ns = total_ns.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+    void Reset() {
+        for (auto &bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        total_ns.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> total_ns;
+};
+
+/**
+ * Nanoseconds elapsed since begin
+ */
+inline uint64_t NanosSince(std::chrono::steady_clock::time_point begin) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin)
+            .count());
+}
+
+/**
+ * Stage times of a single call, accumulated in per-thread scratch and
+ * recorded into Metrics at once, so that a stage entered several times per
+ * call (e.g., per character) is recorded as a single sample
+ */
+class StageTimes {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    void Clear() { ns.clear(); }
+
+    /**
+     * Add the time since the given time point to stage
+     * @return now, to be passed to the next lap
+     */
+    Clock::time_point Lap(size_t stage, Clock::time_point since) {
+        const auto now = Clock::now();
+        if (ns.size() <= stage) ns.resize(stage + 1, uint64_t{UNTIMED});
+        if (ns[stage] == UNTIMED) ns[stage] = 0;
+        ns[stage] += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - since)
+                .count());
+        return now;
+    }
+
+  private:
+    static constexpr uint64_t UNTIMED = UINT64_MAX;
+
+    // per stage; UNTIMED for stages not entered
+    std::vector<uint64_t> ns;
+
+    friend class Metrics;
+};
+
+/**
+ * Per-stage latency histograms & event counters shared by all threads of a
+ * completer, indexed by the completer's own stage & counter enums
+ * When disabled, recording returns right away; callers also skip reading
+ * the clock by checking Enabled.
+ */
+class Metrics {
+  public:
+    Metrics(bool enabled, std::vector<std::string> stage_names,
+            std::vector<std::string> counter_names)
+        : enabled{enabled},
+          stage_names{std::move(stage_names)},
+          counter_names{std::move(counter_names)},
+          stages{new LatencyHistogram[this->stage_names.size()]},
+          counters{new Counter[this->counter_names.size()]} {
+        Reset();
+    }
+
+    bool Enabled() const { return enabled; }
+
+    void Record(size_t stage, uint64_t ns) {
+        if (enabled) stages[stage].Record(ns);
+    }
+
+    void Record(const StageTimes &times) {
+        if (!enabled) return;
+        for (size_t stage = 0; stage < times.ns.size(); ++stage)
+            if (times.ns[stage] != StageTimes::UNTIMED)
+                stages[stage].Record(times.ns[stage]);
+    }
+
+    void Count(size_t counter, uint64_t n = 1) {
+        if (enabled && n)
+            counters[counter].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    MetricsSnapshot Snapshot() const {
+        MetricsSnapshot snapshot;
+        snapshot.enabled = enabled;
+        for (size_t stage = 0; stage < stage_names.size(); ++stage)
+            snapshot.stages[stage_names[stage]] = stages[stage].Snapshot();
+        for (size_t counter = 0; counter < counter_names.size(); ++counter)
+            snapshot.counters[counter_names[counter]] =
+                counters[counter].value.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+    /**
+     * Zero every histogram & counter; samples recorded concurrently may be
+     * partly kept
+     */
+    void Reset() {
+        for (size_t stage = 0; stage < stage_names.size(); ++stage)
+            stages[stage].Reset();
+        for (size_t counter = 0; counter < counter_names.size(); ++counter)
+            counters[counter].value.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    // padded to a cache line, so that threads bumping different counters
+    // do not contend
+    struct Counter {
+        std::atomic<uint64_t> value;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    const bool enabled;
+    const std::vector<std::string> stage_names;
+    const std::vector<std::string> counter_names;
+    std::unique_ptr<LatencyHistogram[]> stages;
+    std::unique_ptr<Counter[]> counters;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_METRICS_H
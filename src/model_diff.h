@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_MODELDIFF_H
+#define QUERYBLAZER_MODELDIFF_H
+
+#include "common.h"
+#include "fst/fstlib.h"
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Position of every state of a backoff n-gram model in its history trie
+ * Reading a history from the unigram state (or from the start state, for
+ * histories beginning with <s>) ends in the state of that history, and no
+ * shorter path reaches it; so the breadth-first tree over non-phi arcs is
+ * the history trie, and states of two models with the same history can be
+ * matched by walking it.
+ */
+struct StateHistories {
+    enum Root : uint8_t { NONE, UNIGRAM, START };
+
+    // reached states in breadth-first order, parents before children
+    std::vector<int> order;
+    // tree parent, or -1 for roots
+    std::vector<int> parent;
+    // ilabel read from the parent
+    std::vector<int> label;
+    // history length, not counting <s>
+    std::vector<uint32_t> depth;
+    // NONE for unreachable states
+    std::vector<uint8_t> root;
+};
+
+/**
+ * State at the end of the backoff chain from the start state
+ */
+inline int UnigramState(const fst::StdExpandedFst &model) {
+    auto state = model.Start();
+    while (true) {
+        auto next = fst::kNoStateId;
+        for (fst::ArcIterator<fst::StdFst> aiter{model, state}; !aiter.Done();
+             aiter.Next()) {
+            if (aiter.Value().ilabel == IDX_PHI) {
+                next = aiter.Value().nextstate;
+                break;
+            }
+        }
+        if (next == fst::kNoStateId) return state;
+        state = next;
+    }
+}
+
+inline StateHistories ComputeHistories(const fst::StdExpandedFst &model) {
+    const auto num_states = static_cast<size_t>(model.NumStates());
+    StateHistories histories;
+    histories.order.reserve(num_states);
+    histories.parent.assign(num_states, -1);
+    histories.label.assign(num_states, IDX_EPSILON);
+    histories.depth.assign(num_states, 0);
+    histories.root.assign(num_states, StateHistories::NONE);
+
+    const auto walk = [&histories, &model](int start, uint8_t root) {
+        if (histories.root[start] != StateHistories::NONE) return;
+        histories.root[start] = root;
+        auto head = histories.order.size();
+        histories.order.push_back(start);
+        for (; head < histories.order.size(); ++head) {
+            const auto state = histories.order[head];
+            for (fst::ArcIterator<fst::StdFst> aiter{model, state};
+                 !aiter.Done(); aiter.Next()) {
+                const auto &arc = aiter.Value();
+                if (arc.ilabel == IDX_PHI ||
+                    histories.root[arc.nextstate] != StateHistories::NONE)
+                    continue;
+                histories.parent[arc.nextstate] = state;
+                histories.label[arc.nextstate] = arc.ilabel;
+                histories.depth[arc.nextstate] = histories.depth[state] + 1;
+                histories.root[arc.nextstate] = root;
+                histories.order.push_back(arc.nextstate);
+            }
+        }
+    };
+    walk(UnigramState(model), StateHistories::UNIGRAM);
+    walk(model.Start(), StateHistories::START);
+    return histories;
+}
+
+/**
+ * Match each state of a model to the state of another model with the same
+ * history, e.g., of the same model retrained on a newer log
+ * Both models must share their symbol tables.
+ * @return state of other per state of the model, or fst::kNoStateId if the
+ * history is not a state of other
+ */
+inline std::vector<int> MatchStates(const StateHistories &histories,
+                                    const fst::StdExpandedFst &other,
+                                    const StateHistories &other_histories) {
+    std::vector<int> match(histories.parent.size(), fst::kNoStateId);
+    fst::SortedMatcher<fst::StdExpandedFst> matcher{
+        &other, fst::MatchType::MATCH_INPUT};
+    for (const auto state : histories.order) {
+        int candidate;
+        if (histories.parent[state] < 0) {
+            candidate = histories.root[state] == StateHistories::UNIGRAM
+                            ? UnigramState(other)
+                            : other.Start();
+        } else {
+            const auto parent = match[histories.parent[state]];
+            if (parent == fst::kNoStateId) continue;
+            matcher.SetState(parent);
+            if (!matcher.Find(histories.label[state])) continue;
+            candidate = matcher.Value().nextstate;
+        }
+        // a shorter history means that this one is not a state of other
+        if (other_histories.root[candidate] == histories.root[state] &&
+            other_histories.depth[candidate] == histories.depth[state])
+            match[state] = candidate;
+    }
+    return match;
+}
+
+/**
+ * Least cost from every state to any source state, by Dijkstra's algorithm
+ * over reversed arcs
+ * @param get_arcs: returns the arcs of a state, each with a nextstate and a
+ * non-negative float weight
+ * @param ignore_weights: take every weight as 0, so that the cost is 0 for
+ * exactly the states that reach a source
+ * @return infinity for states that cannot reach a source
+ */
+template <typename GetArcs>
+std::vector<double> CostsToSources(const std::vector<uint8_t> &sources,
+                                   GetArcs get_arcs,
+                                   bool ignore_weights = false) {
+    const auto num_states = sources.size();
+    // reversed arcs in CSR layout
+    std::vector<size_t> offsets(num_states + 1, 0);
+    for (size_t state = 0; state < num_states; ++state)
+        for (const auto &arc : get_arcs(static_cast<int>(state)))
+            ++offsets[arc.nextstate + 1];
+    for (size_t state = 0; state < num_states; ++state)
+        offsets[state + 1] += offsets[state];
+    std::vector<std::pair<int, float>> reversed(offsets.back());
+    {
+        auto fill = offsets;
+        for (size_t state = 0; state < num_states; ++state)
+            for (const auto &arc : get_arcs(static_cast<int>(state)))
+                reversed[fill[arc.nextstate]++] = {
+                    static_cast<int>(state),
+                    ignore_weights ? 0.0f : arc.weight};
+    }
+
+    using Entry = std::pair<double, int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    std::vector<double> costs(num_states,
+                              std::numeric_limits<double>::infinity());
+    for (size_t state = 0; state < num_states; ++state) {
+        if (!sources[state]) continue;
+        costs[state] = 0.0;
+        queue.emplace(0.0, static_cast<int>(state));
+    }
+    while (!queue.empty()) {
+        const auto cost = queue.top().first;
+        const auto state = queue.top().second;
+        queue.pop();
+        if (cost > costs[state]) continue;
+        for (auto idx = offsets[state]; idx < offsets[state + 1]; ++idx) {
+            const auto prev = reversed[idx].first;
+            const auto prev_cost = cost + reversed[idx].second;
+            if (prev_cost < costs[prev]) {
+                costs[prev] = prev_cost;
+                queue.emplace(prev_cost, prev);
+            }
+        }
+    }
+    return costs;
+}
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_MODELDIFF_H
@@ -8,20 +8,42 @@
 #ifndef QUERYBLAZER_MPC_H
 #define QUERYBLAZER_MPC_H
 
+#include "cache.h"
+#include "char_map.h"
+#include "encoder.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "parallel.h"
 #include "prefix_tree.h"
 #include "boost/serialization/utility.hpp"
 #include "boost/serialization/vector.hpp"
 #include "boost/archive/binary_oarchive.hpp"
 #include "boost/archive/binary_iarchive.hpp"
+#include <queue>
+#include <tuple>
+#include <unordered_map>
 
 namespace qbz {
 
 class Mpc {
   public:
+    // (query, count)
+    using Completion = std::vector<std::pair<std::string, size_t>>;
+
+    /**
+     * @param mmap: memory-map the trie if it is an aligned ConstFst file
+     * @param cache_bytes: memory budget for completions of recent prefixes;
+     * 0 disables the cache
+     * @param metrics: collect per-stage latency histograms & counters
+     */
     explicit Mpc(const std::string &trie_file,
-                            const std::string &serialized)
-        : trie{fst::StdExpandedFst::Read(trie_file)} {
+                            const std::string &serialized, bool mmap = false,
+                            size_t cache_bytes = 0, bool metrics = false)
+        : trie{ReadFst(trie_file, mmap)},
+          cache{cache_bytes},
+          metrics{MakeMetrics(metrics)} {
         QBZ_ASSERT(trie, "Error reading " + trie_file);
+        charMap = CharMap{*trie->InputSymbols()};
         QBZ_ASSERT(Load(serialized), "Error lading from " + serialized);
     }
 
@@ -35,8 +57,10 @@ class Mpc {
         : queries{std::move(queries)},
           counts{std::move(counts)},
           completions(this->queries.size()),
-          trie{fst::StdExpandedFst::Read(trie_file)} {
+          trie{fst::StdExpandedFst::Read(trie_file)},
+          metrics{MakeMetrics(false)} {
         QBZ_ASSERT(trie, "Error reading " + trie_file);
+        charMap = CharMap{*trie->InputSymbols()};
         QBZ_ASSERT(trie->NumStates() == this->counts.size(), "queries & counts size mismatch");
         QBZ_ASSERT(this->queries.size() == this->counts.size(), "queries & counts size mismatch");
     }
@@ -45,22 +69,39 @@ class Mpc {
         TopK(trie->Start(), topk);
     }
 
-    std::vector<std::pair<std::string, size_t>> Complete(const std::string &prefix) {
-        std::vector<std::pair<std::string, size_t>> result;
-        fst::SortedMatcher<fst::StdExpandedFst> matcher{*trie, fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
-        auto state = trie->Start();
-        for (auto c : ToUtf8(prefix)) {
-            matcher.SetState(state);
-            auto ilabel = trie->InputSymbols()->Find(ToString({c}));
-            if (!matcher.Find(ilabel)) return result;
-            state = matcher.Value().nextstate;
-        }
+    Completion Complete(const std::string &prefix) const {
+        if (!metrics.Enabled()) return Lookup(prefix);
+        const auto begin = std::chrono::steady_clock::now();
+        auto completion = Lookup(prefix);
+        metrics.Record(STAGE_TOTAL, NanosSince(begin));
+        return completion;
+    }
 
-        result.reserve(completions.at(state).size());
-        for (const auto &pair : completions.at(state)) {
-            result.emplace_back(queries.at(pair.second), pair.first);
-        }
+    /**
+     * Counters of the completion cache
+     */
+    CacheStats CompletionCacheStats() const { return cache.Stats(); }
+
+    /**
+     * Per-stage latency histograms & counters since construction or the
+     * last reset; empty unless enabled on construction
+     */
+    MetricsSnapshot GetMetrics() const { return metrics.Snapshot(); }
+
+    void ResetMetrics() const { metrics.Reset(); }
 
+    /**
+     * Complete prefixes in parallel on the internal worker pool
+     * @return completions in the same order as prefixes
+     */
+    std::vector<Completion>
+    CompleteBatch(const std::vector<std::string> &prefixes) const {
+        std::vector<Completion> result(prefixes.size());
+        workers.ParallelFor(prefixes.size(), [this, &prefixes, &result](
+                                                 size_t begin, size_t end) {
+            for (auto idx = begin; idx < end; ++idx)
+                result.at(idx) = Complete(prefixes.at(idx));
+        });
         return result;
     }
 
@@ -77,6 +118,77 @@ class Mpc {
     }
 
   private:
+    // stages of a completion timed by the metrics
+    enum Stage : size_t { STAGE_WALK, STAGE_COPY, STAGE_TOTAL };
+
+    // events counted by the metrics
+    enum Counter : size_t { COUNT_OOV_CHARS, COUNT_UNMATCHED };
+
+    static Metrics MakeMetrics(bool enabled) {
+        return Metrics{enabled,
+                       {"walk", "copy", "total"},
+                       {"oov_chars", "unmatched"}};
+    }
+
+    Completion Lookup(const std::string &prefix) const {
+        if (!cache.Enabled()) return Search(prefix);
+
+        // prefixes with the same ilabels complete the same
+        std::u32string key;
+        ForEachChar(prefix, [&](char32_t c) {
+            key.push_back(static_cast<char32_t>(charMap.Find(c)));
+        });
+        return *cache.GetOrCompute(
+            key, [&]() { return Search(prefix); }, CompletionBytes);
+    }
+
+    /**
+     * Complete prefix without the completion cache
+     */
+    Completion Search(const std::string &prefix) const {
+        const auto measure = metrics.Enabled();
+        std::chrono::steady_clock::time_point begin;
+        if (measure) begin = std::chrono::steady_clock::now();
+        Completion result;
+        fst::SortedMatcher<fst::StdExpandedFst> matcher{*trie, fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
+        auto state = trie->Start();
+        ForEachChar(prefix, [&](char32_t c) {
+            if (state == fst::kNoStateId) return;
+            matcher.SetState(state);
+            const auto ilabel = charMap.Find(c);
+            if (ilabel == fst::kNoLabel) metrics.Count(COUNT_OOV_CHARS);
+            if (ilabel == fst::kNoLabel || !matcher.Find(ilabel))
+                state = fst::kNoStateId;
+            else
+                state = matcher.Value().nextstate;
+        });
+        if (measure) metrics.Record(STAGE_WALK, NanosSince(begin));
+        if (state == fst::kNoStateId) {
+            metrics.Count(COUNT_UNMATCHED);
+            return result;
+        }
+
+        if (measure) begin = std::chrono::steady_clock::now();
+        result.reserve(completions.at(state).size());
+        for (const auto &pair : completions.at(state)) {
+            result.emplace_back(queries.at(pair.second), pair.first);
+        }
+        if (measure) metrics.Record(STAGE_COPY, NanosSince(begin));
+
+        return result;
+    }
+
+    /**
+     * Heap memory held by a cached completion
+     */
+    static size_t CompletionBytes(const Completion &completion) {
+        auto bytes = sizeof completion + sizeof(std::u32string) +
+                     sizeof(std::pair<std::string, size_t>) *
+                         completion.capacity();
+        for (const auto &pair : completion) bytes += pair.first.capacity();
+        return bytes;
+    }
+
     /**
      * Return {count, query_idx} up to topK
      * @param state
@@ -127,8 +239,136 @@ class Mpc {
     // topk completion score & indices at each state
     std::vector<std::vector<std::pair<size_t, size_t>>> completions;
     std::unique_ptr<const fst::StdExpandedFst> trie;
+    CharMap charMap;
+    // serves CompleteBatch
+    mutable WorkerPool workers;
+    // completions keyed by the ilabels of the prefix
+    mutable LruCache<std::u32string, Completion> cache;
+    mutable Metrics metrics;
 };
 
+inline std::pair<std::vector<std::string>, std::vector<size_t>>
+CountQueries(const std::string &file) {
+    std::string query;
+    std::ifstream ifs{file};
+    QBZ_ASSERT(ifs, "Error reading " + file);
+
+    std::unordered_map<std::string, size_t> counter;
+    while (std::getline(ifs, query)) {
+        auto it = counter.find(query);
+        if (it == counter.end())
+            counter.emplace(std::move(query), 1);
+        else
+            ++it->second;
+    }
+
+    std::vector<std::string> queries;
+    std::vector<size_t> counts;
+    queries.reserve(counter.size());
+    counts.reserve(counter.size());
+    for (auto it = counter.begin(); it != counter.end(); ) {
+        queries.push_back(it->first);
+        counts.push_back(it->second);
+        it = counter.erase(it);
+    }
+
+    return {queries, counts};
+}
+
+inline std::pair<std::vector<std::string>, std::vector<size_t>>
+CopyToFst(const Trie<int> &trie, fst::StdVectorFst &vec_fst) {
+    std::vector<size_t> counts{0}; // start state
+    std::vector<std::string> queries(1); // queries at each state if final
+    // prefix node, state idx
+    std::queue<std::pair<const PrefixNode<int, Trie<int>::Data>*, int>> queue;
+    queue.emplace(&trie.Root(), vec_fst.Start());
+    while (!queue.empty()) {
+        const auto &pair = queue.front();
+        for (auto child : pair.first->Children()) {
+            auto nextstate = vec_fst.AddState();
+            counts.push_back(0);
+            queries.emplace_back("");
+            vec_fst.AddArc(pair.second, fst::StdArc(child.first, child.first, nextstate));
+            queue.emplace(child.second, nextstate);
+        }
+
+        if (pair.first->Data()) {
+            vec_fst.SetFinal(pair.second);
+            counts.at(pair.second) = pair.first->Data()->count;
+            for (auto ilabel : pair.first->Prefix()) {
+                queries.at(pair.second) += vec_fst.InputSymbols()->Find(ilabel);
+            }
+        }
+
+        queue.pop();
+    }
+
+    return {queries, counts};
+}
+
+/**
+ * Build the trie of queries and precompute the top k completions per state
+ * @param queries: distinct queries
+ * @param counts: count of each query
+ */
+inline void BuildMpc(std::vector<std::string> queries,
+                     std::vector<size_t> counts, const std::string &trie_file,
+                     const std::string &completions_file, size_t topk = 10) {
+    std::vector<Utf8> utf8_queries;
+    utf8_queries.reserve(queries.size());
+    for (const auto &query : queries) utf8_queries.push_back(ToUtf8(query));
+
+    auto vocab = ExtractCharacters(utf8_queries.begin(), utf8_queries.end());
+
+    // create FST
+    auto p_vec_fst = new fst::StdVectorFst;
+    fst::StdVectorFst &vec_fst = *p_vec_fst;
+    vec_fst.SetStart(vec_fst.AddState());
+    auto symtable = new fst::SymbolTable;
+    for (const auto &symbol : DEFAULT_SYMBOLS)
+        symtable->AddSymbol(symbol);
+
+    for (auto c : vocab)
+        symtable->AddSymbol(ToString({c}));
+
+    vec_fst.SetInputSymbols(symtable);
+    vec_fst.SetOutputSymbols(symtable);
+
+    {
+        Trie<int> trie;
+        std::cerr << "Building a prefixtree..." << std::endl;
+        std::vector<int> ilabels;
+        for (auto i = 0; i < utf8_queries.size(); ++i) {
+            const auto &query = utf8_queries.at(i);
+            ilabels.clear();
+            ilabels.reserve(query.size());
+            for (auto c : query)
+                ilabels.push_back(symtable->Find(ToString({c})));
+            trie.Insert(ilabels, counts.at(i));
+        }
+
+        std::cerr << "Copying to an FST" << std::endl;
+        // count per FST state
+        std::tie(queries, counts) = CopyToFst(trie, vec_fst);
+    }
+
+    std::cerr << "Converting to ConstFST" << std::endl;
+    {
+        fst::StdConstFst const_fst{vec_fst};
+        // aligned so that it can be memory-mapped
+        QBZ_ASSERT(WriteAlignedFst(const_fst, trie_file), "Error writing " + trie_file);
+    }
+    delete p_vec_fst;
+
+    std::cerr << "Precomputing topk completions" << std::endl;
+    Mpc completions(trie_file, std::move(queries), std::move(counts));
+    completions.FindCompletions(topk);
+    std::cerr << "Writing to " << completions_file << std::endl;
+    QBZ_ASSERT(completions.Save(completions_file), "Error saving to " + completions_file);
+
+    delete symtable;
+}
+
 }
 
 #endif // QUERYBLAZER_MPC_H
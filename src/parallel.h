@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_PARALLEL_H
+#define QUERYBLAZER_PARALLEL_H
+
+#include "ThreadPool.h"
+#include "common.h"
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * ThreadPool that is started on first use, so that instances which never
+ * run batches do not keep idle threads around
+ */
+class WorkerPool {
+  public:
+    explicit WorkerPool(
+        size_t num_threads = std::thread::hardware_concurrency())
+        : num_threads{std::max<size_t>(num_threads, 1)} {}
+
+    size_t NumThreads() const { return num_threads; }
+
+    /**
+     * Split [0, size) into contiguous chunks and run fn(begin, end) on each
+     * chunk in the pool; blocks until all chunks are done, then rethrows the
+     * first exception raised by fn
+     * Must not be called from within one of the pool's own tasks
+     */
+    template <typename Fn>
+    void ParallelFor(size_t size, Fn fn) {
+        if (size == 0) return;
+        const auto num_chunks = std::min(size, num_threads);
+        if (num_chunks == 1) {
+            fn(size_t{0}, size);
+            return;
+        }
+
+        auto &pool = Get();
+        std::vector<std::future<void>> results;
+        results.reserve(num_chunks);
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+            const auto begin = size * chunk / num_chunks;
+            const auto end = size * (chunk + 1) / num_chunks;
+            results.push_back(pool.enqueue(fn, begin, end));
+        }
+        std::exception_ptr error;
+        for (auto &result : results) {
+            try {
+                result.get();
+            } catch (...) {
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+  private:
+    ThreadPool &Get() {
+        std::call_once(flag,
+                       [this]() { pool.reset(new ThreadPool{num_threads}); });
+        return *pool;
+    }
+
+    const size_t num_threads;
+    std::once_flag flag;
+    std::unique_ptr<ThreadPool> pool;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_PARALLEL_H
@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_PRECOMPUTED_H
+#define QUERYBLAZER_PRECOMPUTED_H
+
+#include "common.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+static_assert(sizeof(int) == sizeof(int32_t), "olabels are stored as int32");
+
+/**
+ * LEB128 variable-length encoding of unsigned integers
+ */
+inline void PutVarint(uint32_t value, std::string *output) {
+    while (value >= 0x80) {
+        output->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    output->push_back(static_cast<char>(value));
+}
+
+inline uint32_t GetVarint(const uint8_t **ptr) {
+    uint32_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        const auto byte = *(*ptr)++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// (vector(olabel_sequences, cost), decoding length)
+using BeamSearchResult =
+    std::pair<std::vector<std::pair<std::vector<int>, float>>, size_t>;
+
+/**
+ * Heap memory held by a result
+ */
+inline size_t HeapBytes(const BeamSearchResult &result) {
+    auto bytes = sizeof result + sizeof(std::pair<std::vector<int>, float>) *
+                                     result.first.capacity();
+    for (const auto &candidate : result.first)
+        bytes += sizeof(int) * candidate.first.capacity();
+    return bytes;
+}
+
+/**
+ * Bytes taken by a result in a flat precomputed file, besides the fixed
+ * per-state offset & decode length
+ */
+inline size_t FlatBytes(const BeamSearchResult &result) {
+    auto bytes = (sizeof(uint64_t) + sizeof(float)) * result.first.size();
+    for (const auto &candidate : result.first)
+        bytes += sizeof(int32_t) * candidate.first.size();
+    return bytes;
+}
+
+/**
+ * Read-only view over the beam search result of a single state, backed either
+ * by a BeamSearchResult, by a flat precomputed file or by a compressed record
+ */
+class ResultView {
+  public:
+    explicit ResultView(const BeamSearchResult &result)
+        : ResultView{} {
+        this->result = &result;
+        size = result.first.size();
+        decode_length = result.second;
+    }
+
+    /**
+     * @param offsets: olabel offsets of the candidates, size + 1 entries
+     * @param costs: costs of the candidates
+     * @param olabels: olabel pool that offsets point into
+     */
+    ResultView(const uint64_t *offsets, const float *costs, const int *olabels,
+               size_t size, size_t decode_length)
+        : ResultView{} {
+        this->offsets = offsets;
+        this->costs = costs;
+        this->olabels = olabels;
+        this->size = size;
+        this->decode_length = decode_length;
+    }
+
+    /**
+     * @param record: compressed record of the state, see CompressedRecord
+     * @param cost_bits: bits per quantized cost
+     */
+    ResultView(const uint8_t *record, unsigned cost_bits,
+               size_t decode_length)
+        : ResultView{} {
+        this->decode_length = decode_length;
+        size = GetVarint(&record);
+        if (!size) return;
+        cost_bytes = cost_bits / 8;
+        std::memcpy(&base, record, sizeof base);
+        std::memcpy(&scale, record + sizeof base, sizeof scale);
+        packed_costs = record + sizeof base + sizeof scale;
+        order = packed_costs + cost_bytes * size;
+        sequences = order + sizeof(uint16_t) * size;
+    }
+
+    /**
+     * number of candidates, sorted by cost
+     */
+    size_t Size() const { return size; }
+
+    float Cost(size_t idx) const {
+        if (result) return result->first[idx].second;
+        if (costs) return costs[idx];
+        return base + scale * Quantized(idx);
+    }
+
+    /**
+     * Olabels of a candidate
+     * Compressed candidates are decoded into scratch, so the span is only
+     * valid until scratch is modified; other views do not touch scratch
+     */
+    Span<int> Olabels(size_t idx, std::vector<int> *scratch) const {
+        if (result) return Span<int>{result->first[idx].first};
+        if (costs)
+            return {olabels + offsets[idx], offsets[idx + 1] - offsets[idx]};
+
+        uint16_t position;
+        std::memcpy(&position, order + sizeof position * idx,
+                    sizeof position);
+        auto ptr = sequences;
+        scratch->clear();
+        for (size_t lex = 0; lex <= position; ++lex) {
+            scratch->resize(GetVarint(&ptr));
+            for (auto length = GetVarint(&ptr); length; --length)
+                scratch->push_back(static_cast<int>(GetVarint(&ptr)));
+        }
+        return Span<int>{*scratch};
+    }
+
+    size_t DecodeLength() const { return decode_length; }
+
+  private:
+    ResultView()
+        : result{nullptr},
+          offsets{nullptr},
+          costs{nullptr},
+          olabels{nullptr},
+          packed_costs{nullptr},
+          order{nullptr},
+          sequences{nullptr},
+          cost_bytes{0},
+          base{0.0f},
+          scale{0.0f},
+          size{0},
+          decode_length{0} {}
+
+    uint32_t Quantized(size_t idx) const {
+        if (cost_bytes == 1) return packed_costs[idx];
+        uint16_t value;
+        std::memcpy(&value, packed_costs + sizeof value * idx, sizeof value);
+        return value;
+    }
+
+    // in memory
+    const BeamSearchResult *result;
+    // flat
+    const uint64_t *offsets;
+    const float *costs;
+    const int *olabels;
+    // compressed
+    const uint8_t *packed_costs;
+    const uint8_t *order;
+    const uint8_t *sequences;
+    uint32_t cost_bytes;
+    float base, scale;
+
+    size_t size;
+    size_t decode_length;
+};
+
+/**
+ * Flat precomputed file, in host byte order:
+ *   PrecomputedHeader
+ *   uint64 state_offsets[num_states + 1]: first candidate of each state
+ *   uint64 candidate_offsets[num_candidates + 1]: first olabel of each
+ *   candidate
+ *   uint32 decode_lengths[num_states]
+ *   float costs[num_candidates]
+ *   int32 olabels[num_olabels]
+ * Every section begins at an 8-byte aligned offset, so that the file can be
+ * mapped into memory and served from directly
+ */
+struct PrecomputedHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t topk;
+    uint64_t num_states;
+    uint64_t num_candidates;
+    uint64_t num_olabels;
+};
+
+constexpr char PRECOMPUTED_MAGIC[8] = "QBZPREC";
+constexpr uint32_t PRECOMPUTED_VERSION = 1;
+constexpr uint32_t PRECOMPUTED_COMPRESSED_VERSION = 2;
+
+inline PrecomputedHeader MakePrecomputedHeader(uint32_t version, size_t topk,
+                                               size_t num_states,
+                                               size_t num_candidates,
+                                               size_t num_olabels) {
+    PrecomputedHeader header;
+    std::memset(&header, 0, sizeof header);
+    std::memcpy(header.magic, PRECOMPUTED_MAGIC, sizeof header.magic);
+    header.version = version;
+    header.topk = static_cast<uint32_t>(topk);
+    header.num_states = num_states;
+    header.num_candidates = num_candidates;
+    header.num_olabels = num_olabels;
+    return header;
+}
+
+/**
+ * Byte offsets of each section of a flat precomputed file
+ */
+struct PrecomputedLayout {
+    explicit PrecomputedLayout(const PrecomputedHeader &header) {
+        state_offsets = Align(sizeof(PrecomputedHeader));
+        candidate_offsets =
+            state_offsets + sizeof(uint64_t) * (header.num_states + 1);
+        decode_lengths = candidate_offsets +
+                         sizeof(uint64_t) * (header.num_candidates + 1);
+        costs = Align(decode_lengths + sizeof(uint32_t) * header.num_states);
+        olabels = Align(costs + sizeof(float) * header.num_candidates);
+        size = olabels + sizeof(int32_t) * header.num_olabels;
+    }
+
+    static uint64_t Align(uint64_t offset) { return (offset + 7) & ~7ull; }
+
+    uint64_t state_offsets, candidate_offsets, decode_lengths, costs, olabels,
+        size;
+};
+
+/**
+ * Writes a flat precomputed file state by state
+ * Sizes must be known in advance so that every section can be written in a
+ * single pass
+ */
+class PrecomputedWriter {
+  public:
+    /**
+     * @param offset: where the precomputed data begins in the file; the bytes
+     * before it are left zero for the caller's own header
+     */
+    PrecomputedWriter(const std::string &file, size_t topk, size_t num_states,
+                      size_t num_candidates, size_t num_olabels,
+                      uint64_t offset = 0)
+        : file{file},
+          header{MakePrecomputedHeader(PRECOMPUTED_VERSION, topk, num_states,
+                                       num_candidates, num_olabels)},
+          layout{header} {
+        QBZ_ASSERT(offset == PrecomputedLayout::Align(offset),
+                   "Precomputed offset must be 8-byte aligned");
+        {
+            std::ofstream ofs{file, std::ios::binary | std::ios::trunc};
+            QBZ_ASSERT(ofs, "Error opening " + file);
+            ofs.seekp(offset);
+            ofs.write(reinterpret_cast<const char *>(&header), sizeof header);
+            // reserve the whole file so that sections can be written in place
+            ofs.seekp(offset + layout.size - 1);
+            ofs.put('\0');
+            QBZ_ASSERT(ofs, "Error writing " + file);
+        }
+        for (auto section :
+             {layout.state_offsets, layout.candidate_offsets,
+              layout.decode_lengths, layout.costs, layout.olabels}) {
+            sections.emplace_back(new std::fstream{
+                file, std::ios::binary | std::ios::in | std::ios::out});
+            QBZ_ASSERT(*sections.back(), "Error opening " + file);
+            sections.back()->seekp(offset + section);
+        }
+    }
+
+    /**
+     * Append the result of the next state
+     */
+    void Add(const ResultView &result) {
+        QBZ_ASSERT(num_states < header.num_states, "Too many states");
+        Write(STATE_OFFSETS, static_cast<uint64_t>(num_candidates));
+        Write(DECODE_LENGTHS, static_cast<uint32_t>(result.DecodeLength()));
+        for (size_t idx = 0; idx < result.Size(); ++idx) {
+            const auto olabels = result.Olabels(idx, &scratch);
+            Write(CANDIDATE_OFFSETS, static_cast<uint64_t>(num_olabels));
+            Write(COSTS, result.Cost(idx));
+            sections[OLABELS]->write(
+                reinterpret_cast<const char *>(olabels.begin()),
+                sizeof(int32_t) * olabels.Size());
+            num_olabels += olabels.Size();
+        }
+        num_candidates += result.Size();
+        ++num_states;
+    }
+
+    /**
+     * Write closing offsets and flush; throws if sizes do not match
+     */
+    void Close() {
+        QBZ_ASSERT(num_states == header.num_states &&
+                       num_candidates == header.num_candidates &&
+                       num_olabels == header.num_olabels,
+                   "Precomputed size mismatch while writing " + file);
+        Write(STATE_OFFSETS, static_cast<uint64_t>(num_candidates));
+        Write(CANDIDATE_OFFSETS, static_cast<uint64_t>(num_olabels));
+        for (auto &section : sections) {
+            section->close();
+            QBZ_ASSERT(*section, "Error writing " + file);
+        }
+        sections.clear();
+    }
+
+  private:
+    enum Section {
+        STATE_OFFSETS,
+        CANDIDATE_OFFSETS,
+        DECODE_LENGTHS,
+        COSTS,
+        OLABELS
+    };
+
+    template <typename T>
+    void Write(Section section, T value) {
+        sections[section]->write(reinterpret_cast<const char *>(&value),
+                                 sizeof value);
+    }
+
+    const std::string file;
+    const PrecomputedHeader header;
+    const PrecomputedLayout layout;
+    std::vector<std::unique_ptr<std::fstream>> sections;
+    std::vector<int> scratch;
+    size_t num_states = 0;
+    size_t num_candidates = 0;
+    size_t num_olabels = 0;
+};
+
+/**
+ * Compressed precomputed file (version 2), in host byte order:
+ *   PrecomputedHeader
+ *   CompressedHeader
+ *   uint64 state_offsets[num_states + 1]: byte offset of each record
+ *   uint32 decode_lengths[num_states]
+ *   uint8 records[record_bytes]
+ * Each state is a variable-length record:
+ *   varint count
+ *   float base, scale: cost = base + scale * quantized cost
+ *   uint8/uint16 quantized costs[count], in cost order
+ *   uint16 positions[count]: lexicographic position of each candidate
+ *   olabel sequences in lexicographic order, each sharing a prefix with the
+ *   previous one: varint shared length, varint suffix length, varint suffix
+ * Quantization keeps candidates of a state in cost order, and olabels are
+ * stored losslessly; only costs lose precision
+ */
+struct CompressedHeader {
+    uint32_t cost_bits;
+    uint32_t reserved;
+    uint64_t record_bytes;
+};
+
+struct CompressedLayout {
+    explicit CompressedLayout(const PrecomputedHeader &header,
+                              uint64_t record_bytes) {
+        state_offsets = PrecomputedLayout::Align(sizeof(PrecomputedHeader) +
+                                                 sizeof(CompressedHeader));
+        decode_lengths =
+            state_offsets + sizeof(uint64_t) * (header.num_states + 1);
+        records = decode_lengths + sizeof(uint32_t) * header.num_states;
+        size = records + record_bytes;
+    }
+
+    uint64_t state_offsets, decode_lengths, records, size;
+};
+
+/**
+ * Writes a compressed precomputed file state by state
+ * Records are appended at the end of the file, so their total size need not
+ * be known in advance
+ */
+class CompressedPrecomputedWriter {
+  public:
+    /**
+     * @param cost_bits: 8 or 16 bits per quantized cost
+     */
+    CompressedPrecomputedWriter(const std::string &file, size_t topk,
+                                size_t num_states, unsigned cost_bits)
+        : file{file},
+          topk{topk},
+          num_states{num_states},
+          cost_bits{cost_bits},
+          layout{MakePrecomputedHeader(PRECOMPUTED_COMPRESSED_VERSION, topk,
+                                       num_states, 0, 0),
+                 0} {
+        QBZ_ASSERT(cost_bits == 8 || cost_bits == 16,
+                   "cost_bits must be 8 or 16");
+        {
+            std::ofstream ofs{file, std::ios::binary | std::ios::trunc};
+            QBZ_ASSERT(ofs, "Error opening " + file);
+            // headers are written on Close; reserve up to the records
+            ofs.seekp(layout.records - 1);
+            ofs.put('\0');
+            QBZ_ASSERT(ofs, "Error writing " + file);
+        }
+        for (auto offset :
+             {layout.state_offsets, layout.decode_lengths, layout.records}) {
+            sections.emplace_back(new std::fstream{
+                file, std::ios::binary | std::ios::in | std::ios::out});
+            QBZ_ASSERT(*sections.back(), "Error opening " + file);
+            sections.back()->seekp(offset);
+        }
+    }
+
+    /**
+     * Append the result of the next state
+     */
+    void Add(const ResultView &result) {
+        QBZ_ASSERT(num_added < num_states, "Too many states");
+        Encode(result);
+        Write(STATE_OFFSETS, static_cast<uint64_t>(record_bytes));
+        Write(DECODE_LENGTHS, static_cast<uint32_t>(result.DecodeLength()));
+        sections[RECORDS]->write(record.data(), record.size());
+        record_bytes += record.size();
+        ++num_added;
+    }
+
+    /**
+     * Write closing offset & headers and flush; throws if not all states
+     * were added
+     */
+    void Close() {
+        QBZ_ASSERT(num_added == num_states,
+                   "Precomputed size mismatch while writing " + file);
+        Write(STATE_OFFSETS, static_cast<uint64_t>(record_bytes));
+
+        const auto header =
+            MakePrecomputedHeader(PRECOMPUTED_COMPRESSED_VERSION, topk,
+                                  num_states, num_candidates, num_olabels);
+        CompressedHeader compressed;
+        std::memset(&compressed, 0, sizeof compressed);
+        compressed.cost_bits = cost_bits;
+        compressed.record_bytes = record_bytes;
+        auto &ofs = *sections.front();
+        ofs.seekp(0);
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof header);
+        ofs.write(reinterpret_cast<const char *>(&compressed),
+                  sizeof compressed);
+        for (auto &section : sections) {
+            section->close();
+            QBZ_ASSERT(*section, "Error writing " + file);
+        }
+        sections.clear();
+    }
+
+  private:
+    enum Section { STATE_OFFSETS, DECODE_LENGTHS, RECORDS };
+
+    /**
+     * Encode result into record
+     */
+    void Encode(const ResultView &result) {
+        const auto count = result.Size();
+        QBZ_ASSERT(count <= std::numeric_limits<uint16_t>::max(),
+                   "Too many candidates per state");
+        record.clear();
+        PutVarint(static_cast<uint32_t>(count), &record);
+        if (!count) return;
+
+        sequences.resize(count);
+        auto base = result.Cost(0), max_cost = result.Cost(0);
+        for (size_t idx = 0; idx < count; ++idx) {
+            const auto olabels = result.Olabels(idx, &scratch);
+            sequences[idx].assign(olabels.begin(), olabels.end());
+            base = std::min(base, result.Cost(idx));
+            max_cost = std::max(max_cost, result.Cost(idx));
+            num_olabels += olabels.Size();
+        }
+        num_candidates += count;
+
+        const auto levels = (1u << cost_bits) - 1;
+        const float scale = (max_cost - base) / levels;
+        Append(base);
+        Append(scale);
+        for (size_t idx = 0; idx < count; ++idx) {
+            const auto quantized =
+                scale > 0.0f
+                    ? std::min<uint32_t>(
+                          levels, static_cast<uint32_t>(std::lround(
+                                      (result.Cost(idx) - base) / scale)))
+                    : 0u;
+            if (cost_bits == 8)
+                Append(static_cast<uint8_t>(quantized));
+            else
+                Append(static_cast<uint16_t>(quantized));
+        }
+
+        // sort lexicographically so that neighbors share prefixes
+        ranks.resize(count);
+        for (size_t idx = 0; idx < count; ++idx) ranks[idx] = idx;
+        std::sort(ranks.begin(), ranks.end(),
+                  [this](size_t a, size_t b) {
+                      return sequences[a] < sequences[b];
+                  });
+        positions.resize(count);
+        for (size_t lex = 0; lex < count; ++lex)
+            positions[ranks[lex]] = static_cast<uint16_t>(lex);
+        for (auto position : positions) Append(position);
+
+        const std::vector<int> *previous = nullptr;
+        for (auto idx : ranks) {
+            const auto &sequence = sequences[idx];
+            size_t shared = 0;
+            if (previous)
+                while (shared < std::min(previous->size(), sequence.size()) &&
+                       (*previous)[shared] == sequence[shared])
+                    ++shared;
+            PutVarint(static_cast<uint32_t>(shared), &record);
+            PutVarint(static_cast<uint32_t>(sequence.size() - shared),
+                      &record);
+            for (auto it = sequence.begin() + shared; it != sequence.end();
+                 ++it)
+                PutVarint(static_cast<uint32_t>(*it), &record);
+            previous = &sequence;
+        }
+    }
+
+    template <typename T>
+    void Append(T value) {
+        record.append(reinterpret_cast<const char *>(&value), sizeof value);
+    }
+
+    template <typename T>
+    void Write(Section section, T value) {
+        sections[section]->write(reinterpret_cast<const char *>(&value),
+                                 sizeof value);
+    }
+
+    const std::string file;
+    const size_t topk;
+    const size_t num_states;
+    const unsigned cost_bits;
+    const CompressedLayout layout;
+    std::vector<std::unique_ptr<std::fstream>> sections;
+    // scratch buffers reused between states
+    std::string record;
+    std::vector<std::vector<int>> sequences;
+    std::vector<size_t> ranks;
+    std::vector<uint16_t> positions;
+    std::vector<int> scratch;
+    size_t num_added = 0;
+    size_t num_candidates = 0;
+    size_t num_olabels = 0;
+    uint64_t record_bytes = 0;
+};
+
+/**
+ * Write in-memory beam search results of every state into a precomputed file
+ * @param get_result: returns the BeamSearchResult of a state; may be called
+ * twice per state
+ * @param cost_bits: 0 for a flat file with float costs, or 8 / 16 for a
+ * compressed file with quantized costs
+ */
+template <typename GetResult>
+void WritePrecomputed(const std::string &file, size_t topk, size_t num_states,
+                      GetResult get_result, unsigned cost_bits = 0) {
+    if (cost_bits) {
+        CompressedPrecomputedWriter writer{file, topk, num_states, cost_bits};
+        for (size_t state = 0; state < num_states; ++state)
+            writer.Add(ResultView{get_result(state)});
+        writer.Close();
+        return;
+    }
+
+    size_t num_candidates = 0, num_olabels = 0;
+    for (size_t state = 0; state < num_states; ++state) {
+        const BeamSearchResult &result = get_result(state);
+        num_candidates += result.first.size();
+        for (const auto &candidate : result.first)
+            num_olabels += candidate.first.size();
+    }
+
+    PrecomputedWriter writer{file, topk, num_states, num_candidates,
+                             num_olabels};
+    for (size_t state = 0; state < num_states; ++state)
+        writer.Add(ResultView{get_result(state)});
+    writer.Close();
+}
+
+inline void WritePrecomputed(const std::string &file, size_t topk,
+                             const std::vector<BeamSearchResult> &results,
+                             unsigned cost_bits = 0) {
+    WritePrecomputed(
+        file, topk, results.size(),
+        [&results](size_t state) -> const BeamSearchResult & {
+            return results[state];
+        },
+        cost_bits);
+}
+
+/**
+ * Write results of every state given as views, e.g., of another precomputed
+ * file, into a precomputed file
+ * @param get_view: returns the ResultView of a state, which must stay valid
+ * until the next call; may be called twice per state
+ * @param cost_bits: see WritePrecomputed
+ */
+template <typename GetView>
+void WritePrecomputedViews(const std::string &file, size_t topk,
+                           size_t num_states, GetView get_view,
+                           unsigned cost_bits = 0) {
+    if (cost_bits) {
+        CompressedPrecomputedWriter writer{file, topk, num_states, cost_bits};
+        for (size_t state = 0; state < num_states; ++state)
+            writer.Add(get_view(state));
+        writer.Close();
+        return;
+    }
+
+    size_t num_candidates = 0, num_olabels = 0;
+    std::vector<int> scratch;
+    for (size_t state = 0; state < num_states; ++state) {
+        const auto view = get_view(state);
+        num_candidates += view.Size();
+        for (size_t idx = 0; idx < view.Size(); ++idx)
+            num_olabels += view.Olabels(idx, &scratch).Size();
+    }
+
+    PrecomputedWriter writer{file, topk, num_states, num_candidates,
+                             num_olabels};
+    for (size_t state = 0; state < num_states; ++state)
+        writer.Add(get_view(state));
+    writer.Close();
+}
+
+/**
+ * Size breakdown of a precomputed file
+ */
+struct PrecomputedStats {
+    uint32_t version;
+    // 32 for float costs
+    uint32_t cost_bits;
+    uint64_t num_states;
+    uint64_t num_candidates;
+    uint64_t num_olabels;
+    uint64_t file_bytes;
+};
+
+/**
+ * Precomputed file, flat or compressed, mapped into memory and served from
+ * directly
+ */
+class PrecomputedResults {
+  public:
+    /**
+     * @param offset: where the precomputed data begins in the file, as given
+     * to the writer
+     */
+    explicit PrecomputedResults(const std::string &file, uint64_t offset = 0)
+        : mapped{file}, offset{offset} {
+        QBZ_ASSERT(mapped.Size() >= offset + sizeof header,
+                   "Invalid precomputed file: " + file);
+        std::memcpy(&header, mapped.Data() + offset, sizeof header);
+        QBZ_ASSERT(std::memcmp(header.magic, PRECOMPUTED_MAGIC,
+                               sizeof header.magic) == 0,
+                   "Invalid precomputed file: " + file);
+        if (header.version == PRECOMPUTED_COMPRESSED_VERSION)
+            InitCompressed(file);
+        else
+            InitFlat(file);
+    }
+
+    /**
+     * Whether file begins with the precomputed magic
+     */
+    static bool IsPrecomputed(const std::string &file) {
+        char magic[sizeof PRECOMPUTED_MAGIC] = {};
+        std::ifstream ifs{file, std::ios::binary};
+        ifs.read(magic, sizeof magic);
+        return ifs &&
+               std::memcmp(magic, PRECOMPUTED_MAGIC, sizeof magic) == 0;
+    }
+
+    size_t NumStates() const { return header.num_states; }
+
+    size_t TopK() const { return header.topk; }
+
+    PrecomputedStats Stats() const {
+        return PrecomputedStats{header.version,
+                                records ? cost_bits : 32,
+                                header.num_states,
+                                header.num_candidates,
+                                header.num_olabels,
+                                mapped.Size()};
+    }
+
+    ResultView Get(int state) const {
+        if (records)
+            return ResultView{records + state_offsets[state], cost_bits,
+                              decode_lengths[state]};
+        const auto first = state_offsets[state];
+        return ResultView{candidate_offsets + first, costs + first, olabels,
+                          state_offsets[state + 1] - first,
+                          decode_lengths[state]};
+    }
+
+  private:
+    void InitFlat(const std::string &file) {
+        QBZ_ASSERT(header.version == PRECOMPUTED_VERSION,
+                   "Unsupported precomputed version " +
+                       std::to_string(header.version) + ": " + file);
+
+        const PrecomputedLayout layout{header};
+        QBZ_ASSERT(offset + layout.size == mapped.Size(),
+                   "Truncated precomputed file: " + file);
+        const auto data = mapped.Data() + offset;
+        state_offsets =
+            reinterpret_cast<const uint64_t *>(data + layout.state_offsets);
+        candidate_offsets =
+            reinterpret_cast<const uint64_t *>(data + layout.candidate_offsets);
+        decode_lengths =
+            reinterpret_cast<const uint32_t *>(data + layout.decode_lengths);
+        costs = reinterpret_cast<const float *>(data + layout.costs);
+        olabels = reinterpret_cast<const int *>(data + layout.olabels);
+        QBZ_ASSERT(state_offsets[header.num_states] == header.num_candidates &&
+                       candidate_offsets[header.num_candidates] ==
+                           header.num_olabels,
+                   "Corrupted precomputed file: " + file);
+    }
+
+    void InitCompressed(const std::string &file) {
+        CompressedHeader compressed;
+        QBZ_ASSERT(mapped.Size() >= offset + sizeof header + sizeof compressed,
+                   "Truncated precomputed file: " + file);
+        std::memcpy(&compressed, mapped.Data() + offset + sizeof header,
+                    sizeof compressed);
+        QBZ_ASSERT(compressed.cost_bits == 8 || compressed.cost_bits == 16,
+                   "Invalid precomputed file: " + file);
+        cost_bits = compressed.cost_bits;
+
+        const CompressedLayout layout{header, compressed.record_bytes};
+        QBZ_ASSERT(offset + layout.size == mapped.Size(),
+                   "Truncated precomputed file: " + file);
+        const auto data = mapped.Data() + offset;
+        state_offsets =
+            reinterpret_cast<const uint64_t *>(data + layout.state_offsets);
+        decode_lengths =
+            reinterpret_cast<const uint32_t *>(data + layout.decode_lengths);
+        records = reinterpret_cast<const uint8_t *>(data + layout.records);
+        QBZ_ASSERT(state_offsets[header.num_states] == compressed.record_bytes,
+                   "Corrupted precomputed file: " + file);
+    }
+
+    const MappedFile mapped;
+    const uint64_t offset;
+    PrecomputedHeader header;
+    const uint64_t *state_offsets = nullptr;
+    const uint32_t *decode_lengths = nullptr;
+    // flat
+    const uint64_t *candidate_offsets = nullptr;
+    const float *costs = nullptr;
+    const int *olabels = nullptr;
+    // compressed
+    const uint8_t *records = nullptr;
+    unsigned cost_bits = 0;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_PRECOMPUTED_H
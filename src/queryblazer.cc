@@ -14,25 +14,150 @@ namespace py = pybind11;
 using namespace qbz;
 
 PYBIND11_MODULE(queryblazer, m) {
+    // the original options may be given positionally, and the rest by
+    // keyword, e.g., Config(30, 50, cache_bytes=1 << 30), or as attributes;
+    // unknown keywords raise AttributeError
     py::class_<Config>(m, "Config")
-        .def(py::init<size_t, size_t, size_t, size_t, int, bool>(),
+        .def(py::init([](size_t branch_factor, size_t beam_size, size_t topk,
+                         size_t length_limit, int precompute, bool verbose,
+                         py::kwargs kwargs) {
+                 Config config{branch_factor, beam_size, topk, length_limit,
+                               precompute != 0, verbose};
+                 const auto object =
+                     py::cast(&config, py::return_value_policy::reference);
+                 for (const auto &item : kwargs)
+                     py::setattr(object, item.first, item.second);
+                 return config;
+             }),
              py::arg("branch_factor") = 30, py::arg("beam_size") = 30,
              py::arg("topk") = 10, py::arg("length_limit") = 100,
-             py::arg("precompute") = false, py::arg("verbose") = false);
+             py::arg("precompute") = false, py::arg("verbose") = false)
+        .def_readwrite("branch_factor", &Config::branch_factor)
+        .def_readwrite("beam_size", &Config::beam_size)
+        .def_readwrite("topk", &Config::topk)
+        .def_readwrite("length_limit", &Config::length_limit)
+        .def_readwrite("precompute", &Config::precompute)
+        .def_readwrite("verbose", &Config::verbose)
+        .def_readwrite("mmap", &Config::mmap)
+        .def_readwrite("cache_bytes", &Config::cache_bytes)
+        .def_readwrite("completion_cache_bytes",
+                       &Config::completion_cache_bytes)
+        .def_readwrite("num_threads", &Config::num_threads)
+        .def_readwrite("top_arcs", &Config::top_arcs)
+        .def_readwrite("beam_gap", &Config::beam_gap)
+        .def_readwrite("stable_steps", &Config::stable_steps)
+        .def_readwrite("metrics", &Config::metrics)
+        .def_readwrite("trace_threshold_us", &Config::trace_threshold_us)
+        .def_readwrite("trace_sample", &Config::trace_sample)
+        .def_readwrite("trace_capacity", &Config::trace_capacity)
+        .def("Validate", &Config::Validate);
+
+    py::class_<CacheStats>(m, "CacheStats")
+        .def_readonly("hits", &CacheStats::hits)
+        .def_readonly("misses", &CacheStats::misses)
+        .def_readonly("coalesced", &CacheStats::coalesced)
+        .def_readonly("evictions", &CacheStats::evictions)
+        .def_readonly("entries", &CacheStats::entries)
+        .def_readonly("bytes", &CacheStats::bytes);
+
+    py::class_<HistogramSnapshot>(m, "HistogramSnapshot")
+        .def_readonly("count", &HistogramSnapshot::count)
+        .def_readonly("total_ns", &HistogramSnapshot::total_ns)
+        .def_readonly("buckets", &HistogramSnapshot::buckets)
+        .def("MeanMicros", &HistogramSnapshot::MeanMicros)
+        .def("PercentileMicros", &HistogramSnapshot::PercentileMicros,
+             py::arg("percentile"));
+
+    py::class_<MetricsSnapshot>(m, "MetricsSnapshot")
+        .def_readonly("enabled", &MetricsSnapshot::enabled)
+        .def_readonly("stages", &MetricsSnapshot::stages)
+        .def_readonly("counters", &MetricsSnapshot::counters);
+
+    py::class_<BudgetStats>(m, "BudgetStats")
+        .def_readonly("calls", &BudgetStats::calls)
+        .def_readonly("partial_calls", &BudgetStats::partial_calls)
+        .def_readonly("searches", &BudgetStats::searches)
+        .def_readonly("stopped_searches", &BudgetStats::stopped_searches);
 
     py::class_<qbz::QueryBlazer>(m, "QueryBlazer")
         .def(py::init<const std::string &, const std::string &,
                       const Config &>(),
              py::arg("encoder"), py::arg("model"),
              py::arg("config") = Config{})
-        .def("Complete", &QueryBlazer::Complete, py::arg("query"))
+        .def(
+            "Complete",
+            [](const QueryBlazer &queryBlazer, const std::string &query) {
+                return queryBlazer.Complete(query);
+            },
+            py::arg("query"), py::call_guard<py::gil_scoped_release>())
+        .def(
+            "CompleteWithin",
+            [](const QueryBlazer &queryBlazer, const std::string &query,
+               long long time_us, size_t max_expansions) {
+                QueryBlazer::Completion completion;
+                const auto partial = queryBlazer.Complete(
+                    query, &completion, std::chrono::microseconds{time_us},
+                    max_expansions);
+                return std::make_pair(std::move(completion), partial);
+            },
+            py::arg("query"), py::arg("time_us"),
+            py::arg("max_expansions") = 0,
+            py::call_guard<py::gil_scoped_release>())
+        .def("CompleteBatch", &QueryBlazer::CompleteBatch, py::arg("queries"),
+             py::call_guard<py::gil_scoped_release>())
         .def("LoadPrecomputed", &QueryBlazer::LoadPrecomputed,
              py::arg("input_file"))
         .def("SavePrecomputed", &QueryBlazer::SavePrecomputed,
-             py::arg("output_file"));
+             py::arg("output_file"), py::arg("cost_bits") = 0)
+        .def("PrecomputeFromLog", &QueryBlazer::PrecomputeFromLog,
+             py::arg("prefix_file"), py::arg("max_bytes"),
+             py::arg("output_file"), py::arg("cost_bits") = 0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("PrecomputeIncremental", &QueryBlazer::PrecomputeIncremental,
+             py::arg("old_model"), py::arg("old_precomputed"),
+             py::arg("output_file"), py::arg("cost_bits") = 0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("CompletionCacheStats", &QueryBlazer::CompletionCacheStats)
+        .def("BudgetStats", &QueryBlazer::GetBudgetStats)
+        .def("Metrics", &QueryBlazer::GetMetrics)
+        .def("ResetMetrics", &QueryBlazer::ResetMetrics)
+        .def("DumpTraces", &QueryBlazer::DumpTraces);
+
+    py::class_<QueryBlazer::Session>(m, "Session")
+        .def(py::init<const QueryBlazer &>(), py::arg("queryblazer"),
+             py::keep_alive<1, 2>())
+        .def("Append", &QueryBlazer::Session::Append, py::arg("characters"))
+        .def("Backspace", &QueryBlazer::Session::Backspace)
+        .def("Reset", &QueryBlazer::Session::Reset)
+        .def("Prefix", &QueryBlazer::Session::Prefix)
+        .def(
+            "Complete",
+            [](QueryBlazer::Session &session) { return session.Complete(); },
+            py::call_guard<py::gil_scoped_release>())
+        .def(
+            "CompleteWithin",
+            [](QueryBlazer::Session &session, long long time_us,
+               size_t max_expansions) {
+                QueryBlazer::Completion completion;
+                const auto partial =
+                    session.Complete(&completion,
+                                     std::chrono::microseconds{time_us},
+                                     max_expansions);
+                return std::make_pair(std::move(completion), partial);
+            },
+            py::arg("time_us"), py::arg("max_expansions") = 0,
+            py::call_guard<py::gil_scoped_release>());
 
     py::class_<Mpc>(m, "Mpc")
-        .def(py::init<const std::string &, const std::string &>(),
-             py::arg("trie"), py::arg("mpc"))
-        .def("Complete", &Mpc::Complete, py::arg("prefix"));
+        .def(py::init<const std::string &, const std::string &, bool,
+                      size_t, bool>(),
+             py::arg("trie"), py::arg("mpc"), py::arg("mmap") = false,
+             py::arg("cache_bytes") = 0, py::arg("metrics") = false)
+        .def("Complete", &Mpc::Complete, py::arg("prefix"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("CompleteBatch", &Mpc::CompleteBatch, py::arg("prefixes"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("CompletionCacheStats", &Mpc::CompletionCacheStats)
+        .def("Metrics", &Mpc::GetMetrics)
+        .def("ResetMetrics", &Mpc::ResetMetrics);
 }
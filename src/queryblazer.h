@@ -9,21 +9,47 @@
 #define QUERYBLAZER_QUERYBLAZER_H
 
 #include "ThreadPool.h"
+#include "beam_store.h"
 #include "boost/archive/binary_iarchive.hpp"
 #include "boost/archive/binary_oarchive.hpp"
 #include "boost/serialization/utility.hpp"
 #include "boost/serialization/vector.hpp"
+#include "budget.h"
+#include "cache.h"
+#include "char_map.h"
 #include "common.h"
 #include "encoder.h"
+#include "encoder_trie.h"
 #include "fst/fstlib.h"
-#include "prefix_tree.h"
+#include "lazy_table.h"
+#include "metrics.h"
+#include "model_diff.h"
+#include "parallel.h"
+#include "precomputed.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "top_arcs.h"
+#include "trace.h"
 #include "transition.h"
+#include <atomic>
+#include <cmath>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 namespace qbz {
 
+/**
+ * QueryBlazer options; the original ones may be given positionally, and the
+ * rest are set by name, e.g.,
+ *     Config config{30, 50};
+ *     config.cache_bytes = 1 << 30;
+ * QueryBlazer validates the config again when created
+ */
 struct Config {
     explicit Config(size_t branch_factor = 30, size_t beam_size = 30,
                     size_t topk = 10, size_t length_limit = 100,
@@ -34,365 +60,1384 @@ struct Config {
           length_limit{length_limit},
           precompute{precompute},
           verbose{verbose} {
+        Validate();
+    }
+
+    /**
+     * Whether the search may return fewer than topk completions
+     */
+    bool Prunes() const { return beam_gap > 0.0f || stable_steps > 0; }
+
+    /**
+     * Throw if an option is out of range or conflicts with another
+     */
+    void Validate() const {
         QBZ_ASSERT(branch_factor >= 1,
                    "Branch factor must be greater positive");
         QBZ_ASSERT(beam_size >= 1, "Beam size must be positive");
         QBZ_ASSERT(beam_size >= topk, "Beam size must be geq to topk");
+        QBZ_ASSERT(beam_gap >= 0.0f, "Beam gap must be non-negative");
+        QBZ_ASSERT(trace_sample >= 1, "Trace sample must be positive");
+        QBZ_ASSERT(!cache_bytes || !top_arcs.empty(),
+                   "cache_bytes requires top_arcs, or top arcs computed on "
+                   "demand would not be bounded");
     }
 
-    const size_t branch_factor;
-    const size_t beam_size;
-    const size_t topk;
-    const size_t length_limit;
-    const bool precompute;
-    const bool verbose;
+    size_t branch_factor;
+    size_t beam_size;
+    size_t topk;
+    size_t length_limit;
+    bool precompute;
+    bool verbose;
+    // memory-map aligned FST files instead of reading them into the heap
+    bool mmap = false;
+    // memory budget for results computed on demand; 0 keeps them all
+    size_t cache_bytes = 0;
+    // memory budget for completions of recent prefixes; 0 disables the cache
+    size_t completion_cache_bytes = 0;
+    // threads for precompute & batches; 0 for hardware concurrency
+    size_t num_threads = 0;
+    // top arc file built from the model by qbz_build_top_arcs; if empty,
+    // top arcs & exit costs are computed from the model as needed
+    std::string top_arcs;
+    // drop hypotheses costing more than the best of their step plus this
+    // gap, in model cost units; 0 disables
+    float beam_gap = 0.0f;
+    // stop searching once the top k have not changed for this many steps;
+    // 0 disables
+    size_t stable_steps = 0;
+    // collect per-stage latency histograms & counters; see GetMetrics
+    bool metrics = false;
+    // keep search traces of completions slower than this; 0 disables
+    size_t trace_threshold_us = 0;
+    // trace 1 out of this many completions
+    size_t trace_sample = 1;
+    // # of latest slow traces kept; see DumpTraces
+    size_t trace_capacity = 256;
 };
 
 class QueryBlazer {
+  public:
+    // (vector(suggestion, cost), decoding length)
+    using Completion =
+        std::pair<std::vector<std::pair<std::string, float>>, size_t>;
+
   private:
-    // (vector(olabel_sequences, cost), decoding length)
-    using BeamSearchResult =
-        std::pair<std::vector<std::pair<std::vector<int>, float>>, size_t>;
+    using Arc = TopArc;
+
+    // stages of a completion timed by the metrics
+    enum Stage : size_t {
+        STAGE_ENCODE,
+        STAGE_MODEL_WALK,
+        STAGE_INIT_BEAMS,
+        STAGE_MERGE,
+        STAGE_RENDER,
+        STAGE_SEARCH,
+        STAGE_TOTAL
+    };
 
-    class Arc {
-      private:
-        // required for serialization but want to hide it otherwise
-        friend class boost::serialization::access;
-        Arc() {}
+    // events counted by the metrics
+    enum Counter : size_t {
+        COUNT_INIT_BEAMS,
+        COUNT_HYPOTHESES,
+        COUNT_ARCS_SCANNED,
+        COUNT_TOP_ARC_FILLS,
+        COUNT_RESULT_FILLS,
+        COUNT_UNK_OLABELS,
+        COUNT_OOV_CHARS
+    };
 
-        template <class Archive>
-        void serialize(Archive &ar, const unsigned int version) {
-            ar &olabel;
-            ar &ilabel;
-            ar &nextstate;
-            ar &weight;
-        }
+    using EM = fst::SortedMatcher<fst::StdExpandedFst>;
+    using PM = fst::PhiMatcher<fst::SortedMatcher<fst::StdExpandedFst>>;
 
-      public:
-        int olabel, ilabel, nextstate;
-        float weight;
-
-        explicit Arc(const fst::StdArc &arc)
-            : olabel{arc.olabel},
-              ilabel{arc.ilabel},
-              nextstate{arc.nextstate},
-              weight{arc.weight.Value()} {}
+    struct Beam {
+        explicit Beam(int state, float cost) : state{state}, cost{cost} {}
+
+        bool operator<(const Beam &that) const { return cost < that.cost; }
+
+        int state;
+        float cost;
+    };
+
+    // (encoder olabel sequence, beam after the sequence)
+    using InitBeam = std::pair<Span<int>, Beam>;
+
+    /**
+     * Pending node of the depth-first walk over the encoder trie
+     */
+    struct TrieFrame {
+        uint32_t node;
+        int model_state;
+        float cost;
+    };
+
+    /**
+     * Completion candidate; olabels are decoded only once it makes the top k
+     */
+    struct Candidate {
+        Span<int> init_olabels;
+        // index into Context::results
+        size_t result;
+        // index into the result
+        size_t idx;
+        float cost;
+    };
+
+    /**
+     * Encoder & model position after consuming a prefix
+     */
+    struct Cursor {
+        int encoder_state;
+        int model_state;
+        // cost of the stable olabels emitted so far
+        float init_cost;
+        // byte length of the stable prefix
+        size_t stable_size;
     };
 
+    // model data below is shared by all threads and never modified once
+    // constructed, except for the lazily filled tables
     const unsigned num_proc;
     const std::unique_ptr<fst::StdExpandedFst> encoder, model;
     const Config config;
-    std::vector<std::vector<Arc>> topArcs;
+    // serves CompleteBatch
+    mutable WorkerPool workers;
+    // top arcs & exit costs mapped from a top arc file, if configured;
+    // otherwise top arcs are computed on demand into topArcs, which keeps
+    // every state searched, hence the file is required with cache_bytes
+    std::unique_ptr<const TopArcTable> topArcTable;
+    mutable LazyTable<TopArcList> topArcs;
+    // results precomputed in memory (precompute config or legacy archive)
     std::vector<BeamSearchResult> topResults;
-    std::vector<std::vector<std::vector<int>>> encoderTransitions;
-
-    using PM = fst::PhiMatcher<fst::SortedMatcher<fst::StdExpandedFst>>;
-    fst::SortedMatcher<fst::StdExpandedFst> encoderMatcher;
-    PM phiMatcher;
+    // results mapped from a flat precomputed file
+    std::unique_ptr<const PrecomputedResults> precomputed;
+    // states without precomputed results are computed on demand into one of
+    // these; the cache is used if the config sets a memory budget
+    mutable LazyTable<BeamSearchResult> lazyResults;
+    mutable LruCache<int, BeamSearchResult> resultCache;
+    mutable std::atomic<size_t> budgetCalls{0}, partialCalls{0},
+        budgetSearches{0}, stoppedSearches{0};
+    mutable Metrics metrics;
+    // slow completion traces, if enabled
+    std::unique_ptr<TraceRing> traces;
+    mutable std::atomic<uint64_t> traceCalls{0};
+    // completions keyed by the code points of the prefix; see CacheKey
+    mutable LruCache<std::u32string, Completion> completionCache;
+    EncoderTrie encoderTrie;
+    CharMap charMap;
+    // output token strings with SPACE rendered as ' '; empty for UNK
+    std::vector<std::string> tokens;
     int encoder_begin_state;
 
   public:
+    /**
+     * Per-thread search state
+     * Matchers are stateful, so each thread calling Complete concurrently
+     * needs its own context; a context is cheap to create and may be reused
+     * across calls on the same thread
+     */
+    class Context {
+      public:
+        explicit Context(const QueryBlazer &queryBlazer)
+            : encoderMatcher{queryBlazer.encoder.get(),
+                             fst::MatchType::MATCH_INPUT},
+              phiMatcher{queryBlazer.model.get(),
+                         fst::MatchType::MATCH_INPUT,
+                         IDX_PHI,
+                         true,
+                         fst::MATCHER_REWRITE_AUTO,
+                         new EM{queryBlazer.model.get(),
+                                fst::MatchType::MATCH_INPUT, IDX_UNK + 1}},
+              beamTopK{queryBlazer.config.beam_size},
+              resultTopK{queryBlazer.config.topk} {}
+
+      private:
+        EM encoderMatcher;
+        PM phiMatcher;
+        // scratch buffers reused between calls
+        std::vector<int> olabels;
+        std::string stable_prefix;
+        std::u32string key;
+        std::vector<TrieFrame> frames;
+        BeamStore beamStore;
+        std::vector<InitBeam> beams;
+        std::vector<ResultView> results;
+        // keeps cached results alive while their views are in use
+        std::vector<std::shared_ptr<const BeamSearchResult>> pinned;
+        std::vector<Candidate> candidates;
+        std::vector<int> decoded;
+        TopK<float> beamTopK, resultTopK;
+        // budget of the current call & whether it ran out
+        SearchBudget budget;
+        bool partial = false;
+        // stage times of the current call, if metrics are enabled
+        StageTimes times;
+        // trace of the current call if traced, in trace_buffer
+        QueryTrace *trace = nullptr;
+        std::unique_ptr<QueryTrace> trace_buffer;
+
+        friend class QueryBlazer;
+    };
+
+  private:
+    /**
+     * Context borrowed from contextPool for the duration of a call, so that
+     * calls without a context of their own still reuse warm matchers and
+     * buffers; the pool grows to the # of concurrent such calls
+     */
+    class PooledContext {
+      public:
+        explicit PooledContext(const QueryBlazer &queryBlazer)
+            : queryBlazer(queryBlazer) {
+            {
+                std::lock_guard<std::mutex> lock{queryBlazer.contextMutex};
+                if (!queryBlazer.contextPool.empty()) {
+                    context = std::move(queryBlazer.contextPool.back());
+                    queryBlazer.contextPool.pop_back();
+                }
+            }
+            if (!context) context.reset(new Context{queryBlazer});
+        }
+
+        PooledContext(const PooledContext &) = delete;
+
+        PooledContext &operator=(const PooledContext &) = delete;
+
+        ~PooledContext() {
+            std::lock_guard<std::mutex> lock{queryBlazer.contextMutex};
+            queryBlazer.contextPool.push_back(std::move(context));
+        }
+
+        Context &Get() { return *context; }
+
+      private:
+        const QueryBlazer &queryBlazer;
+        std::unique_ptr<Context> context;
+    };
+
+    // idle contexts of calls without a context; declared after the FSTs,
+    // so that they are destroyed first
+    mutable std::mutex contextMutex;
+    mutable std::vector<std::unique_ptr<Context>> contextPool;
+
+  public:
+    /**
+     * Keystroke session that keeps encoder & model state between calls, so
+     * that each typed character costs a single encoder/model step instead of
+     * re-encoding the whole prefix
+     * Not thread-safe; use one session per input stream
+     */
+    class Session {
+      public:
+        explicit Session(const QueryBlazer &queryBlazer)
+            : queryBlazer(queryBlazer),
+              context{queryBlazer} {
+            Reset();
+        }
+
+        /**
+         * Clear the prefix
+         */
+        void Reset() {
+            cursors.assign(1, queryBlazer.BeginCursor());
+            stable_prefix.clear();
+            prefix.clear();
+        }
+
+        /**
+         * Append one or more (UTF-8) characters to the prefix
+         */
+        void Append(const std::string &characters) {
+            queryBlazer.Measured(context, false, [this, &characters]() {
+                ForEachChar(characters, [this](char32_t c) {
+                    auto cursor = cursors.back();
+                    queryBlazer.Advance(c, context, &cursor, &stable_prefix);
+                    cursors.push_back(cursor);
+                    prefix.push_back(c);
+                });
+            });
+        }
+
+        /**
+         * Remove the last character
+         * @return false if the prefix is already empty
+         */
+        bool Backspace() {
+            if (prefix.empty()) return false;
+            cursors.pop_back();
+            prefix.pop_back();
+            stable_prefix.resize(cursors.back().stable_size);
+            return true;
+        }
+
+        std::string Prefix() const {
+            return prefix.empty() ? std::string{} : ToString(prefix);
+        }
+
+        /**
+         * Complete the current prefix
+         */
+        Completion Complete() {
+            Completion completion;
+            Complete(&completion);
+            return completion;
+        }
+
+        /**
+         * Same as above but reuses the memory of completion
+         */
+        void Complete(Completion *completion) {
+            context.budget.Disable();
+            queryBlazer.Measured(context, true, [this, completion]() {
+                TraceSession();
+                queryBlazer.Complete(cursors.back(), stable_prefix, context,
+                                     completion);
+            });
+        }
+
+        /**
+         * Complete the current prefix within a budget; see
+         * QueryBlazer::Complete
+         * @return true if the completion is partial
+         */
+        bool Complete(Completion *completion, std::chrono::microseconds time,
+                      size_t max_expansions = 0) {
+            return queryBlazer.RunWithin(
+                context, time, max_expansions, [this, completion]() {
+                    queryBlazer.Measured(context, true, [this, completion]() {
+                        TraceSession();
+                        queryBlazer.Complete(cursors.back(), stable_prefix,
+                                             context, completion);
+                    });
+                });
+        }
+
+      private:
+        /**
+         * Fill the prefix & its state path into the trace, if traced
+         */
+        void TraceSession() {
+            if (!context.trace) return;
+            context.trace->query = ToString(prefix);
+            for (size_t idx = 1; idx < cursors.size(); ++idx) {
+                context.trace->encoder_states.push_back(
+                    cursors[idx].encoder_state);
+                context.trace->model_states.push_back(
+                    cursors[idx].model_state);
+            }
+        }
+
+        const QueryBlazer &queryBlazer;
+        Context context;
+        // cursor after each character; front is the empty prefix
+        std::vector<Cursor> cursors;
+        std::string stable_prefix;
+        Utf8 prefix;
+    };
+
     explicit QueryBlazer(const std::string &encoder, const std::string &model,
                          const Config &config = Config{})
-        : num_proc{std::thread::hardware_concurrency()},
-          encoder{fst::StdExpandedFst::Read(encoder)},
-          model{fst::StdExpandedFst::Read(model)},
+        : num_proc{config.num_threads
+                       ? static_cast<unsigned>(config.num_threads)
+                       : std::max(std::thread::hardware_concurrency(), 1u)},
+          encoder{ReadFst(encoder, config.mmap)},
+          model{ReadFst(model, config.mmap)},
           config{config},
-          encoderMatcher{this->encoder.get(), fst::MatchType::MATCH_INPUT},
-          phiMatcher{this->model.get(),
-                     fst::MatchType::MATCH_INPUT,
-                     IDX_PHI,
-                     true,
-                     fst::MATCHER_REWRITE_AUTO,
-                     new fst::SortedMatcher<fst::StdExpandedFst>{
-                         this->model.get(), fst::MatchType::MATCH_INPUT,
-                         IDX_UNK + 1}} {
+          workers{num_proc},
+          resultCache{config.cache_bytes},
+          metrics{config.metrics,
+                  {"encode", "model_walk", "init_beams", "merge", "render",
+                   "search", "total"},
+                  {"init_beams", "hypotheses", "arcs_scanned",
+                   "top_arc_fills", "result_fills", "unk_olabels",
+                   "oov_chars"}},
+          traces{config.trace_threshold_us
+                     ? new TraceRing{config.trace_capacity}
+                     : nullptr},
+          completionCache{config.completion_cache_bytes} {
+        config.Validate();
         QBZ_ASSERT(this->encoder, "Invalid encoder: " + encoder);
         QBZ_ASSERT(this->model, "Invalid model: " + model);
         QBZ_ASSERT(this->encoder->OutputSymbols()->LabeledCheckSum() ==
                        this->model->InputSymbols()->LabeledCheckSum(),
                    "Encoder's symbols does not match with that of model's");
+        charMap = CharMap{*this->encoder->InputSymbols()};
+        RenderTokens();
+        EM encoderMatcher{this->encoder.get(), fst::MatchType::MATCH_INPUT};
         encoderMatcher.SetState(this->encoder->Start());
-        QBZ_ASSERT(encoderMatcher.Find(
-                       this->encoder->InputSymbols()->Find(ToString({SPACE}))),
+        QBZ_ASSERT(encoderMatcher.Find(charMap.Find(SPACE)),
                    "Encoder begin state not found");
         encoder_begin_state = encoderMatcher.Value().nextstate;
-        ComputeEncoderTransitions();
+        ComputeEncoderTransitions(encoderMatcher);
+        if (!config.top_arcs.empty()) {
+            topArcTable.reset(new TopArcTable{config.top_arcs});
+            QBZ_ASSERT(topArcTable->NumStates() ==
+                               static_cast<size_t>(this->model->NumStates()) &&
+                           topArcTable->BranchFactor() == config.branch_factor,
+                       config.top_arcs + " does not match the model & config");
+            // hashing the whole model would read every page of it; the
+            // offline tools compare ModelChecksum instead
+            QBZ_ASSERT(topArcTable->ModelBytes() == FileSize(model),
+                       config.top_arcs + " was built from a different model");
+        }
         PrecomputeTopResults(config.precompute);
     }
 
     /**
-     * Load beam search results from a serialized file
+     * Load beam search results from a precomputed file
+     * Flat & compressed files are mapped into memory and shared between
+     * processes; legacy Boost archives are read into the heap
      */
     bool LoadPrecomputed(const std::string &input_file) {
         if (config.precompute) return false;
+        if (!PrecomputedResults::IsPrecomputed(input_file))
+            return LoadArchive(input_file);
 
-        std::ifstream ifs{input_file};
-        QBZ_ASSERT(ifs, "Error opening " + input_file);
-        boost::archive::binary_iarchive iarchive{ifs};
-        size_t size, topk;
-        iarchive >> size;
-        iarchive >> topk;
-        if (size != topResults.size() || topk != config.topk) return false;
+        std::unique_ptr<const PrecomputedResults> results{
+            new PrecomputedResults{input_file}};
+        if (results->NumStates() != model->NumStates() ||
+            results->TopK() != config.topk)
+            return false;
+        precomputed = std::move(results);
         topResults.clear();
-        iarchive >> topResults;
-        QBZ_ASSERT(topResults.size() == model->NumStates(),
-                   "NumStates mismatch");
-        topArcs.clear();
+        topResults.shrink_to_fit();
+        topArcs.Clear();
+        lazyResults.Clear();
+        resultCache.Clear();
         return true;
     }
 
     /**
-     * Save beam search results into a serialized file
+     * Save beam search results into a precomputed file
+     * @param cost_bits: 0 to store float costs, or 8 / 16 to compress the
+     * file with quantized costs & varint-coded olabels
      */
-    bool SavePrecomputed(const std::string &output_file) {
+    bool SavePrecomputed(const std::string &output_file,
+                         unsigned cost_bits = 0) {
         if (!config.precompute) {
             std::cerr << "Config's precompute flag is false" << std::endl;
             return false;
         }
 
-        std::ofstream ofs{output_file};
-        QBZ_ASSERT(ofs, "Error opening " + output_file);
-        boost::archive::binary_oarchive oarchive{ofs};
-        oarchive << topResults.size();
-        oarchive << config.topk;
-        oarchive << topResults;
+        WritePrecomputed(output_file, config.topk, topResults, cost_bits);
         return true;
     }
 
-    std::pair<std::vector<std::pair<std::string, float>>, size_t>
-    Complete(const std::string &query) {
-        std::vector<std::pair<std::string, float>> suggestions;
-        suggestions.reserve(config.topk);
-
-        auto prefix = ToUtf8(query);
-        std::replace(prefix.begin(), prefix.end(), static_cast<char32_t>(' '),
-                     SPACE);
-        Utf8 oovs;
-        std::vector<int> ilabels;
-        ilabels.reserve(prefix.size());
-        for (auto c : prefix) {
-            auto ilabel = encoder->InputSymbols()->Find(ToString({c}));
-            if (ilabel == fst::kNoSymbol) {
-                oovs.push_back(c);
-                ilabel = IDX_UNK;
+    /**
+     * Precompute beam search results only for the model states reached by a
+     * prefix log, most frequent first, until the output file would take
+     * more than max_bytes, and save them into a precomputed file
+     * The file sizes as a flat file, whose offset & decode length tables of
+     * every model state take a fixed part of max_bytes; compressed files are
+     * smaller.
+     * Other states are left empty in the file and computed on demand when
+     * loaded, so set cache_bytes (and top_arcs) in the config to bound their
+     * memory
+     * @param prefix_file: one prefix per line; anything after a tab is
+     * ignored, so the output of script/extract_prefix.py can be used as is
+     * @param cost_bits: see SavePrecomputed
+     * @return number of states precomputed
+     */
+    size_t PrecomputeFromLog(const std::string &prefix_file, size_t max_bytes,
+                             const std::string &output_file,
+                             unsigned cost_bits = 0) const {
+        std::ifstream ifs{prefix_file};
+        QBZ_ASSERT(ifs, "Error reading " + prefix_file);
+        std::vector<std::string> prefixes;
+        std::string line;
+        while (std::getline(ifs, line))
+            prefixes.push_back(line.substr(0, line.find('\t')));
+
+        // count how often each state is searched from
+        std::unordered_map<int, size_t> counts;
+        std::mutex mutex;
+        workers.ParallelFor(prefixes.size(), [&](size_t begin, size_t end) {
+            Context context{*this};
+            std::unordered_map<int, size_t> local;
+            for (auto idx = begin; idx < end; ++idx) {
+                auto cursor = BeginCursor();
+                context.stable_prefix.clear();
+                ForEachChar(prefixes[idx], [&](char32_t c) {
+                    Advance(c, context, &cursor, &context.stable_prefix);
+                });
+                for (const auto &beam : InitBeams(context, cursor.encoder_state,
+                                                  cursor.model_state))
+                    ++local[beam.second.state];
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            for (const auto &pair : local) counts[pair.first] += pair.second;
+        });
+        std::vector<std::pair<int, size_t>> ranked{counts.begin(),
+                                                   counts.end()};
+        std::sort(ranked.begin(), ranked.end(),
+                  [](const std::pair<int, size_t> &a,
+                     const std::pair<int, size_t> &b) {
+                      return a.second != b.second ? a.second > b.second
+                                                  : a.first < b.first;
+                  });
+        std::cerr << prefixes.size() << " prefixes reach " << ranked.size()
+                  << " of " << model->NumStates() << " states" << std::endl;
+
+        // the tables of every state are taken out of the budget first, plus
+        // a word for the alignment of the sections
+        const auto fixed_bytes =
+            PrecomputedLayout{MakePrecomputedHeader(PRECOMPUTED_VERSION,
+                                                    config.topk,
+                                                    model->NumStates(), 0,
+                                                    0)}
+                .size +
+            sizeof(uint64_t);
+        QBZ_ASSERT(max_bytes >= fixed_bytes,
+                   "max_bytes is below the " + std::to_string(fixed_bytes) +
+                       " bytes of the per-state tables");
+        max_bytes -= fixed_bytes;
+
+        // compute in chunks of frequent states until the budget runs out
+        std::vector<std::pair<int, BeamSearchResult>> hot;
+        const size_t chunk_size = 64 * std::max(num_proc, 1u);
+        size_t bytes = 0;
+        for (size_t first = 0; first < ranked.size() && bytes < max_bytes;
+             first += chunk_size) {
+            std::vector<BeamSearchResult> chunk(
+                std::min(chunk_size, ranked.size() - first));
+            workers.ParallelFor(
+                chunk.size(), [&](size_t begin, size_t end) {
+                    BeamStore store;
+                    for (auto idx = begin; idx < end; ++idx)
+                        chunk[idx] =
+                            ComputeTopResult(ranked[first + idx].first, store);
+                });
+            for (size_t idx = 0; idx < chunk.size(); ++idx) {
+                const auto size = FlatBytes(chunk[idx]);
+                if (bytes + size > max_bytes) {
+                    bytes = max_bytes;
+                    break;
+                }
+                bytes += size;
+                hot.emplace_back(ranked[first + idx].first,
+                                 std::move(chunk[idx]));
             }
-            ilabels.push_back(ilabel);
         }
+        std::cerr << "Precomputed " << hot.size() << " states in " << bytes
+                  << " bytes besides " << fixed_bytes
+                  << " bytes of per-state tables" << std::endl;
+
+        std::sort(hot.begin(), hot.end(),
+                  [](const std::pair<int, BeamSearchResult> &a,
+                     const std::pair<int, BeamSearchResult> &b) {
+                      return a.first < b.first;
+                  });
+        const BeamSearchResult empty;
+        WritePrecomputed(
+            output_file, config.topk, model->NumStates(),
+            [&hot, &empty](size_t state) -> const BeamSearchResult & {
+                const auto it = std::lower_bound(
+                    hot.begin(), hot.end(), static_cast<int>(state),
+                    [](const std::pair<int, BeamSearchResult> &a, int b) {
+                        return a.first < b;
+                    });
+                return it != hot.end() && it->first == static_cast<int>(state)
+                           ? it->second
+                           : empty;
+            },
+            cost_bits);
+        return hot.size();
+    }
 
-        int encoder_state;
-        auto stable_output_seq =
-            Encode(*encoder, encoderMatcher, encoder_begin_state, ilabels,
-                   false, &encoder_state);
-        std::string stable_prefix;
-        auto oov_idx = 0;
-        for (auto id : stable_output_seq) {
-            if (id == IDX_UNK) {
-                stable_prefix += ToString({oovs.at(oov_idx++)});
-            } else {
-                stable_prefix += encoder->OutputSymbols()->Find(id);
-            }
+    /**
+     * Precompute beam search results of model states [begin, end) into shard
+     * files of states_per_shard states under dir
+     * Each shard is written as soon as it is done, so that memory is bounded
+     * by one shard, and shards already in dir are skipped, so that a rerun
+     * after a crash resumes where it stopped. Merge with MergeShards.
+     * Set config's precompute flag to false, so that nothing else is held.
+     * @param model_checksum: FileChecksum of the model, recorded in shards
+     * @param end: clipped to the number of model states
+     * @return number of shards computed by this call
+     */
+    size_t PrecomputeShards(const std::string &dir, uint64_t model_checksum,
+                            size_t states_per_shard, size_t begin = 0,
+                            size_t end = SIZE_MAX) {
+        QBZ_ASSERT(states_per_shard > 0, "states_per_shard must be positive");
+        end = std::min<size_t>(end, model->NumStates());
+        QBZ_ASSERT(begin <= end, "Invalid state range");
+        MakeDirectory(dir);
+        auto header = MakeShardHeader(
+            config.topk, config.beam_size, config.branch_factor,
+            config.length_limit, config.beam_gap, config.stable_steps,
+            model->NumStates(), model_checksum);
+
+        std::vector<ShardHeader> done;
+        for (const auto &file : ListShards(dir)) {
+            const Shard shard{file};
+            QBZ_ASSERT(SameBuild(shard.Header(), header),
+                       file + " was built from a different model or config");
+            done.push_back(shard.Header());
         }
-        QBZ_ASSERT(oov_idx == oovs.size(), "OOV size mismatch");
 
-        auto model_state = model->Start();
-        float init_cost = 0.0f;
-        for (auto id : stable_output_seq) {
-            phiMatcher.SetState(model_state);
-            if (!phiMatcher.Find(id)) {
-                QBZ_ASSERT(phiMatcher.Find(IDX_UNK),
-                           "UNK token not found in the model");
+        RangeScheduler scheduler{num_proc};
+        std::vector<BeamStore> stores(scheduler.NumThreads());
+        std::vector<BeamSearchResult> results;
+        size_t num_computed = 0;
+        for (auto first = begin; first < end; first += states_per_shard) {
+            header.begin = first;
+            header.end = std::min(end, first + states_per_shard);
+            bool exists = false;
+            for (const auto &shard : done) {
+                if (shard.end <= header.begin || shard.begin >= header.end)
+                    continue;
+                QBZ_ASSERT(shard.begin == header.begin &&
+                               shard.end == header.end,
+                           "Shards in " + dir +
+                               " were written with other state ranges");
+                exists = true;
             }
-            init_cost += phiMatcher.Value().weight.Value();
-            model_state = phiMatcher.Value().nextstate;
+            if (exists) continue;
+
+            results.assign(header.end - header.begin, BeamSearchResult{});
+            scheduler.Run(
+                "states " + std::to_string(header.begin) + "-" +
+                    std::to_string(header.end),
+                results.size(),
+                [&](size_t begin, size_t end, size_t worker) {
+                    for (auto idx = begin; idx < end; ++idx)
+                        results[idx] = ComputeTopResult(
+                            static_cast<int>(header.begin + idx),
+                            stores[worker]);
+                });
+            WriteShard(ShardFile(dir, header.begin, header.end), header,
+                       [&](uint64_t state) -> const BeamSearchResult & {
+                           return results[state - header.begin];
+                       });
+            // top arcs are cached for every state a search visits; drop them
+            // between shards, or they would grow with the whole model
+            topArcs.Clear();
+            ++num_computed;
         }
+        std::cerr << "Computed " << num_computed << " shards of states "
+                  << begin << " to " << end << " into " << dir << std::endl;
+        return num_computed;
+    }
 
-        auto beams = InitBeams(encoder_state, model_state);
-        std::pair<std::vector<std::pair<std::vector<int>, float>>, size_t>
-            autocomplete;
+    /**
+     * Update the precomputed file of an older model (e.g., before the query
+     * log was refreshed) to this model, recomputing only the states whose
+     * beam search may have changed, and save it into a precomputed file
+     * States are matched across models by n-gram history. A state changed if
+     * it is new, or its top arcs or exit cost differ. A search from a state
+     * cannot change if no changed state is reachable over top arcs at a cost
+     * below its old k-th best completion, since costs only grow along a
+     * path; such states are copied, and all others recomputed.
+     * The config must equal the one of the old file; decode lengths of
+     * copied states are kept as they were. With stable_steps, when a search
+     * stops depends on every hypothesis it ranks, so the bound does not hold
+     * and every state is recomputed.
+     * @param old_precomputed: flat precomputed file of old_model
+     * @param cost_bits: see SavePrecomputed
+     * @return number of states recomputed
+     */
+    size_t PrecomputeIncremental(const std::string &old_model_file,
+                                 const std::string &old_precomputed,
+                                 const std::string &output_file,
+                                 unsigned cost_bits = 0) const {
+        std::unique_ptr<fst::StdExpandedFst> old_model{
+            ReadFst(old_model_file, config.mmap)};
+        QBZ_ASSERT(old_model, "Invalid model: " + old_model_file);
+        QBZ_ASSERT(old_model->InputSymbols()->LabeledCheckSum() ==
+                       model->InputSymbols()->LabeledCheckSum(),
+                   "Old model's symbols do not match with that of model's");
+        const PrecomputedResults old_results{old_precomputed};
+        QBZ_ASSERT(old_results.NumStates() ==
+                           static_cast<size_t>(old_model->NumStates()) &&
+                       old_results.TopK() == config.topk,
+                   old_precomputed + " does not match " + old_model_file);
+        // quantized costs would make the thresholds below inexact
+        QBZ_ASSERT(old_results.Stats().cost_bits == 32,
+                   old_precomputed + " must be a flat precomputed file");
+
+        const auto num_states = static_cast<size_t>(model->NumStates());
+        const auto match = MatchStates(ComputeHistories(*model), *old_model,
+                                       ComputeHistories(*old_model));
+
+        RangeScheduler scheduler{num_proc};
+        std::vector<std::unique_ptr<EM>> matchers, old_matchers;
+        for (size_t idx = 0; idx < scheduler.NumThreads(); ++idx) {
+            matchers.emplace_back(new EM{model.get(),
+                                         fst::MatchType::MATCH_INPUT,
+                                         IDX_UNK + 1});
+            old_matchers.emplace_back(new EM{old_model.get(),
+                                             fst::MatchType::MATCH_INPUT,
+                                             IDX_UNK + 1});
+        }
+        std::vector<uint8_t> changed(num_states, 0);
+        std::atomic<bool> negative{false};
+        scheduler.Run(
+            "model diff", num_states,
+            [&](size_t begin, size_t end, size_t worker) {
+                for (auto state = begin; state < end; ++state) {
+                    const auto arcs = GetTopArcs(static_cast<int>(state));
+                    const auto exit_cost = GetExitCost(
+                        static_cast<int>(state), *matchers[worker]);
+                    if (exit_cost < 0) negative = true;
+                    for (const auto &arc : arcs)
+                        if (arc.weight < 0) negative = true;
+
+                    const auto old_state = match[state];
+                    if (old_state == fst::kNoStateId) {
+                        changed[state] = 1;
+                        continue;
+                    }
+                    const auto old_arcs = TopArcs<Arc>(
+                        *old_model, old_state, config.branch_factor);
+                    auto same = arcs.Size() == old_arcs.size() &&
+                                exit_cost == MakeExitTransitions(
+                                                 *old_model,
+                                                 *old_matchers[worker],
+                                                 old_state);
+                    for (size_t idx = 0; same && idx < arcs.Size(); ++idx)
+                        same = arcs[idx].ilabel == old_arcs[idx].ilabel &&
+                               arcs[idx].olabel == old_arcs[idx].olabel &&
+                               arcs[idx].weight == old_arcs[idx].weight &&
+                               match[arcs[idx].nextstate] ==
+                                   old_arcs[idx].nextstate;
+                    changed[state] = !same;
+                }
+            });
 
-        TopK<float> topK{config.topk};
-        for (const auto &beam : beams) {
-            // beam stores score before beam search (i.e., minimal olabel
-            // sequences) will not insert cost but make sure it is within range
-            if (!topK.WillInsert(beam.second.cost)) break;
-            const auto &pair = GetTopResult(beam.second.state);
-            for (const auto &precomputed : pair.first) {
-                const auto cost = beam.second.cost + precomputed.second;
-                if (!topK.Insert(cost)) break;
-                auto olabels = beam.first;
-                olabels.insert(olabels.end(), precomputed.first.begin(),
-                               precomputed.first.end());
-                autocomplete.first.emplace_back(std::move(olabels), cost);
+        // with negative costs, costs no longer grow along a path, so fall
+        // back to invalidating every state that reaches a changed state
+        if (negative)
+            std::cerr << "Negative costs found; recomputing every state "
+                         "that reaches a changed state"
+                      << std::endl;
+        const auto costs = CostsToSources(
+            changed,
+            [this](int state) { return GetTopArcs(state); },
+            negative);
+
+        if (config.stable_steps)
+            std::cerr << "Stable steps set; recomputing every state"
+                      << std::endl;
+        std::vector<int> affected;
+        for (size_t state = 0; state < num_states; ++state) {
+            if (changed[state] || config.stable_steps) {
+                affected.push_back(static_cast<int>(state));
+                continue;
             }
-            autocomplete.second = std::max(autocomplete.second, pair.second);
+            if (std::isinf(costs[state])) continue;
+            const auto old_result = old_results.Get(match[state]);
+            // a search that found fewer than k completions is not bounded;
+            // the margin covers float rounding of the summed costs
+            if (negative || old_result.Size() < config.topk ||
+                costs[state] <= old_result.Cost(config.topk - 1) * 1.0001 +
+                                    1e-4)
+                affected.push_back(static_cast<int>(state));
         }
-        QBZ_ASSERT(config.topk <= autocomplete.first.size(),
-                   "not enough completions for topK");
-        std::partial_sort(autocomplete.first.begin(),
-                          autocomplete.first.begin() + config.topk,
-                          autocomplete.first.end(),
-                          [](const std::pair<std::vector<int>, float> &a,
-                             const std::pair<std::vector<int>, float> &b) {
-                              return a.second < b.second;
-                          });
-        autocomplete.first.erase(autocomplete.first.begin() + config.topk,
-                                 autocomplete.first.end());
-
-        for (const auto &candidate : autocomplete.first) {
-            std::string output = stable_prefix;
-            for (auto id : candidate.first) {
-                if (id == IDX_UNK) continue;
-                output += model->OutputSymbols()->Find(id);
+        std::cerr << std::count(changed.begin(), changed.end(), 1)
+                  << " states changed; recomputing " << affected.size()
+                  << " of " << num_states << " states" << std::endl;
+
+        std::vector<BeamSearchResult> results(affected.size());
+        std::vector<BeamStore> stores(scheduler.NumThreads());
+        scheduler.Run("top results", affected.size(),
+                      [&](size_t begin, size_t end, size_t worker) {
+                          for (auto idx = begin; idx < end; ++idx)
+                              results[idx] = ComputeTopResult(affected[idx],
+                                                              stores[worker]);
+                      });
+
+        WritePrecomputedViews(
+            output_file, config.topk, num_states,
+            [&](size_t state) -> ResultView {
+                const auto it = std::lower_bound(
+                    affected.begin(), affected.end(), static_cast<int>(state));
+                if (it != affected.end() && *it == static_cast<int>(state))
+                    return ResultView{results[it - affected.begin()]};
+                return old_results.Get(match[state]);
+            },
+            cost_bits);
+        return affected.size();
+    }
+
+    /**
+     * Thread-safe; borrows a context from a pool shared by such calls
+     */
+    Completion Complete(const std::string &query) const {
+        PooledContext context{*this};
+        return Complete(query, context.Get());
+    }
+
+    /**
+     * Complete queries in parallel on the internal worker pool
+     * @return completions in the same order as queries
+     */
+    std::vector<Completion>
+    CompleteBatch(const std::vector<std::string> &queries) const {
+        std::vector<Completion> completions(queries.size());
+        workers.ParallelFor(queries.size(), [this, &queries, &completions](
+                                                size_t begin, size_t end) {
+            Context context{*this};
+            for (auto idx = begin; idx < end; ++idx)
+                completions.at(idx) = Complete(queries.at(idx), context);
+        });
+        return completions;
+    }
+
+    /**
+     * Thread-safe as long as each thread passes its own context
+     */
+    Completion Complete(const std::string &query, Context &context) const {
+        Completion completion;
+        Complete(query, context, &completion);
+        return completion;
+    }
+
+    /**
+     * Same as above but writes into completion, reusing its memory
+     * With a warm context and completion this does not allocate on the heap
+     * for precomputed states
+     */
+    void Complete(const std::string &query, Context &context,
+                  Completion *completion) const {
+        context.budget.Disable();
+        Measured(context, true, [&]() {
+            if (context.trace) context.trace->query = query;
+            if (!completionCache.Enabled()) {
+                Search(query, context, completion);
+                return;
             }
 
-            auto utf_output = ToUtf8(output);
-            std::replace(utf_output.begin(), utf_output.end(), SPACE,
-                         static_cast<char32_t>(' '));
-            // merge consecutive white spaces
-            output = Join(Split(ToString(utf_output)));
+            auto &key = context.key;
+            CacheKey(query, &key);
+            const auto cached = completionCache.GetOrCompute(
+                key,
+                [&]() {
+                    Completion result;
+                    Search(query, context, &result);
+                    return result;
+                },
+                CompletionBytes);
+            *completion = *cached;
+        });
+    }
 
-            suggestions.emplace_back(output, init_cost + candidate.second);
-        }
+    /**
+     * Same as above but within a budget: once time runs out or
+     * max_expansions hypotheses have been expanded, beam searches run on
+     * demand stop and the best completions found so far are returned, which
+     * may be fewer than topk
+     * Precomputed & already computed results are used as usual, and only
+     * complete results are cached
+     * @param time: wall time of the call; zero for no limit
+     * @param max_expansions: 0 for no limit
+     * @return true if the budget ran out, i.e., the completion is partial
+     */
+    bool Complete(const std::string &query, Completion *completion,
+                  std::chrono::microseconds time,
+                  size_t max_expansions = 0) const {
+        PooledContext context{*this};
+        return Complete(query, context.Get(), completion, time,
+                        max_expansions);
+    }
+
+    /**
+     * Same as above with a context of the caller's
+     */
+    bool Complete(const std::string &query, Context &context,
+                  Completion *completion, std::chrono::microseconds time,
+                  size_t max_expansions = 0) const {
+        return RunWithin(context, time, max_expansions, [&]() {
+            Measured(context, true, [&]() {
+                if (context.trace) context.trace->query = query;
+                if (!completionCache.Enabled()) {
+                    Search(query, context, completion);
+                    return;
+                }
+                CacheKey(query, &context.key);
+                const auto cached = completionCache.Find(context.key);
+                if (cached) {
+                    *completion = *cached;
+                    return;
+                }
+                Search(query, context, completion);
+                if (!context.partial)
+                    completionCache.Insert(
+                        context.key,
+                        std::make_shared<const Completion>(*completion),
+                        CompletionBytes(*completion));
+            });
+        });
+    }
+
+    /**
+     * Counters of the completion cache
+     */
+    CacheStats CompletionCacheStats() const { return completionCache.Stats(); }
 
-        return {suggestions, autocomplete.second};
+    /**
+     * Counters of completions run within a budget
+     */
+    BudgetStats GetBudgetStats() const {
+        return BudgetStats{budgetCalls, partialCalls, budgetSearches,
+                           stoppedSearches};
+    }
+
+    /**
+     * Per-stage latency histograms & counters since construction or the
+     * last reset; empty unless the config enables metrics
+     */
+    MetricsSnapshot GetMetrics() const { return metrics.Snapshot(); }
+
+    void ResetMetrics() const { metrics.Reset(); }
+
+    /**
+     * Take the kept traces of slow completions out as a JSON array, oldest
+     * first; "[]" unless the config sets a trace threshold
+     */
+    std::string DumpTraces() const {
+        return traces ? traces->DumpJson() : "[]";
     }
 
     const Config& GetConfig() const { return config; }
 
+    size_t NumModelStates() const { return model->NumStates(); }
+
+    /**
+     * Heap bytes of the results precomputed in memory; 0 unless the config
+     * sets precompute
+     */
+    size_t PrecomputedBytes() const {
+        size_t bytes = 0;
+        for (const auto &result : topResults) bytes += HeapBytes(result);
+        return bytes;
+    }
+
   private:
-    struct Beam {
-        explicit Beam(int state, float cost) : state{state}, cost{cost} {}
+    // times private stages; see bench_components.cc
+    friend class ComponentBench;
 
-        bool operator<(const Beam &that) const { return cost < that.cost; }
+    /**
+     * Run fn within a budget & count the outcome
+     * @return true if the budget ran out
+     */
+    template <typename Fn>
+    bool RunWithin(Context &context, std::chrono::microseconds time,
+                   size_t max_expansions, Fn fn) const {
+        context.budget.Start(time, max_expansions);
+        context.partial = false;
+        fn();
+        context.budget.Disable();
+        ++budgetCalls;
+        if (context.partial) ++partialCalls;
+        return context.partial;
+    }
 
-        int state;
-        float cost;
-    };
+    /**
+     * Run fn & record the stage times it collects in the context, along with
+     * its wall time as the total if timed
+     */
+    template <typename Fn>
+    void Measured(Context &context, bool timed, Fn fn) const {
+        const auto traced = timed && StartTrace(context);
+        if (!metrics.Enabled() && !traced) {
+            fn();
+            return;
+        }
+        context.times.Clear();
+        const auto begin = StageTimes::Clock::now();
+        fn();
+        if (timed) context.times.Lap(STAGE_TOTAL, begin);
+        metrics.Record(context.times);
+        if (traced) FinishTrace(context, NanosSince(begin));
+    }
 
     /**
-     * Return top emitting transitions equal to branch_factor
+     * Start tracing the call if tracing is enabled & the call is sampled
+     * @return true if traced
+     */
+    bool StartTrace(Context &context) const {
+        context.trace = nullptr;
+        if (!traces ||
+            traceCalls.fetch_add(1, std::memory_order_relaxed) %
+                config.trace_sample)
+            return false;
+        if (!context.trace_buffer) context.trace_buffer.reset(new QueryTrace);
+        context.trace_buffer->Clear();
+        context.trace = context.trace_buffer.get();
+        return true;
+    }
+
+    /**
+     * Keep the trace of the call if it was slow
+     */
+    void FinishTrace(Context &context, uint64_t ns) const {
+        context.trace = nullptr;
+        if (ns < config.trace_threshold_us * 1000) return;
+        context.trace_buffer->total_ns = ns;
+        traces->Add(std::move(context.trace_buffer));
+    }
+
+    /**
+     * Record a search of state in the trace of the call, if traced
+     */
+    static SearchTrace *TraceSearch(Context &context, int state) {
+        if (!context.trace) return nullptr;
+        context.trace->searches.emplace_back();
+        context.trace->searches.back().state = state;
+        return &context.trace->searches.back();
+    }
+
+    /**
+     * Completion cache key of a query: its code points with ' ' as SPACE, as
+     * Advance sees them
+     * Not the ilabels, since characters out of the encoder all map to UNK
+     * but are copied into the suggestions as they are.
      */
-    const std::vector<Arc> &GetTopArcs(int state) {
-        if (!topArcs.at(state).empty()) return topArcs.at(state);
-
-        std::vector<Arc> arcs;
-        std::vector<bool> ilabels(model->InputSymbols()->AvailableKey(), false);
-
-        using Backoff = std::pair<int, float>;
-        std::queue<Backoff> queue;
-        queue.emplace(state, 0);
-        while (!queue.empty()) {
-            auto phi_state = queue.front().first;
-            auto cost = queue.front().second;
-            queue.pop();
-
-            fst::ArcIterator<fst::StdFst> aiter{*model, phi_state};
-            for (; !aiter.Done(); aiter.Next()) {
-                Arc arc{aiter.Value()};
-                if (arc.ilabel == IDX_PHI) {
-                    queue.emplace(arc.nextstate, cost + arc.weight);
-                } else if (!ilabels.at(arc.ilabel)) {
-                    ilabels.at(arc.ilabel) = true;
-                } else
-                    continue; // fewer-phi-transition already exists for the
-                              // ilabel
-
-                arc.weight = arc.weight + cost;
-                arcs.push_back(arc);
+    static void CacheKey(const std::string &query, std::u32string *key) {
+        key->clear();
+        ForEachChar(query, [key](char32_t c) {
+            key->push_back(c == static_cast<char32_t>(' ') ? SPACE : c);
+        });
+    }
+
+    /**
+     * Heap memory held by a cached completion
+     */
+    static size_t CompletionBytes(const Completion &completion) {
+        auto bytes = sizeof completion + sizeof(std::u32string) +
+                     sizeof(std::pair<std::string, float>) *
+                         completion.first.capacity();
+        for (const auto &suggestion : completion.first)
+            bytes += suggestion.first.capacity();
+        return bytes;
+    }
+
+    /**
+     * Complete query without the completion cache
+     */
+    void Search(const std::string &query, Context &context,
+                Completion *completion) const {
+        auto cursor = BeginCursor();
+        // stable prefix is built in the context's scratch buffer
+        auto &stable_prefix = context.stable_prefix;
+        stable_prefix.clear();
+        ForEachChar(query, [&](char32_t c) {
+            Advance(c, context, &cursor, &stable_prefix);
+        });
+        Complete(cursor, stable_prefix, context, completion);
+    }
+
+    Cursor BeginCursor() const {
+        return Cursor{encoder_begin_state, model->Start(), 0.0f, 0};
+    }
+
+    /**
+     * Encoder ilabel of a character; UNK if not in the encoder
+     */
+    int ILabel(char32_t c) const {
+        if (c == static_cast<char32_t>(' ')) c = SPACE;
+        const auto ilabel = charMap.Find(c);
+        return ilabel == fst::kNoLabel ? IDX_UNK : ilabel;
+    }
+
+    /**
+     * Consume a single character
+     * Stable olabels emitted by the encoder are scored with the model and
+     * their strings appended to stable_prefix
+     */
+    void Advance(char32_t c, Context &context, Cursor *cursor,
+                 std::string *stable_prefix) const {
+        const auto measure = metrics.Enabled();
+        StageTimes::Clock::time_point lap;
+        if (measure) lap = StageTimes::Clock::now();
+        const auto ilabel = ILabel(c);
+        if (ilabel == IDX_UNK) metrics.Count(COUNT_OOV_CHARS);
+
+        auto &olabels = context.olabels;
+        olabels.clear();
+        EncodeStep(*encoder, context.encoderMatcher, cursor->encoder_state,
+                   ilabel, &olabels, &cursor->encoder_state);
+        if (measure) lap = context.times.Lap(STAGE_ENCODE, lap);
+
+        auto &phiMatcher = context.phiMatcher;
+        for (auto id : olabels) {
+            if (id == IDX_UNK) {
+                utf8::append(c, std::back_inserter(*stable_prefix));
+            } else {
+                *stable_prefix += tokens.at(id);
             }
 
-            if (arcs.size() > config.branch_factor)
-                std::partial_sort(arcs.begin(),
-                                  arcs.begin() + config.branch_factor,
-                                  arcs.end(), [](const Arc &a, const Arc &b) {
-                                      return a.weight < b.weight;
-                                  });
+            phiMatcher.SetState(cursor->model_state);
+            if (id == IDX_UNK || !phiMatcher.Find(id)) {
+                metrics.Count(COUNT_UNK_OLABELS);
+                QBZ_ASSERT(phiMatcher.Find(IDX_UNK),
+                           "UNK token not found in the model");
+            }
+            cursor->init_cost += phiMatcher.Value().weight.Value();
+            cursor->model_state = phiMatcher.Value().nextstate;
+        }
+        cursor->stable_size = stable_prefix->size();
+        if (measure) context.times.Lap(STAGE_MODEL_WALK, lap);
+        if (context.trace) {
+            context.trace->encoder_states.push_back(cursor->encoder_state);
+            context.trace->model_states.push_back(cursor->model_state);
+        }
+    }
 
-            // if phi transition is not within the top arcs, we are done
-            auto it = std::find_if(arcs.begin(), arcs.end(), [](const Arc &a) {
-                return a.ilabel == IDX_PHI;
+    /**
+     * Complete from the given cursor
+     * @param stable_prefix: rendered string of the stable olabels consumed by
+     * cursor
+     */
+    void Complete(const Cursor &cursor, const std::string &stable_prefix,
+                  Context &context, Completion *completion) const {
+        const auto measure = metrics.Enabled();
+        StageTimes::Clock::time_point lap;
+        if (measure) lap = StageTimes::Clock::now();
+        const auto init_cost = cursor.init_cost;
+        const auto &beams = InitBeams(context, cursor.encoder_state,
+                                      cursor.model_state);
+        if (measure) lap = context.times.Lap(STAGE_INIT_BEAMS, lap);
+        metrics.Count(COUNT_INIT_BEAMS, beams.size());
+        auto &results = context.results;
+        results.clear();
+        context.pinned.clear();
+        auto &candidates = context.candidates;
+        candidates.clear();
+        size_t decode_length = 0;
+
+        auto &topK = context.resultTopK;
+        topK.Clear();
+        for (const auto &beam : beams) {
+            // beam stores score before beam search (i.e., minimal olabel
+            // sequences) will not insert cost but make sure it is within range
+            if (!topK.WillInsert(beam.second.cost)) break;
+            results.push_back(GetTopResult(beam.second.state, context));
+            const auto &result = results.back();
+            for (size_t idx = 0; idx < result.Size(); ++idx) {
+                const auto cost = beam.second.cost + result.Cost(idx);
+                if (!topK.Insert(cost)) break;
+                candidates.push_back(
+                    Candidate{beam.first, results.size() - 1, idx, cost});
+            }
+            decode_length = std::max(decode_length, result.DecodeLength());
+        }
+        // searches stopped by a budget or pruned may come up short
+        QBZ_ASSERT(config.topk <= candidates.size() || context.partial ||
+                       config.Prunes(),
+                   "not enough completions for topK");
+        const auto topk = std::min(config.topk, candidates.size());
+        std::partial_sort(
+            candidates.begin(), candidates.begin() + topk, candidates.end(),
+            [](const Candidate &a, const Candidate &b) {
+                return a.cost < b.cost;
             });
+        if (measure) lap = context.times.Lap(STAGE_MERGE, lap);
+
+        // only the final top k are rendered; strings keep their capacity
+        auto &suggestions = completion->first;
+        suggestions.resize(topk);
+        for (size_t idx = 0; idx < topk; ++idx) {
+            const auto &candidate = candidates[idx];
+            auto &output = suggestions[idx].first;
+            output.clear();
+            auto space = false;
+            AppendMergingSpaces(stable_prefix, &output, &space);
+            for (auto id : candidate.init_olabels)
+                AppendMergingSpaces(tokens[id], &output, &space);
+            const auto olabels = results[candidate.result].Olabels(
+                candidate.idx, &context.decoded);
+            for (auto id : olabels)
+                AppendMergingSpaces(tokens[id], &output, &space);
+            suggestions[idx].second = init_cost + candidate.cost;
+        }
+        completion->second = decode_length;
+        if (measure) context.times.Lap(STAGE_RENDER, lap);
+    }
 
-            if (arcs.size() > config.branch_factor &&
-                std::distance(arcs.begin(), it) >= config.branch_factor) {
-                arcs.erase(arcs.begin() + config.branch_factor, arcs.end());
-                arcs.shrink_to_fit();
-                QBZ_ASSERT(std::find_if(arcs.begin(), arcs.end(),
-                                        [](const Arc &a) {
-                                            return a.olabel == IDX_EPSILON;
-                                        }) == arcs.end(),
-                           "Non-emitting transition within top arcs");
-                topArcs.at(state) = std::move(arcs);
-                return topArcs.at(state);
-            }
+    /**
+     * Load beam search results from a legacy Boost archive
+     */
+    bool LoadArchive(const std::string &input_file) {
+        std::ifstream ifs{input_file};
+        QBZ_ASSERT(ifs, "Error opening " + input_file);
+        boost::archive::binary_iarchive iarchive{ifs};
+        size_t size, topk;
+        iarchive >> size;
+        iarchive >> topk;
+        if (size != model->NumStates() || topk != config.topk) return false;
+        topResults.clear();
+        iarchive >> topResults;
+        QBZ_ASSERT(topResults.size() == model->NumStates(),
+                   "NumStates mismatch");
+        precomputed.reset();
+        topArcs.Clear();
+        lazyResults.Clear();
+        resultCache.Clear();
+        return true;
+    }
 
-            // swap with the last element and remove so that it is O(1)
-            QBZ_ASSERT(it != arcs.end(), "phi transition not found");
-            std::swap(arcs.back(), *it);
-            arcs.erase(arcs.end() - 1);
+    /**
+     * Render output symbols once, so that completions can be assembled by
+     * plain concatenation
+     */
+    void RenderTokens() {
+        const auto &symbols = *model->OutputSymbols();
+        tokens.assign(symbols.AvailableKey(), "");
+        for (fst::SymbolTableIterator siter{symbols}; !siter.Done();
+             siter.Next()) {
+            if (siter.Value() == IDX_UNK) continue;
+            auto token = ToUtf8(siter.Symbol());
+            std::replace(token.begin(), token.end(), SPACE,
+                         static_cast<char32_t>(' '));
+            if (!token.empty()) tokens.at(siter.Value()) = ToString(token);
         }
+    }
 
-        QBZ_ASSERT(false, "This must not be reached");
+    /**
+     * Return top emitting transitions equal to branch_factor
+     */
+    ArcSpan GetTopArcs(int state) const {
+        if (topArcTable) return topArcTable->Arcs(state);
+        return topArcs
+            .GetOrCompute(state,
+                          [this, state]() {
+                              metrics.Count(COUNT_TOP_ARC_FILLS);
+                              return TopArcList{ComputeTopArcs(state)};
+                          })
+            .View();
+    }
+
+    /**
+     * Cost of exiting the model from state
+     */
+    float GetExitCost(int state, EM &matcher) const {
+        if (topArcTable) return topArcTable->ExitCost(state);
+        return MakeExitTransitions(*model, matcher, state);
+    }
+
+    std::vector<Arc> ComputeTopArcs(int state) const {
+        return TopArcs<Arc>(*model, state, config.branch_factor);
     }
 
     /**
      * Returns beam search result for the given model state
+     * Results taken from the cache are pinned in the context
      */
-    const BeamSearchResult &GetTopResult(int state) {
-        if (topResults.at(state).first.empty()) {
-            PrefixTree<int, Beam> prefixTree;
-            prefixTree.Insert({}, Beam{state, 0.0f});
-            size_t decode_length;
-            auto autocomplete = BeamSearch(prefixTree, &decode_length);
-            topResults.at(state) = {std::move(autocomplete), decode_length};
+    ResultView GetTopResult(int state, Context &context) const {
+        if (precomputed) {
+            const auto result = precomputed->Get(state);
+            if (result.Size()) return result;
         }
-        return topResults.at(state);
+        if (static_cast<size_t>(state) < topResults.size() &&
+            !topResults[state].first.empty())
+            return ResultView{topResults[state]};
+        if (context.budget.Enabled()) return GetTopResultWithin(state, context);
+        if (!resultCache.Enabled())
+            return ResultView{lazyResults.GetOrCompute(
+                state, [this, state, &context]() {
+                    return ComputeTopResult(state, context.beamStore, nullptr,
+                                            TraceSearch(context, state));
+                })};
+
+        auto result = resultCache.Find(state);
+        if (!result) {
+            result = std::make_shared<const BeamSearchResult>(
+                ComputeTopResult(state, context.beamStore, nullptr,
+                                 TraceSearch(context, state)));
+            resultCache.Insert(state, result, HeapBytes(*result));
+        }
+        context.pinned.push_back(result);
+        return ResultView{*result};
+    }
+
+    /**
+     * Same as above within the context's budget; a result cut short by the
+     * budget is kept in the context only, so that it is never served as a
+     * complete result later
+     */
+    ResultView GetTopResultWithin(int state, Context &context) const {
+        if (!resultCache.Enabled()) {
+            if (const auto result = lazyResults.Get(state))
+                return ResultView{*result};
+        } else if (const auto result = resultCache.Find(state)) {
+            context.pinned.push_back(result);
+            return ResultView{*result};
+        }
+
+        ++budgetSearches;
+        auto result = ComputeTopResult(state, context.beamStore,
+                                       &context.budget,
+                                       TraceSearch(context, state));
+        if (context.budget.Exhausted()) {
+            ++stoppedSearches;
+            context.partial = true;
+            context.pinned.push_back(
+                std::make_shared<const BeamSearchResult>(std::move(result)));
+            return ResultView{*context.pinned.back()};
+        }
+        if (!resultCache.Enabled())
+            return ResultView{lazyResults.GetOrCompute(
+                state, [&result]() { return std::move(result); })};
+
+        const auto cached =
+            std::make_shared<const BeamSearchResult>(std::move(result));
+        resultCache.Insert(state, cached, HeapBytes(*cached));
+        context.pinned.push_back(cached);
+        return ResultView{*cached};
+    }
+
+    /**
+     * @param budget: stops the search once exhausted, if given
+     * @param trace: records the search, if given
+     */
+    BeamSearchResult ComputeTopResult(int state, BeamStore &store,
+                                      SearchBudget *budget = nullptr,
+                                      SearchTrace *trace = nullptr) const {
+        size_t decode_length;
+        metrics.Count(COUNT_RESULT_FILLS);
+        auto autocomplete =
+            BeamSearch(state, store, &decode_length, budget, trace);
+        return {std::move(autocomplete), decode_length};
     }
 
     /**
      * Pre-compute beam search results on all states
      */
     void PrecomputeTopResults(bool precompute) {
-        topArcs.resize(model->NumStates());
-        topResults.resize(model->NumStates());
+        if (!topArcTable) topArcs.Resize(model->NumStates());
+        if (!resultCache.Enabled()) lazyResults.Resize(model->NumStates());
         if (!precompute) return;
+        topResults.resize(model->NumStates());
 
-        ThreadPool pool{num_proc};
-        std::cerr << "Precomputing top arcs for " << model->NumStates()
-                  << " states" << std::endl;
-        std::vector<std::future<void>> results(model->NumStates());
-        const auto fn_top_arcs = [this](int state) { this->GetTopArcs(state); };
-        for (auto state = 0; state < model->NumStates(); ++state) {
-            results.at(state) = pool.enqueue(fn_top_arcs, state);
-        }
-        for (auto state = 0; state < results.size(); ++state) {
-            if (state % 1000000 == 0)
-                std::cerr << "state " << state << "..." << std::endl;
-            results.at(state).get();
-        }
-
-        std::cerr << "Precomputing top results for " << model->NumStates()
-                  << " states" << std::endl;
-        const auto fn_top_results = [this](int state) {
-            this->GetTopResult(state);
-        };
-        for (auto state = 0; state < model->NumStates(); ++state) {
-            results.at(state) = pool.enqueue(fn_top_results, state);
-        }
-        for (auto state = 0; state < results.size(); ++state) {
-            if (state % 1000000 == 0)
-                std::cerr << "state " << state << "..." << std::endl;
-            results.at(state).get();
-        }
+        // states are handed out in ranges, and each worker reuses its own
+        // beam store across all of its states
+        RangeScheduler scheduler{num_proc};
+        std::cerr << "Precomputing " << model->NumStates() << " states on "
+                  << scheduler.NumThreads() << " threads" << std::endl;
+        if (!topArcTable)
+            scheduler.Run("top arcs", model->NumStates(),
+                          [this](size_t begin, size_t end, size_t) {
+                              for (auto state = begin; state < end; ++state)
+                                  GetTopArcs(static_cast<int>(state));
+                          });
+
+        std::vector<BeamStore> stores(scheduler.NumThreads());
+        // each worker writes to its own slots only
+        scheduler.Run("top results", model->NumStates(),
+                      [this, &stores](size_t begin, size_t end, size_t worker) {
+                          for (auto state = begin; state < end; ++state)
+                              topResults[state] = ComputeTopResult(
+                                  static_cast<int>(state), stores[worker]);
+                      });
         // remove topArcs results, since they are no long needed
-        topArcs.clear();
+        topArcs.Clear();
 
         std::cerr << "Precomputing top results complete" << std::endl;
     }
 
-    void ComputeEncoderTransitions() {
-        encoderTransitions.reserve(encoder->NumStates());
+    void ComputeEncoderTransitions(EM &encoderMatcher) {
+        encoderTrie.Reserve(encoder->NumStates());
         std::cerr << "Computing encoder transitions for "
                   << encoder->NumStates() << " states..." << std::endl;
         for (auto state = 0; state < encoder->NumStates(); ++state) {
@@ -408,95 +1453,157 @@ class QueryBlazer {
                         std::to_string(state));
                 sequences.emplace_back();
             }
-            encoderTransitions.push_back(std::move(sequences));
+            encoderTrie.Add(std::move(sequences));
         }
     }
 
     /**
      * Returns best beam_size beams that give the best transitions to encoder's
-     * start state
-     */
-    std::vector<std::pair<std::vector<int>, Beam>> InitBeams(int encoder_state,
-                                                             int model_state) {
-        const auto &sequences = encoderTransitions.at(encoder_state);
-        TopK<float> topK{config.beam_size};
-        std::vector<std::pair<std::vector<int>, Beam>> beams;
-
-        for (const auto &sequence : sequences) {
-            auto score = 0.0f;
-            auto state = model_state;
-            std::vector<int> olabels;
-            auto skip_flag = false;
-            for (auto ilabel : sequence) {
-                phiMatcher.SetState(state);
-                if (!phiMatcher.Find(ilabel)) {
+     * start state, sorted by cost; written into the context's buffer
+     * With a beam gap, beams costing more than the best one plus the gap are
+     * dropped as well
+     */
+    const std::vector<InitBeam> &InitBeams(Context &context, int encoder_state,
+                                           int model_state) const {
+        auto &phiMatcher = context.phiMatcher;
+        auto &topK = context.beamTopK;
+        topK.Clear();
+        auto &beams = context.beams;
+        beams.clear();
+
+        // depth-first over the candidate trie, so that a prefix shared by
+        // several sequences is scored once & pruned along with its subtree
+        auto &frames = context.frames;
+        frames.clear();
+        frames.push_back(TrieFrame{encoderTrie.Root(encoder_state),
+                                   model_state, 0.0f});
+        const auto gap = config.beam_gap > 0.0f
+                             ? config.beam_gap
+                             : std::numeric_limits<float>::infinity();
+        auto max_cost = std::numeric_limits<float>::infinity();
+        const auto trace = context.trace;
+        while (!frames.empty()) {
+            const auto frame = frames.back();
+            frames.pop_back();
+            if (trace) ++trace->init_tried;
+            // the bounds may have tightened since the frame was pushed
+            if (!topK.WillInsert(frame.cost) || frame.cost > max_cost) {
+                if (trace) ++trace->init_pruned;
+                continue;
+            }
+            const auto &node = encoderTrie.GetNode(frame.node);
+            if (node.sequence != EncoderTrie::NO_SEQUENCE) {
+                beams.emplace_back(encoderTrie.Sequence(node),
+                                   Beam{frame.model_state, frame.cost});
+                topK.Insert(frame.cost);
+                max_cost = std::min(max_cost, frame.cost + gap);
+            }
+
+            for (uint32_t child = node.first_child;
+                 child < node.first_child + node.num_children; ++child) {
+                phiMatcher.SetState(frame.model_state);
+                if (!phiMatcher.Find(encoderTrie.GetNode(child).olabel)) {
                     // ilabel unigram does not exist (may have been pruned away
                     // during LM construction)
+                    metrics.Count(COUNT_UNK_OLABELS);
                     QBZ_ASSERT(phiMatcher.Find(IDX_UNK),
                                "UNK token not found in model");
                 }
-                score += phiMatcher.Value().weight.Value();
-                if (!topK.WillInsert(score)) {
-                    skip_flag = true;
-                    break;
+                const auto cost =
+                    frame.cost + phiMatcher.Value().weight.Value();
+                if (!topK.WillInsert(cost) || cost > max_cost) {
+                    if (trace) ++trace->init_pruned;
+                    continue;
                 }
-                state = phiMatcher.Value().nextstate;
-                olabels.push_back(ilabel);
+                frames.push_back(
+                    TrieFrame{child, phiMatcher.Value().nextstate, cost});
             }
-            if (skip_flag) continue;
-
-            beams.emplace_back(std::move(olabels), Beam{state, score});
-            topK.Insert(score);
         }
 
+        // beams found before the best one may exceed its gap
+        beams.erase(std::remove_if(beams.begin(), beams.end(),
+                                   [max_cost](const InitBeam &beam) {
+                                       return beam.second.cost > max_cost;
+                                   }),
+                    beams.end());
         const auto beam_size = std::min(beams.size(), config.beam_size);
         std::partial_sort(beams.begin(), beams.begin() + beam_size, beams.end(),
-                          [](const std::pair<std::vector<int>, Beam> &a,
-                             const std::pair<std::vector<int>, Beam> &b) {
+                          [](const InitBeam &a, const InitBeam &b) {
                               return a.second < b.second;
                           });
         beams.erase(beams.begin() + beam_size, beams.end());
+        if (trace)
+            for (const auto &beam : beams)
+                trace->beams.push_back(BeamTrace{
+                    std::vector<int>(beam.first.begin(), beam.first.end()),
+                    beam.second.state, beam.second.cost});
 
         return beams;
     }
 
     /**
-     *
-     * @param prefixTree
-     * @param model
-     * @return
+     * Beam search from the given model state until no beam can enter the top
+     * k completions
+     * With a beam gap, hypotheses costing more than the best of their step
+     * plus the gap are not expanded; with stable steps, the search stops once
+     * the top k have not changed for that many steps. Either may lose
+     * completions, so that fewer than topk may be returned.
+     * @param store: arena for the hypotheses; cleared on entry
+     * @param decode_length: optional pointer to which the maximum number of
+     * olabels decoded is written
+     * @param budget: optional budget charged per hypothesis expanded; once
+     * exhausted, the search stops with the best completions found so far
+     * @param trace: optional trace into which the frontier size per step is
+     * recorded
+     * @return top k olabel sequences with costs, sorted by cost
      */
     std::vector<std::pair<std::vector<int>, float>>
-    BeamSearch(PrefixTree<int, Beam> &prefixTree,
-               size_t *decode_length = nullptr) {
-        std::vector<std::pair<std::vector<int>, float>> result;
+    BeamSearch(int state, BeamStore &store, size_t *decode_length = nullptr,
+               SearchBudget *budget = nullptr,
+               SearchTrace *trace = nullptr) const {
+        // (hypothesis, final cost); olabels are only built for the top k
+        std::vector<std::pair<uint32_t, float>> finals;
         TopK<float> topK{config.topk};
         size_t max_dl = 0;
         fst::SortedMatcher<fst::StdExpandedFst> matcher{
             model.get(), fst::MatchType::MATCH_INPUT, IDX_UNK + 1};
 
-        while (!prefixTree.Empty()) {
-            auto prefixes = prefixTree.FindAll();
-            const auto beam_size = std::min(prefixes.size(), config.beam_size);
-            std::partial_sort(prefixes.begin(), prefixes.begin() + beam_size,
-                              prefixes.end(),
-                              [](const PrefixLeaf<int, Beam> &a,
-                                 const PrefixLeaf<int, Beam> &b) {
-                                  return a.Data() < b.Data();
-                              });
-
-            for (auto it = prefixes.begin(); it != prefixes.begin() + beam_size;
-                 ++it) {
+        const auto measure = metrics.Enabled() || trace;
+        StageTimes::Clock::time_point begin;
+        if (measure) begin = StageTimes::Clock::now();
+        size_t hypotheses = 0, scanned = 0;
+
+        store.Clear();
+        store.Add(BeamStore::NO_PARENT, IDX_EPSILON, state, 0.0f);
+        const auto gap = config.beam_gap > 0.0f
+                             ? config.beam_gap
+                             : std::numeric_limits<float>::infinity();
+        size_t stable = 0;
+        bool stopped = false;
+        while (!stopped && store.Advance(config.beam_size)) {
+            // the frontier is sorted, so its first hypothesis is the best
+            const auto max_cost = store[store.Frontier().front()].cost + gap;
+            if (trace)
+                trace->frontier_sizes.push_back(
+                    static_cast<uint32_t>(store.Frontier().size()));
+            // best cost added to the next step so far
+            auto next_best = std::numeric_limits<float>::infinity();
+            bool changed = false;
+            for (auto idx : store.Frontier()) {
                 // process valid beams
-                auto &prefix = *it;
-                auto state = prefix.Data().state;
-                if (!topK.WillInsert(prefix.Data().cost)) {
+                const auto hypothesis = store[idx];
+                if (!topK.WillInsert(hypothesis.cost) ||
+                    hypothesis.cost > max_cost) {
                     // no need to process the rest of the beams
                     break;
                 }
+                if (budget && !budget->Spend()) {
+                    stopped = true;
+                    break;
+                }
 
-                max_dl = std::max(prefix.Depth(), max_dl);
-                if (prefix.Depth() >= config.length_limit) {
+                max_dl = std::max<size_t>(hypothesis.depth, max_dl);
+                if (hypothesis.depth >= config.length_limit) {
                     if (config.verbose)
                         std::cerr << "non-epsilon transition length limit "
                                      "exceeded; skipping"
@@ -504,39 +1611,58 @@ class QueryBlazer {
                     continue;
                 }
 
-                auto final_cost = MakeExitTransitions(*model, matcher, state);
-                final_cost += prefix.Data().cost;
+                auto final_cost = GetExitCost(hypothesis.state, matcher);
+                final_cost += hypothesis.cost;
 
                 if (topK.Insert(final_cost)) {
-                    result.emplace_back(prefix.Prefix(), final_cost);
+                    finals.emplace_back(idx, final_cost);
+                    changed = true;
                 }
 
-                const auto &arcs = GetTopArcs(state);
-                for (const auto &arc : arcs) {
-                    auto weight = prefix.Data().cost + arc.weight;
-                    if (!topK.WillInsert(weight)) continue;
-                    prefixTree.Insert(prefix, {arc.olabel},
-                                      Beam{arc.nextstate, weight});
+                // arcs are sorted by weight, and neither bound loosens as
+                // arcs are added, so none past the first one out of bounds
+                // can be added
+                const auto arcs = GetTopArcs(hypothesis.state);
+                for (size_t a = 0; a < arcs.Size(); ++a) {
+                    ++scanned;
+                    const auto weight = hypothesis.cost + arcs.Weight(a);
+                    if (!topK.WillInsert(weight) || weight > next_best + gap)
+                        break;
+                    store.Add(idx, arcs.OLabel(a), arcs.NextState(a), weight);
+                    ++hypotheses;
+                    next_best = std::min(next_best, weight);
                 }
             }
 
-            // remove all processed beams
-            for (auto & prefix : prefixes)
-                prefixTree.Erase(prefix);
+            // only a full top k can be stable
+            stable = changed || finals.size() < config.topk ? 0 : stable + 1;
+            if (config.stable_steps && stable >= config.stable_steps) break;
         }
 
-        if (result.size() > config.topk) {
-            std::partial_sort(result.begin(), result.begin() + config.topk,
-                              result.end(),
-                              [](const std::pair<std::vector<int>, float> &a,
-                                 const std::pair<std::vector<int>, float> &b) {
-                                  return a.second < b.second;
-                              });
-            result.erase(result.begin() + config.topk, result.end());
-            result.shrink_to_fit();
+        const auto topk = std::min(finals.size(), config.topk);
+        std::partial_sort(finals.begin(), finals.begin() + topk, finals.end(),
+                          [](const std::pair<uint32_t, float> &a,
+                             const std::pair<uint32_t, float> &b) {
+                              return a.second < b.second;
+                          });
+        std::vector<std::pair<std::vector<int>, float>> result(topk);
+        for (size_t idx = 0; idx < topk; ++idx) {
+            store.Olabels(finals[idx].first, &result[idx].first);
+            result[idx].second = finals[idx].second;
         }
 
         if (decode_length) *decode_length = max_dl;
+        if (measure) {
+            const auto ns = NanosSince(begin);
+            metrics.Count(COUNT_HYPOTHESES, hypotheses);
+            metrics.Count(COUNT_ARCS_SCANNED, scanned);
+            metrics.Record(STAGE_SEARCH, ns);
+            if (trace) {
+                trace->ns = ns;
+                trace->hypotheses = hypotheses;
+                trace->stopped = stopped;
+            }
+        }
 
         return result;
     }
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_SCHEDULER_H
+#define QUERYBLAZER_SCHEDULER_H
+
+#include "bench.h"
+#include "common.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Runs a function over a large index range (e.g., model states) on dedicated
+ * threads with work stealing
+ * Each worker starts with an equal contiguous slice and takes small chunks
+ * from its front; a worker that runs out steals the back half of the largest
+ * remaining slice, so that load stays balanced even when the cost per index
+ * varies wildly, without a task or future per index.
+ * The calling thread reports progress, throughput & ETA while waiting.
+ */
+class RangeScheduler {
+  public:
+    /**
+     * @param num_threads: number of workers; 0 for hardware concurrency
+     * @param report_seconds: interval between progress reports; 0 disables
+     */
+    explicit RangeScheduler(size_t num_threads = 0,
+                            double report_seconds = 10.0)
+        : num_threads{num_threads ? num_threads
+                                  : std::max<size_t>(
+                                        std::thread::hardware_concurrency(),
+                                        1)},
+          report_seconds{report_seconds} {}
+
+    size_t NumThreads() const { return num_threads; }
+
+    /**
+     * Run fn(begin, end, worker) over chunks covering [0, size) and block
+     * until all are done; rethrows the first exception raised by fn, after
+     * which no new chunks are started
+     * @param fn: worker is in [0, NumThreads()), so that the caller can keep
+     * per-worker scratch buffers; a worker runs one chunk at a time
+     */
+    template <typename Fn>
+    void Run(const std::string &name, size_t size, Fn fn) {
+        if (size == 0) return;
+        const auto chunk_size = std::max<size_t>(
+            1, std::min<size_t>(1024, size / (num_threads * 64)));
+
+        std::unique_ptr<Slice[]> slices{new Slice[num_threads]};
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            slices[worker].begin = size * worker / num_threads;
+            slices[worker].end = size * (worker + 1) / num_threads;
+        }
+
+        std::atomic<size_t> done{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t num_running = num_threads;
+
+        const auto work = [&](size_t worker) {
+            try {
+                size_t begin, end;
+                while (!failed && Take(slices.get(), worker, chunk_size,
+                                       &begin, &end)) {
+                    fn(begin, end, worker);
+                    done += end - begin;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{mutex};
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            if (--num_running == 0) finished.notify_all();
+        };
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (size_t worker = 0; worker < num_threads; ++worker)
+            threads.emplace_back(work, worker);
+
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            while (num_running > 0) {
+                if (report_seconds <= 0) {
+                    finished.wait(lock);
+                    continue;
+                }
+                const auto timeout =
+                    std::chrono::duration<double>(report_seconds);
+                if (!finished.wait_for(lock, timeout,
+                                       [&]() { return num_running == 0; }))
+                    Report(name, done, size, SecondsSince(start));
+            }
+        }
+        for (auto &thread : threads) thread.join();
+        if (error) std::rethrow_exception(error);
+        if (report_seconds > 0)
+            Report(name, done, size, SecondsSince(start));
+    }
+
+  private:
+    /**
+     * Remaining range of a worker
+     */
+    struct Slice {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    /**
+     * Take the next chunk of worker's slice, stealing from the largest slice
+     * if its own is empty
+     * @return false if no work is left
+     */
+    bool Take(Slice *slices, size_t worker, size_t chunk_size, size_t *begin,
+              size_t *end) const {
+        auto &own = slices[worker];
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock{own.mutex};
+                if (own.begin < own.end) {
+                    *begin = own.begin;
+                    *end = std::min(own.end, own.begin + chunk_size);
+                    own.begin = *end;
+                    return true;
+                }
+            }
+
+            // remaining sizes may change while scanning; a stale choice only
+            // costs another round
+            size_t victim = num_threads, largest = 0;
+            for (size_t idx = 0; idx < num_threads; ++idx) {
+                if (idx == worker) continue;
+                std::lock_guard<std::mutex> lock{slices[idx].mutex};
+                const auto remaining = slices[idx].end - slices[idx].begin;
+                if (remaining > largest) {
+                    largest = remaining;
+                    victim = idx;
+                }
+            }
+            if (victim == num_threads) return false;
+
+            size_t stolen_begin, stolen_end;
+            {
+                std::lock_guard<std::mutex> lock{slices[victim].mutex};
+                auto &slice = slices[victim];
+                if (slice.begin >= slice.end) continue;
+                stolen_end = slice.end;
+                stolen_begin = slice.end - (slice.end - slice.begin + 1) / 2;
+                slice.end = stolen_begin;
+            }
+            std::lock_guard<std::mutex> lock{own.mutex};
+            own.begin = stolen_begin;
+            own.end = stolen_end;
+        }
+    }
+
+    static void Report(const std::string &name, size_t done, size_t size,
+                       double seconds) {
+        const auto rate = seconds > 0 ? done / seconds : 0.0;
+        std::cerr << name << ": " << done << " / " << size << " ("
+                  << 100.0 * done / size << "%), " << rate << " per sec";
+        if (done < size && rate > 0)
+            std::cerr << ", ETA " << (size - done) / rate << " sec";
+        std::cerr << ", RSS " << GetMemoryUsage().rss / 1024 << " MB"
+                  << std::endl;
+    }
+
+    const size_t num_threads;
+    const double report_seconds;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_SCHEDULER_H
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_SHARD_H
+#define QUERYBLAZER_SHARD_H
+
+#include "common.h"
+#include "precomputed.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace qbz {
+
+#define SHARD_MAGIC "QBZSHRD"
+
+constexpr uint32_t SHARD_VERSION = 2;
+
+/**
+ * Header of a shard file, which holds the beam search results of a range of
+ * model states as a flat precomputed file right after the header
+ * Records the model & config the results were computed with, so that shards
+ * of different builds are never mixed up
+ */
+struct ShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t topk;
+    uint32_t beam_size;
+    uint32_t branch_factor;
+    uint32_t length_limit;
+    // pruning of the search, which changes its results
+    uint32_t stable_steps;
+    float beam_gap;
+    uint32_t reserved;
+    // number of model states
+    uint64_t num_states;
+    // FileChecksum of the model
+    uint64_t model_checksum;
+    // states in [begin, end)
+    uint64_t begin;
+    uint64_t end;
+};
+
+static_assert(sizeof(ShardHeader) == 72, "Unexpected shard header padding");
+
+inline ShardHeader MakeShardHeader(size_t topk, size_t beam_size,
+                                   size_t branch_factor, size_t length_limit,
+                                   float beam_gap, size_t stable_steps,
+                                   size_t num_states,
+                                   uint64_t model_checksum) {
+    ShardHeader header;
+    std::memset(&header, 0, sizeof header);
+    std::memcpy(header.magic, SHARD_MAGIC, sizeof header.magic);
+    header.version = SHARD_VERSION;
+    header.topk = static_cast<uint32_t>(topk);
+    header.beam_size = static_cast<uint32_t>(beam_size);
+    header.branch_factor = static_cast<uint32_t>(branch_factor);
+    header.length_limit = static_cast<uint32_t>(length_limit);
+    header.stable_steps = static_cast<uint32_t>(stable_steps);
+    header.beam_gap = beam_gap;
+    header.num_states = num_states;
+    header.model_checksum = model_checksum;
+    return header;
+}
+
+/**
+ * Whether two shards were computed from the same model with the same config,
+ * regardless of their state ranges
+ */
+inline bool SameBuild(const ShardHeader &a, const ShardHeader &b) {
+    return a.topk == b.topk && a.beam_size == b.beam_size &&
+           a.branch_factor == b.branch_factor &&
+           a.length_limit == b.length_limit &&
+           a.stable_steps == b.stable_steps && a.beam_gap == b.beam_gap &&
+           a.num_states == b.num_states &&
+           a.model_checksum == b.model_checksum;
+}
+
+/**
+ * Path of the shard of states [begin, end) under dir; zero-padded, so that
+ * shards list in state order
+ */
+inline std::string ShardFile(const std::string &dir, uint64_t begin,
+                             uint64_t end) {
+    char name[64];
+    std::snprintf(name, sizeof name, "states-%012llu-%012llu.shard",
+                  static_cast<unsigned long long>(begin),
+                  static_cast<unsigned long long>(end));
+    return dir + "/" + name;
+}
+
+/**
+ * Shard files under dir, sorted by name; empty if dir does not exist
+ * Shards still being written carry a .tmp suffix and are not listed
+ */
+inline std::vector<std::string> ListShards(const std::string &dir) {
+    std::vector<std::string> files;
+    const auto handle = opendir(dir.c_str());
+    if (!handle) return files;
+    const std::string suffix = ".shard";
+    while (const auto entry = readdir(handle)) {
+        const std::string name = entry->d_name;
+        if (name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(),
+                         suffix) == 0)
+            files.push_back(dir + "/" + name);
+    }
+    closedir(handle);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+/**
+ * Create dir unless it exists
+ */
+inline void MakeDirectory(const std::string &dir) {
+    QBZ_ASSERT(mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST,
+               "Error creating " + dir);
+}
+
+/**
+ * Flush a file or directory to disk
+ */
+inline void SyncPath(const std::string &path) {
+    const auto fd = open(path.c_str(), O_RDONLY);
+    QBZ_ASSERT(fd >= 0, "Error opening " + path);
+    const auto synced = fsync(fd) == 0;
+    close(fd);
+    QBZ_ASSERT(synced, "Error syncing " + path);
+}
+
+/**
+ * Write the shard header into a complete temporary shard & move it into place
+ * The shard is synced before the rename and its directory after, so that
+ * after a crash the shard is either complete or absent
+ */
+inline void FinishShard(const std::string &temp, const std::string &file,
+                        const ShardHeader &header) {
+    {
+        std::fstream fs{temp, std::ios::binary | std::ios::in | std::ios::out};
+        fs.write(reinterpret_cast<const char *>(&header), sizeof header);
+        fs.close();
+        QBZ_ASSERT(fs, "Error writing " + temp);
+    }
+    SyncPath(temp);
+    QBZ_ASSERT(std::rename(temp.c_str(), file.c_str()) == 0,
+               "Error renaming " + temp + " to " + file);
+    const auto slash = file.rfind('/');
+    SyncPath(slash == std::string::npos ? "." : file.substr(0, slash + 1));
+}
+
+/**
+ * Write the results of states [header.begin, header.end) into a shard file
+ * The shard is written under a temporary name and renamed when complete, so
+ * that a crash never leaves a partial shard behind
+ * @param get_result: returns the BeamSearchResult of a state; called twice
+ * per state
+ */
+template <typename GetResult>
+void WriteShard(const std::string &file, const ShardHeader &header,
+                GetResult get_result) {
+    size_t num_candidates = 0, num_olabels = 0;
+    for (auto state = header.begin; state < header.end; ++state) {
+        const BeamSearchResult &result = get_result(state);
+        num_candidates += result.first.size();
+        for (const auto &candidate : result.first)
+            num_olabels += candidate.first.size();
+    }
+
+    const auto temp = file + ".tmp";
+    PrecomputedWriter writer{temp,           header.topk,
+                             header.end - header.begin,
+                             num_candidates, num_olabels,
+                             sizeof header};
+    for (auto state = header.begin; state < header.end; ++state)
+        writer.Add(ResultView{get_result(state)});
+    writer.Close();
+    FinishShard(temp, file, header);
+}
+
+/**
+ * Shard file mapped into memory
+ */
+class Shard {
+  public:
+    explicit Shard(const std::string &file)
+        : file{file},
+          header{ReadHeader(file)},
+          results{file, sizeof(ShardHeader)} {
+        QBZ_ASSERT(results.NumStates() == header.end - header.begin &&
+                       results.TopK() == header.topk,
+                   "Corrupted shard: " + file);
+    }
+
+    const std::string &File() const { return file; }
+
+    const ShardHeader &Header() const { return header; }
+
+    const PrecomputedResults &Results() const { return results; }
+
+    /**
+     * @param state: model state in [begin, end)
+     */
+    ResultView Get(uint64_t state) const {
+        return results.Get(static_cast<int>(state - header.begin));
+    }
+
+  private:
+    static ShardHeader ReadHeader(const std::string &file) {
+        ShardHeader header;
+        std::ifstream ifs{file, std::ios::binary};
+        QBZ_ASSERT(ifs, "Error opening " + file);
+        ifs.read(reinterpret_cast<char *>(&header), sizeof header);
+        QBZ_ASSERT(ifs && std::memcmp(header.magic, SHARD_MAGIC,
+                                      sizeof header.magic) == 0,
+                   "Invalid shard: " + file);
+        QBZ_ASSERT(header.version == SHARD_VERSION,
+                   "Unsupported shard version " +
+                       std::to_string(header.version) + ": " + file);
+        QBZ_ASSERT(header.begin <= header.end &&
+                       header.end <= header.num_states,
+                   "Invalid state range in shard: " + file);
+        return header;
+    }
+
+    const std::string file;
+    const ShardHeader header;
+    const PrecomputedResults results;
+};
+
+/**
+ * Slice of model states computed by shard index out of count, as evenly as
+ * possible
+ */
+inline std::pair<size_t, size_t> ShardSlice(size_t num_states, size_t index,
+                                            size_t count) {
+    QBZ_ASSERT(index < count, "Shard index must be less than shard count");
+    return {num_states * index / count, num_states * (index + 1) / count};
+}
+
+using Shards = std::vector<std::unique_ptr<const Shard>>;
+
+/**
+ * Open shards and sort them by state range
+ * Shards must come from the same build and cover a contiguous range of
+ * states exactly once; they may be given in any order
+ */
+inline Shards OpenShards(const std::vector<std::string> &files) {
+    QBZ_ASSERT(!files.empty(), "No shards given");
+    Shards shards;
+    for (const auto &file : files) shards.emplace_back(new Shard{file});
+    std::sort(shards.begin(), shards.end(),
+              [](const std::unique_ptr<const Shard> &a,
+                 const std::unique_ptr<const Shard> &b) {
+                  return a->Header().begin < b->Header().begin;
+              });
+
+    const auto &first = shards.front()->Header();
+    auto next = first.begin;
+    for (const auto &shard : shards) {
+        const auto &header = shard->Header();
+        QBZ_ASSERT(SameBuild(header, first),
+                   shard->File() + " was built from a different model or "
+                                   "config than " +
+                       shards.front()->File());
+        QBZ_ASSERT(header.begin <= next,
+                   "Missing states " + std::to_string(next) + " to " +
+                       std::to_string(header.begin));
+        QBZ_ASSERT(header.begin >= next,
+                   shard->File() + " overlaps states before " +
+                       std::to_string(next));
+        next = header.end;
+    }
+    return shards;
+}
+
+/**
+ * Combine shards of a contiguous range into a single shard, e.g., the
+ * partial file of one precompute process
+ */
+inline void CombineShards(const std::vector<std::string> &files,
+                          const std::string &output) {
+    const auto shards = OpenShards(files);
+    auto header = shards.front()->Header();
+    header.end = shards.back()->Header().end;
+    uint64_t num_candidates = 0, num_olabels = 0;
+    for (const auto &shard : shards) {
+        num_candidates += shard->Results().Stats().num_candidates;
+        num_olabels += shard->Results().Stats().num_olabels;
+    }
+
+    const auto temp = output + ".tmp";
+    PrecomputedWriter writer{temp,           header.topk,
+                             header.end - header.begin,
+                             num_candidates, num_olabels,
+                             sizeof header};
+    for (const auto &shard : shards)
+        for (auto state = shard->Header().begin; state < shard->Header().end;
+             ++state)
+            writer.Add(shard->Get(state));
+    writer.Close();
+    FinishShard(temp, output, header);
+}
+
+/**
+ * Merge shards covering every model state into a single precomputed file,
+ * streaming one state at a time
+ * The output depends only on the results, not on how states were sharded
+ * @param cost_bits: see WritePrecomputed
+ */
+inline void MergeShards(const std::vector<std::string> &files,
+                        const std::string &output, unsigned cost_bits = 0) {
+    const auto shards = OpenShards(files);
+    const auto &first = shards.front()->Header();
+    const auto end = shards.back()->Header().end;
+    QBZ_ASSERT(first.begin == 0,
+               "Missing states 0 to " + std::to_string(first.begin));
+    QBZ_ASSERT(end == first.num_states,
+               "Missing states " + std::to_string(end) + " to " +
+                   std::to_string(first.num_states));
+
+    if (cost_bits) {
+        CompressedPrecomputedWriter writer{output, first.topk,
+                                           first.num_states, cost_bits};
+        for (const auto &shard : shards)
+            for (auto state = shard->Header().begin;
+                 state < shard->Header().end; ++state)
+                writer.Add(shard->Get(state));
+        writer.Close();
+        return;
+    }
+
+    uint64_t num_candidates = 0, num_olabels = 0;
+    for (const auto &shard : shards) {
+        num_candidates += shard->Results().Stats().num_candidates;
+        num_olabels += shard->Results().Stats().num_olabels;
+    }
+    PrecomputedWriter writer{output, first.topk, first.num_states,
+                             num_candidates, num_olabels};
+    for (const auto &shard : shards)
+        for (auto state = shard->Header().begin; state < shard->Header().end;
+             ++state)
+            writer.Add(shard->Get(state));
+    writer.Close();
+}
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_SHARD_H
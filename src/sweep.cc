@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include "bench.h"
+#include "queryblazer.h"
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <unordered_set>
+
+DEFINE_string(branch_factors, "10,30", "comma-separated branch factors");
+DEFINE_string(beam_sizes, "10,30", "comma-separated beam sizes");
+DEFINE_string(length_limits, "100", "comma-separated length limits");
+DEFINE_string(beam_gaps, "0", "comma-separated beam gaps; 0 disables");
+DEFINE_string(stable_steps, "0", "comma-separated stable steps; 0 disables");
+DEFINE_int32(topk, 10, "# of top completion candidates");
+DEFINE_int32(threads, 0,
+             "# of threads completing prefixes & precomputing; 0 for all "
+             "cores");
+DEFINE_bool(precompute, false,
+            "precompute every model state per config, and report the memory "
+            "of the results; otherwise every prefix is searched on demand");
+DEFINE_bool(mmap, false, "memory-map the encoder & model");
+
+using namespace qbz;
+
+/**
+ * Parse comma-separated values
+ */
+template <typename T, typename Parse>
+std::vector<T> ParseList(const std::string &flag, const std::string &values,
+                         Parse parse) {
+    std::vector<T> parsed;
+    for (const auto &value : Split(values, [](char c) { return c == ','; }))
+        parsed.push_back(parse(value));
+    QBZ_ASSERT(!parsed.empty(), "--" + flag + " is empty");
+    return parsed;
+}
+
+std::vector<size_t> ParseSizes(const std::string &flag,
+                               const std::string &values) {
+    return ParseList<size_t>(flag, values, [](const std::string &value) {
+        return static_cast<size_t>(std::stoul(value));
+    });
+}
+
+/**
+ * Whether c is a white space to Python's str.strip()
+ */
+bool IsPythonSpace(char32_t c) {
+    return (c >= 0x09 && c <= 0x0d) || (c >= 0x1c && c <= 0x20) ||
+           c == 0x85 || c == 0xa0 || c == 0x1680 ||
+           (c >= 0x2000 && c <= 0x200a) || c == 0x2028 || c == 0x2029 ||
+           c == 0x202f || c == 0x205f || c == 0x3000;
+}
+
+/**
+ * Strip leading & trailing white spaces, e.g., '\r' of CRLF files, as
+ * script/eval.py does, so that both count the same queries as found & seen
+ */
+std::string Strip(const std::string &line) {
+    const auto chars = ToUtf8(line);
+    auto begin = chars.begin(), end = chars.end();
+    while (begin != end && IsPythonSpace(*begin)) ++begin;
+    while (end != begin && IsPythonSpace(*(end - 1))) --end;
+    std::string stripped;
+    utf8::utf32to8(begin, end, std::back_inserter(stripped));
+    return stripped;
+}
+
+struct Evaluation {
+    size_t count = 0;
+    double reciprocal_rank_sum = 0.0;
+    // # of queries ranked within the top k + 1
+    std::vector<size_t> hits;
+
+    explicit Evaluation(size_t topk) : hits(topk, 0) {}
+
+    /**
+     * @param rank: 1-based rank of the query, or 0 if not found
+     */
+    void Add(size_t rank) {
+        ++count;
+        if (!rank) return;
+        reciprocal_rank_sum += 1.0 / rank;
+        for (auto k = rank - 1; k < hits.size(); ++k) ++hits[k];
+    }
+};
+
+void Print(const std::string &name, const Evaluation &evaluation) {
+    const auto count = std::max<size_t>(evaluation.count, 1);
+    std::cout << "\"" << name << "\": {\"queries\": " << evaluation.count
+              << ", \"mrr\": " << evaluation.reciprocal_rank_sum / count
+              << ", \"success\": [";
+    for (size_t k = 0; k < evaluation.hits.size(); ++k)
+        std::cout << (k ? ", " : "")
+                  << static_cast<double>(evaluation.hits[k]) / count;
+    std::cout << "]}";
+}
+
+/**
+ * Complete every prefix with a QueryBlazer of config, and print its
+ * accuracy, latency & memory as a JSON object
+ */
+void Run(const char *encoder, const char *model, const Config &config,
+         const std::vector<std::string> &prefixes,
+         const std::vector<std::string> &queries,
+         const std::vector<bool> &seen) {
+    const auto build_begin = std::chrono::steady_clock::now();
+    const QueryBlazer queryBlazer{encoder, model, config};
+    const auto build_seconds = SecondsSince(build_begin);
+    const auto precomputed_bytes = queryBlazer.PrecomputedBytes();
+
+    // 1-based rank of the query per prefix, 0 if not completed
+    std::vector<size_t> ranks(prefixes.size(), 0);
+    std::vector<double> latencies(prefixes.size(), 0.0);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    const auto begin = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx < config.num_threads; ++idx) {
+        threads.emplace_back([&]() {
+            QueryBlazer::Context context{queryBlazer};
+            QueryBlazer::Completion completion;
+            for (auto line = next++; line < prefixes.size(); line = next++) {
+                const auto start = std::chrono::steady_clock::now();
+                queryBlazer.Complete(prefixes[line], context, &completion);
+                latencies[line] = SecondsSince(start) * 1e6;
+                const auto &candidates = completion.first;
+                for (size_t rank = 0; rank < candidates.size(); ++rank) {
+                    if (candidates[rank].first == queries[line]) {
+                        ranks[line] = rank + 1;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    const auto seconds = SecondsSince(begin);
+
+    Evaluation seen_evaluation{config.topk}, unseen_evaluation{config.topk},
+        total_evaluation{config.topk};
+    for (size_t line = 0; line < prefixes.size(); ++line) {
+        (seen[line] ? seen_evaluation : unseen_evaluation).Add(ranks[line]);
+        total_evaluation.Add(ranks[line]);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double latency_sum = 0.0;
+    for (const auto latency : latencies) latency_sum += latency;
+    const auto memory = GetMemoryUsage();
+
+    std::cout << "{\"branch_factor\": " << config.branch_factor
+              << ", \"beam_size\": " << config.beam_size
+              << ", \"length_limit\": " << config.length_limit
+              << ", \"beam_gap\": " << config.beam_gap
+              << ", \"stable_steps\": " << config.stable_steps << ", ";
+    Print("seen", seen_evaluation);
+    std::cout << ", ";
+    Print("unseen", unseen_evaluation);
+    std::cout << ", ";
+    Print("total", total_evaluation);
+    std::cout << ", \"qps\": " << prefixes.size() / std::max(seconds, 1e-9)
+              << ", \"mean_us\": " << latency_sum / prefixes.size()
+              << ", \"p50_us\": " << Percentile(latencies, 50)
+              << ", \"p90_us\": " << Percentile(latencies, 90)
+              << ", \"p99_us\": " << Percentile(latencies, 99)
+              << ", \"p999_us\": " << Percentile(latencies, 99.9)
+              << ", \"build_seconds\": " << build_seconds
+              << ", \"precomputed_bytes\": " << precomputed_bytes
+              << ", \"rss_kb\": " << memory.rss << "}";
+}
+
+int main(int argc, char **argv) {
+    const std::string usage =
+        "Evaluate a grid of configs on a prefix/query file, and report the "
+        "accuracy, latency & memory of each as a JSON array\n\n"
+        "Usage: " +
+        std::string{argv[0]} +
+        " [--flags] ENCODER MODEL PREFIX_QUERY [TRAIN]\n"
+        "\tENCODER: LPM encoder in FST\n"
+        "\tMODEL: ngram language model in FST\n"
+        "\tPREFIX_QUERY: prefix & query per line separated by a tab, e.g., "
+        "from script/extract_prefix.py\n"
+        "\tTRAIN: query log the model was built from; test queries in it "
+        "are seen, the rest unseen\n"
+        "Configs run one after another, each completing the prefixes on "
+        "--threads threads.\n";
+    SET_FLAGS(usage.c_str(), &argc, &argv, true);
+    if (argc != 4 && argc != 5) {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    QBZ_ASSERT(FLAGS_topk > 0 && FLAGS_threads >= 0,
+               "--topk must be positive");
+    const auto branch_factors =
+        ParseSizes("branch_factors", FLAGS_branch_factors);
+    const auto beam_sizes = ParseSizes("beam_sizes", FLAGS_beam_sizes);
+    const auto length_limits = ParseSizes("length_limits", FLAGS_length_limits);
+    const auto beam_gaps = ParseList<float>(
+        "beam_gaps", FLAGS_beam_gaps,
+        [](const std::string &value) { return std::stof(value); });
+    const auto stable_steps = ParseSizes("stable_steps", FLAGS_stable_steps);
+
+    std::vector<std::string> prefixes, queries;
+    {
+        std::ifstream ifs{argv[3]};
+        QBZ_ASSERT(ifs, "Error reading " + std::string{argv[3]});
+        std::string line;
+        while (std::getline(ifs, line)) {
+            const auto tab = line.find('\t');
+            QBZ_ASSERT(tab != std::string::npos,
+                       "Invalid prefix/query line: " + line);
+            prefixes.push_back(line.substr(0, tab));
+            queries.push_back(Strip(line.substr(tab + 1)));
+        }
+        QBZ_ASSERT(!prefixes.empty(), "No prefix in " + std::string{argv[3]});
+    }
+
+    std::vector<bool> seen(queries.size(), false);
+    if (argc == 5) {
+        std::unordered_set<std::string> train;
+        std::ifstream ifs{argv[4]};
+        QBZ_ASSERT(ifs, "Error reading " + std::string{argv[4]});
+        std::string query;
+        while (std::getline(ifs, query)) train.insert(Strip(query));
+        for (size_t idx = 0; idx < queries.size(); ++idx)
+            seen[idx] = train.count(queries[idx]) > 0;
+    }
+
+    const auto num_threads =
+        FLAGS_threads ? static_cast<size_t>(FLAGS_threads)
+                      : std::max(std::thread::hardware_concurrency(), 1u);
+    Config base;
+    base.topk = static_cast<size_t>(FLAGS_topk);
+    base.precompute = FLAGS_precompute;
+    base.mmap = FLAGS_mmap;
+    base.num_threads = num_threads;
+    std::vector<Config> configs;
+    for (const auto branch_factor : branch_factors)
+        for (const auto beam_size : beam_sizes)
+            for (const auto length_limit : length_limits)
+                for (const auto beam_gap : beam_gaps)
+                    for (const auto steps : stable_steps) {
+                        configs.push_back(base);
+                        auto &config = configs.back();
+                        config.branch_factor = branch_factor;
+                        config.beam_size = beam_size;
+                        config.length_limit = length_limit;
+                        config.beam_gap = beam_gap;
+                        config.stable_steps = steps;
+                        config.Validate();
+                    }
+
+    // each config is printed as soon as it is done
+    std::cout << "[" << std::endl;
+    for (size_t idx = 0; idx < configs.size(); ++idx) {
+        std::cout << (idx ? ",\n " : " ");
+        Run(argv[1], argv[2], configs[idx], prefixes, queries, seen);
+        std::cout << std::flush;
+    }
+    std::cout << "\n]" << std::endl;
+    return 0;
+}
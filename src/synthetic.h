@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_SYNTHETIC_H
+#define QUERYBLAZER_SYNTHETIC_H
+
+#include "char_map.h"
+#include "common.h"
+#include "encoder.h"
+#include "fst/fstlib.h"
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Sampler of ranks in [0, n), each with probability proportional to
+ * 1 / (rank + 1)^exponent
+ */
+class ZipfSampler {
+  public:
+    ZipfSampler(size_t n, double exponent) {
+        QBZ_ASSERT(n > 0, "Nothing to sample from");
+        std::vector<double> weights(n);
+        for (size_t rank = 0; rank < n; ++rank)
+            weights[rank] = 1.0 / std::pow(rank + 1.0, exponent);
+        distribution = std::discrete_distribution<size_t>{weights.begin(),
+                                                          weights.end()};
+    }
+
+    size_t operator()(std::mt19937 &rng) { return distribution(rng); }
+
+  private:
+    std::discrete_distribution<size_t> distribution;
+};
+
+/**
+ * Distinct random words over the first alphabet_size lowercase letters
+ * May return fewer than num_words if the alphabet is too small
+ */
+inline std::vector<std::string> SyntheticWords(size_t num_words,
+                                               size_t alphabet_size,
+                                               std::mt19937 &rng) {
+    QBZ_ASSERT(alphabet_size >= 2 && alphabet_size <= 26,
+               "Alphabet size must be in [2, 26]");
+    std::uniform_int_distribution<int> letter{
+        0, static_cast<int>(alphabet_size) - 1};
+    // 2 letters plus a geometric tail, i.e., about 4 letters on average
+    std::geometric_distribution<size_t> tail{0.4};
+    std::set<std::string> seen;
+    std::vector<std::string> words;
+    for (size_t attempt = 0;
+         words.size() < num_words && attempt < num_words * 100; ++attempt) {
+        std::string word(2 + std::min<size_t>(tail(rng), 10), 'a');
+        for (auto &c : word) c = static_cast<char>('a' + letter(rng));
+        if (seen.insert(word).second) words.push_back(std::move(word));
+    }
+    return words;
+}
+
+/**
+ * Distinct queries of 1 to max_words words, each drawn from a Zipf
+ * distribution over words
+ * May return fewer than num_queries if there are too few words
+ */
+inline std::vector<std::string>
+SyntheticQueries(size_t num_queries, const std::vector<std::string> &words,
+                 size_t max_words, double exponent, std::mt19937 &rng) {
+    QBZ_ASSERT(max_words > 0, "Queries must have a word");
+    ZipfSampler word{words.size(), exponent};
+    std::uniform_int_distribution<size_t> length{1, max_words};
+    std::set<std::string> seen;
+    std::vector<std::string> queries;
+    for (size_t attempt = 0;
+         queries.size() < num_queries && attempt < num_queries * 100;
+         ++attempt) {
+        std::string query = words[word(rng)];
+        for (auto idx = length(rng); idx > 1; --idx)
+            query += " " + words[word(rng)];
+        if (seen.insert(query).second) queries.push_back(std::move(query));
+    }
+    return queries;
+}
+
+/**
+ * Query log of num_lines queries, each drawn from a Zipf distribution over
+ * queries, so that the first queries are the most popular
+ */
+inline std::vector<std::string>
+ZipfQueryLog(const std::vector<std::string> &queries, size_t num_lines,
+             double exponent, std::mt19937 &rng) {
+    ZipfSampler query{queries.size(), exponent};
+    std::vector<std::string> log;
+    log.reserve(num_lines);
+    for (size_t idx = 0; idx < num_lines; ++idx)
+        log.push_back(queries[query(rng)]);
+    return log;
+}
+
+/**
+ * Sentencepiece-style subword vocabulary of up to vocab_size tokens, made of
+ * substrings of words drawn from a Zipf distribution; substrings beginning a
+ * word carry the leading space
+ * The space and every letter, with & without the leading space, are tokens on
+ * their own, so that any query over the words can be encoded.
+ */
+inline std::vector<std::string>
+SyntheticVocabulary(const std::vector<std::string> &words, size_t vocab_size,
+                    double exponent, std::mt19937 &rng) {
+    const auto space = ToString({SPACE});
+    std::set<std::string> vocabulary{space};
+    for (const auto &word : words) {
+        for (auto c : word) {
+            vocabulary.insert(std::string(1, c));
+            vocabulary.insert(space + c);
+        }
+    }
+
+    ZipfSampler word{words.size(), exponent};
+    for (size_t attempt = 0;
+         vocabulary.size() < vocab_size && attempt < vocab_size * 100;
+         ++attempt) {
+        const auto &chosen = words[word(rng)];
+        std::uniform_int_distribution<size_t> begin{0, chosen.size() - 2};
+        const auto first = begin(rng);
+        std::uniform_int_distribution<size_t> length{
+            2, std::min<size_t>(chosen.size() - first, 6)};
+        const auto token = chosen.substr(first, length(rng));
+        vocabulary.insert(first == 0 ? space + token : token);
+    }
+    return {vocabulary.begin(), vocabulary.end()};
+}
+
+/**
+ * Encode queries into olabels as QueryBlazer does, i.e., beginning with a
+ * space and ending at an exit state of the encoder
+ */
+inline std::vector<std::vector<int>>
+EncodeQueries(const fst::StdFst &encoder,
+              const std::vector<std::string> &queries) {
+    fst::SortedMatcher<fst::StdFst> matcher{&encoder,
+                                            fst::MatchType::MATCH_INPUT,
+                                            IDX_UNK + 1};
+    const CharMap charMap{*encoder.InputSymbols()};
+    matcher.SetState(encoder.Start());
+    QBZ_ASSERT(matcher.Find(charMap.Find(SPACE)),
+               "space char not found in the encoder");
+    const auto start = matcher.Value().nextstate;
+
+    std::vector<std::vector<int>> sentences;
+    sentences.reserve(queries.size());
+    std::vector<int> ilabels;
+    for (const auto &query : queries) {
+        ilabels.clear();
+        ForEachChar(query, [&](char32_t c) {
+            if (c == static_cast<char32_t>(' ')) c = SPACE;
+            const auto ilabel = charMap.Find(c);
+            ilabels.push_back(ilabel == fst::kNoLabel ? IDX_UNK : ilabel);
+        });
+        sentences.push_back(Encode(encoder, matcher, start, ilabels, true));
+    }
+    return sentences;
+}
+
+/**
+ * Build a backoff n-gram model in the format script/build_fst_model.sh
+ * produces, i.e., one state per history with backoff arcs relabeled to phi,
+ * the history <s> as the start state and the cost of </s> as final weight
+ * Costs are estimated with absolute discounting, the discounted mass going
+ * to the backoff arc, and add-one smoothing over the whole vocabulary at the
+ * unigram state; lower orders are not adjusted for the words the higher
+ * ones cover, so the model has the structure of a real one but is not
+ * exactly normalized.
+ *
+ * @param sentences: olabel sequences without <s> & </s>
+ * @param symbols: output symbols of the encoder, used for both sides
+ * @param order: n-gram order
+ * @param model: empty graph to build the model into
+ */
+inline void BuildBackoffModel(const std::vector<std::vector<int>> &sentences,
+                              const fst::SymbolTable &symbols, size_t order,
+                              fst::StdVectorFst *model) {
+    QBZ_ASSERT(order > 0, "n-gram order must be positive");
+    using History = std::vector<int>;
+    const float discount = 0.5f;
+
+    // count of each word following each history of up to order - 1 words
+    std::map<History, std::map<int, size_t>> counts;
+    counts[History{}];
+    History sequence;
+    for (const auto &sentence : sentences) {
+        sequence.assign(1, IDX_BOS);
+        sequence.insert(sequence.end(), sentence.begin(), sentence.end());
+        sequence.push_back(IDX_EOS);
+        for (size_t idx = 1; idx < sequence.size(); ++idx)
+            for (size_t length = 0; length < order && length <= idx; ++length)
+                ++counts[History{sequence.begin() + (idx - length),
+                                 sequence.begin() + idx}][sequence[idx]];
+    }
+
+    model->SetInputSymbols(&symbols);
+    model->SetOutputSymbols(&symbols);
+    std::map<History, int> states;
+    for (const auto &pair : counts)
+        states.emplace(pair.first, model->AddState());
+
+    // longest suffix of history + word of up to order - 1 words with a state
+    auto nextstate = [&states, order](const History &history, int word) {
+        History next{history};
+        next.push_back(word);
+        if (next.size() >= order)
+            next.erase(next.begin(), next.end() - (order - 1));
+        while (states.find(next) == states.end()) next.erase(next.begin());
+        return states.at(next);
+    };
+
+    for (const auto &pair : counts) {
+        const auto &history = pair.first;
+        const auto state = states.at(history);
+        size_t total = 0;
+        for (const auto &count : pair.second) total += count.second;
+
+        if (history.empty()) {
+            std::vector<int> words;
+            for (fst::SymbolTableIterator siter{symbols}; !siter.Done();
+                 siter.Next()) {
+                const auto word = static_cast<int>(siter.Value());
+                if (word != IDX_EPSILON && word != IDX_PHI && word != IDX_BOS)
+                    words.push_back(word);
+            }
+            for (const auto word : words) {
+                const auto it = pair.second.find(word);
+                const auto count = it == pair.second.end() ? 0 : it->second;
+                const auto cost = -std::log(static_cast<float>(count + 1) /
+                                            (total + words.size()));
+                if (word == IDX_EOS)
+                    model->SetFinal(state, cost);
+                else
+                    model->AddArc(state, fst::StdArc(word, word, cost,
+                                                     nextstate(history, word)));
+            }
+            continue;
+        }
+
+        for (const auto &count : pair.second) {
+            const auto word = count.first;
+            const auto cost = -std::log((count.second - discount) /
+                                        static_cast<float>(total));
+            if (word == IDX_EOS)
+                model->SetFinal(state, cost);
+            else
+                model->AddArc(state, fst::StdArc(word, word, cost,
+                                                 nextstate(history, word)));
+        }
+        const auto backoff = -std::log(discount * pair.second.size() /
+                                       static_cast<float>(total));
+        model->AddArc(state,
+                      fst::StdArc(IDX_PHI, IDX_EPSILON, backoff,
+                                  states.at(History{history.begin() + 1,
+                                                    history.end()})));
+    }
+
+    const auto start = states.find(History{IDX_BOS});
+    model->SetStart(start == states.end() ? states.at(History{})
+                                          : start->second);
+    fst::ArcSort(model, fst::ILabelCompare<fst::StdArc>{});
+}
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_SYNTHETIC_H
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#include <iostream>
+#include "queryblazer.h"
+
+using namespace qbz;
+
+int Usage(const char *program) {
+    std::cerr << "Usage: " << program << " ENCODER MODEL PREFIX_FILE" << std::endl;
+    std::cerr << "\tENCODER: LPM encoder in FST" << std::endl;
+    std::cerr << "\tMODEL: ngram language model in FST" << std::endl;
+    std::cerr << "\tPREFIX_FILE: a file with prefix in each line" << std::endl;
+    std::cerr << "Checks that the completion cache returns what a search does, including for prefixes ending in characters out of the encoder" << std::endl;
+
+    return EXIT_FAILURE;
+}
+
+int main(int argc, const char **argv) {
+    std::ios::sync_with_stdio(false);
+    if (argc != 4) return Usage(argv[0]);
+    Config config;
+    const QueryBlazer uncached{argv[1], argv[2], config};
+    config.completion_cache_bytes = 1 << 26;
+    const QueryBlazer cached{argv[1], argv[2], config};
+
+    std::ifstream ifs{argv[3]};
+    QBZ_ASSERT(ifs, "Error reading " + std::string{argv[3]});
+    // private use characters, which no encoder is built with
+    const std::string oovs[] = {"\xee\x80\x80", "\xee\x80\x81"};
+    std::string prefix;
+    size_t count = 0;
+    while (std::getline(ifs, prefix)) {
+        std::vector<QueryBlazer::Completion> oov_completions;
+        for (const auto &query : {prefix, prefix + oovs[0], prefix + oovs[1]}) {
+            const auto expected = uncached.Complete(query);
+            // the 2nd call is served from the cache
+            for (auto repeat = 0; repeat < 2; ++repeat)
+                QBZ_ASSERT(cached.Complete(query).first == expected.first,
+                           "Cached completions differ for " + query);
+            if (query != prefix) oov_completions.push_back(expected);
+        }
+        QBZ_ASSERT(oov_completions[0].first.empty() ||
+                       oov_completions[0].first != oov_completions[1].first,
+                   "Same completions for different characters out of the "
+                   "encoder after " + prefix);
+        ++count;
+    }
+    std::cout << count << " prefixes checked" << std::endl;
+
+    return 0;
+}
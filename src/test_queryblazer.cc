@@ -6,14 +6,17 @@
  */
 
 #include <iostream>
+#include "bench.h"
 #include "queryblazer.h"
 
 int Usage(const char* program) {
-    std::cerr << "Usage: " << program << " ENCODER MODEL PRECOMPUTED PREFIX_FILE" << std::endl;
+    std::cerr << "Usage: " << program << " ENCODER MODEL PRECOMPUTED PREFIX_FILE [BEAM_GAP [STABLE_STEPS]]" << std::endl;
     std::cerr << "ENCODER: LPM encoder in FST" << std::endl;
     std::cerr << "MODEL: ngram language model in FST" << std::endl;
     std::cerr << "PRECOMPUTED: precomputed binary if available; use '-' if not" << std::endl;
     std::cerr << "PREFIX_FILE: a file with prefix in each line to trigger autocomplete" << std::endl;
+    std::cerr << "BEAM_GAP: prune hypotheses costing more than the best of their step plus this gap; 0 disables" << std::endl;
+    std::cerr << "STABLE_STEPS: stop a search once its top k have not changed for this many steps; 0 disables" << std::endl;
     return EXIT_FAILURE;
 }
 
@@ -21,12 +24,16 @@ using namespace qbz;
 
 int main(int argc, const char** argv) {
     std::ios::sync_with_stdio(false);
-    if (argc != 5) return Usage(argv[0]);
+    if (argc < 5 || argc > 7) return Usage(argv[0]);
     const std::string precomputed{argv[3]};
     const std::string prefixes{argv[4]};
+    const float beam_gap = argc > 5 ? std::stof(argv[5]) : 0.0f;
+    const size_t stable_steps = argc > 6 ? std::stoul(argv[6]) : 0;
 
-    QueryBlazer completer{argv[1], argv[2],
-                          Config{30, 30, 10, 100, false}};
+    Config config;
+    config.beam_gap = beam_gap;
+    config.stable_steps = stable_steps;
+    QueryBlazer completer{argv[1], argv[2], config};
     if (std::string{"-"} != precomputed) {
         std::cerr << "Loading precomputed from " << precomputed << std::endl;
         completer.LoadPrecomputed(precomputed);
@@ -37,20 +44,24 @@ int main(int argc, const char** argv) {
     std::vector<std::string> candidates(completer.GetConfig().topk);
     std::string prefix;
 
-    auto t_start = std::chrono::high_resolution_clock::now();
+    // only completions are timed, not reading prefixes or writing results
+    double seconds = 0.0;
     size_t count = 0;
     while (std::getline(ifs, prefix)) {
+        const auto begin = std::chrono::steady_clock::now();
         auto completions = completer.Complete(prefix).first;
+        seconds += SecondsSince(begin);
+        // pruned searches may return fewer than topk
         for (auto idx = 0; idx < candidates.size(); ++idx)
-            candidates.at(idx) = std::move(completions.at(idx).first);
+            candidates.at(idx) = idx < completions.size()
+                                     ? std::move(completions.at(idx).first)
+                                     : std::string{};
 
         std::cout << Join(candidates, "\t") << std::endl;
         ++count;
     }
 
-    auto t_end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::seconds>(t_end - t_start).count();
-    std::cerr << "Completion speed: " << static_cast<double>(count) / duration << " QPS" << std::endl;
+    std::cerr << "Completion speed: " << count / std::max(seconds, 1e-9) << " QPS" << std::endl;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_TOPARCS_H
+#define QUERYBLAZER_TOPARCS_H
+
+#include "common.h"
+#include "fst/fstlib.h"
+#include "mapped_file.h"
+#include "scheduler.h"
+#include "transition.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Model transition with the costs of the phi transitions taken to reach it
+ * folded into its weight
+ */
+struct TopArc {
+    TopArc() = default;
+
+    TopArc(int olabel, int ilabel, int nextstate, float weight)
+        : olabel{olabel},
+          ilabel{ilabel},
+          nextstate{nextstate},
+          weight{weight} {}
+
+    explicit TopArc(const fst::StdArc &arc)
+        : olabel{arc.olabel},
+          ilabel{arc.ilabel},
+          nextstate{arc.nextstate},
+          weight{arc.weight.Value()} {}
+
+    int olabel, ilabel, nextstate;
+    float weight;
+};
+
+/**
+ * Top arcs of a state as parallel arrays, sorted by weight
+ * Beam search reads weights alone until one exceeds its bound, so keeping
+ * them contiguous & apart from the labels leaves the labels of skipped arcs
+ * unread
+ */
+class ArcSpan {
+  public:
+    class Iterator {
+      public:
+        Iterator(const ArcSpan &span, size_t idx) : span{&span}, idx{idx} {}
+
+        TopArc operator*() const { return (*span)[idx]; }
+
+        Iterator &operator++() {
+            ++idx;
+            return *this;
+        }
+
+        bool operator!=(const Iterator &that) const { return idx != that.idx; }
+
+      private:
+        const ArcSpan *span;
+        size_t idx;
+    };
+
+    ArcSpan() = default;
+
+    ArcSpan(const float *weights, const int *olabels, const int *ilabels,
+            const int *nextstates, size_t size)
+        : weights{weights},
+          olabels{olabels},
+          ilabels{ilabels},
+          nextstates{nextstates},
+          size{size} {}
+
+    size_t Size() const { return size; }
+
+    float Weight(size_t idx) const { return weights[idx]; }
+
+    int OLabel(size_t idx) const { return olabels[idx]; }
+
+    int NextState(size_t idx) const { return nextstates[idx]; }
+
+    TopArc operator[](size_t idx) const {
+        return TopArc{olabels[idx], ilabels[idx], nextstates[idx],
+                      weights[idx]};
+    }
+
+    Iterator begin() const { return Iterator{*this, 0}; }
+
+    Iterator end() const { return Iterator{*this, size}; }
+
+  private:
+    const float *weights = nullptr;
+    const int *olabels = nullptr;
+    const int *ilabels = nullptr;
+    const int *nextstates = nullptr;
+    size_t size = 0;
+};
+
+/**
+ * Top arcs of a state computed in memory, in the layout of ArcSpan
+ */
+class TopArcList {
+  public:
+    TopArcList() = default;
+
+    /**
+     * @param arcs: sorted by weight, as returned by TopArcs
+     */
+    explicit TopArcList(const std::vector<TopArc> &arcs)
+        : weights(arcs.size()), labels(3 * arcs.size()) {
+        QBZ_ASSERT(std::is_sorted(arcs.begin(), arcs.end(),
+                                  [](const TopArc &a, const TopArc &b) {
+                                      return a.weight < b.weight;
+                                  }),
+                   "Top arcs must be sorted by weight");
+        const auto size = arcs.size();
+        for (size_t idx = 0; idx < size; ++idx) {
+            weights[idx] = arcs[idx].weight;
+            labels[idx] = arcs[idx].olabel;
+            labels[size + idx] = arcs[idx].ilabel;
+            labels[2 * size + idx] = arcs[idx].nextstate;
+        }
+    }
+
+    ArcSpan View() const {
+        const auto size = weights.size();
+        return ArcSpan{weights.data(), labels.data(), labels.data() + size,
+                       labels.data() + 2 * size, size};
+    }
+
+  private:
+    std::vector<float> weights;
+    // olabels, ilabels & nextstates in a single allocation
+    std::vector<int> labels;
+};
+
+#define TOP_ARCS_MAGIC "QBZARCS"
+
+constexpr uint32_t TOP_ARCS_VERSION = 3;
+
+/**
+ * Header of a top arc file, in host byte order
+ * Followed by arc offsets per state (uint64, num_states + 1), exit costs per
+ * state (float), then weights (float), olabels, ilabels & nextstates (int)
+ * of the arcs of all states, each 8-byte aligned
+ * Arc sections are sized for branch_factor arcs per state, so that they can
+ * be written in place before the number of arcs is known
+ */
+struct TopArcsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t branch_factor;
+    uint64_t num_states;
+    uint64_t num_arcs;
+    // FileChecksum of the model, verified by offline tools
+    uint64_t model_checksum;
+    // FileSize of the model, verified at load as reading it all is too slow
+    uint64_t model_bytes;
+};
+
+/**
+ * Byte offsets of each section of a top arc file
+ */
+struct TopArcsLayout {
+    explicit TopArcsLayout(const TopArcsHeader &header) {
+        capacity = header.num_states * header.branch_factor;
+        offsets = Align(sizeof(TopArcsHeader));
+        exit_costs = offsets + sizeof(uint64_t) * (header.num_states + 1);
+        weights = Align(exit_costs + sizeof(float) * header.num_states);
+        olabels = Align(weights + sizeof(float) * capacity);
+        ilabels = Align(olabels + sizeof(int) * capacity);
+        nextstates = Align(ilabels + sizeof(int) * capacity);
+        size = nextstates + sizeof(int) * capacity;
+    }
+
+    static uint64_t Align(uint64_t offset) { return (offset + 7) & ~7ull; }
+
+    // # of arcs each arc section has room for
+    uint64_t capacity;
+    uint64_t offsets, exit_costs, weights, olabels, ilabels, nextstates, size;
+};
+
+/**
+ * Compute the top arcs & exit cost of every model state and write them into
+ * a top arc file, a chunk of states at a time
+ * @param model_checksum: FileChecksum of the model, recorded in the file
+ * @param model_bytes: FileSize of the model, recorded in the file
+ */
+inline void WriteTopArcs(const fst::StdExpandedFst &model,
+                         size_t branch_factor, uint64_t model_checksum,
+                         uint64_t model_bytes, const std::string &file,
+                         size_t num_threads = 0) {
+    TopArcsHeader header;
+    std::memset(&header, 0, sizeof header);
+    std::memcpy(header.magic, TOP_ARCS_MAGIC, sizeof header.magic);
+    header.version = TOP_ARCS_VERSION;
+    header.branch_factor = static_cast<uint32_t>(branch_factor);
+    header.num_states = static_cast<uint64_t>(model.NumStates());
+    header.model_checksum = model_checksum;
+    header.model_bytes = model_bytes;
+    const TopArcsLayout layout{header};
+
+    std::ofstream ofs{file, std::ios::binary | std::ios::trunc};
+    QBZ_ASSERT(ofs, "Error opening " + file);
+    const auto write = [&ofs](uint64_t offset, const void *data,
+                              size_t bytes) {
+        ofs.seekp(offset);
+        ofs.write(static_cast<const char *>(data), bytes);
+    };
+
+    using Matcher = fst::SortedMatcher<fst::StdExpandedFst>;
+    RangeScheduler scheduler{num_threads};
+    std::vector<std::unique_ptr<Matcher>> matchers;
+    for (size_t idx = 0; idx < scheduler.NumThreads(); ++idx)
+        matchers.emplace_back(
+            new Matcher{&model, fst::MatchType::MATCH_INPUT, IDX_UNK + 1});
+
+    const size_t chunk_size = 1 << 16;
+    std::vector<std::vector<TopArc>> arcs;
+    std::vector<float> exit_costs, weights;
+    std::vector<int> olabels, ilabels, nextstates;
+    std::vector<uint64_t> offsets;
+    uint64_t num_arcs = 0;
+    for (uint64_t first = 0; first < header.num_states; first += chunk_size) {
+        const auto size = std::min<uint64_t>(chunk_size,
+                                             header.num_states - first);
+        arcs.assign(size, std::vector<TopArc>{});
+        exit_costs.assign(size, 0.0f);
+        scheduler.Run("top arcs", size,
+                      [&](size_t begin, size_t end, size_t worker) {
+                          for (auto idx = begin; idx < end; ++idx) {
+                              const auto state = static_cast<int>(first + idx);
+                              arcs[idx] = TopArcs<TopArc>(model, state,
+                                                          branch_factor);
+                              exit_costs[idx] = MakeExitTransitions(
+                                  model, *matchers[worker], state);
+                          }
+                      });
+
+        const auto chunk_first_arc = num_arcs;
+        offsets.clear();
+        weights.clear();
+        olabels.clear();
+        ilabels.clear();
+        nextstates.clear();
+        for (const auto &state_arcs : arcs) {
+            QBZ_ASSERT(state_arcs.size() <= branch_factor,
+                       "More top arcs than the branch factor");
+            offsets.push_back(num_arcs);
+            for (const auto &arc : state_arcs) {
+                weights.push_back(arc.weight);
+                olabels.push_back(arc.olabel);
+                ilabels.push_back(arc.ilabel);
+                nextstates.push_back(arc.nextstate);
+            }
+            num_arcs += state_arcs.size();
+        }
+        write(layout.offsets + sizeof(uint64_t) * first, offsets.data(),
+              sizeof(uint64_t) * offsets.size());
+        write(layout.exit_costs + sizeof(float) * first, exit_costs.data(),
+              sizeof(float) * exit_costs.size());
+        write(layout.weights + sizeof(float) * chunk_first_arc, weights.data(),
+              sizeof(float) * weights.size());
+        write(layout.olabels + sizeof(int) * chunk_first_arc, olabels.data(),
+              sizeof(int) * olabels.size());
+        write(layout.ilabels + sizeof(int) * chunk_first_arc, ilabels.data(),
+              sizeof(int) * ilabels.size());
+        write(layout.nextstates + sizeof(int) * chunk_first_arc,
+              nextstates.data(), sizeof(int) * nextstates.size());
+    }
+
+    header.num_arcs = num_arcs;
+    write(0, &header, sizeof header);
+    write(layout.offsets + sizeof(uint64_t) * header.num_states, &num_arcs,
+          sizeof num_arcs);
+    // extend the file over the unused tail of the last section
+    if (num_arcs < layout.capacity) {
+        const char zero = 0;
+        write(layout.size - 1, &zero, 1);
+    }
+    ofs.close();
+    QBZ_ASSERT(ofs, "Error writing " + file);
+}
+
+/**
+ * Top arc file mapped into memory and served from directly
+ */
+class TopArcTable {
+  public:
+    explicit TopArcTable(const std::string &file) : mapped{file} {
+        QBZ_ASSERT(mapped.Size() >= sizeof header,
+                   "Invalid top arc file: " + file);
+        std::memcpy(&header, mapped.Data(), sizeof header);
+        QBZ_ASSERT(std::memcmp(header.magic, TOP_ARCS_MAGIC,
+                               sizeof header.magic) == 0,
+                   "Invalid top arc file: " + file);
+        QBZ_ASSERT(header.version == TOP_ARCS_VERSION,
+                   "Unsupported top arc file version " +
+                       std::to_string(header.version) + ": " + file);
+
+        const TopArcsLayout layout{header};
+        QBZ_ASSERT(layout.size == mapped.Size(),
+                   "Truncated top arc file: " + file);
+        const auto data = mapped.Data();
+        offsets = reinterpret_cast<const uint64_t *>(data + layout.offsets);
+        exit_costs = reinterpret_cast<const float *>(data + layout.exit_costs);
+        weights = reinterpret_cast<const float *>(data + layout.weights);
+        olabels = reinterpret_cast<const int *>(data + layout.olabels);
+        ilabels = reinterpret_cast<const int *>(data + layout.ilabels);
+        nextstates = reinterpret_cast<const int *>(data + layout.nextstates);
+        QBZ_ASSERT(header.num_arcs <= layout.capacity &&
+                       offsets[header.num_states] == header.num_arcs,
+                   "Corrupted top arc file: " + file);
+    }
+
+    size_t NumStates() const { return header.num_states; }
+
+    size_t BranchFactor() const { return header.branch_factor; }
+
+    uint64_t ModelChecksum() const { return header.model_checksum; }
+
+    uint64_t ModelBytes() const { return header.model_bytes; }
+
+    ArcSpan Arcs(int state) const {
+        const auto first = offsets[state];
+        return ArcSpan{weights + first, olabels + first, ilabels + first,
+                       nextstates + first, offsets[state + 1] - first};
+    }
+
+    /**
+     * Cost of the phi transitions & final weight to exit from state
+     */
+    float ExitCost(int state) const { return exit_costs[state]; }
+
+  private:
+    const MappedFile mapped;
+    TopArcsHeader header;
+    const uint64_t *offsets = nullptr;
+    const float *exit_costs = nullptr;
+    const float *weights = nullptr;
+    const int *olabels = nullptr;
+    const int *ilabels = nullptr;
+    const int *nextstates = nullptr;
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_TOPARCS_H
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2018, salesforce.com, inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+
+#ifndef QUERYBLAZER_TRACE_H
+#define QUERYBLAZER_TRACE_H
+
+#include "common.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace qbz {
+
+/**
+ * Beam search run on demand while tracing a completion
+ */
+struct SearchTrace {
+    int state = 0;
+    uint64_t ns = 0;
+    // # of hypotheses in the frontier per step
+    std::vector<uint32_t> frontier_sizes;
+    size_t hypotheses = 0;
+    // stopped by the budget of the call
+    bool stopped = false;
+};
+
+/**
+ * Initial beam kept by InitBeams
+ */
+struct BeamTrace {
+    std::vector<int> olabels;
+    int model_state;
+    float cost;
+};
+
+/**
+ * Search trace of a single completion
+ */
+struct QueryTrace {
+    // order in which traces were kept
+    uint64_t sequence = 0;
+    std::string query;
+    uint64_t total_ns = 0;
+    // encoder & model states after each character
+    std::vector<int> encoder_states, model_states;
+    // InitBeams trie nodes visited & cut by the bounds
+    size_t init_tried = 0, init_pruned = 0;
+    std::vector<BeamTrace> beams;
+    // model states whose results were computed on demand
+    std::vector<SearchTrace> searches;
+
+    void Clear() {
+        sequence = 0;
+        query.clear();
+        total_ns = 0;
+        encoder_states.clear();
+        model_states.clear();
+        init_tried = init_pruned = 0;
+        beams.clear();
+        searches.clear();
+    }
+};
+
+/**
+ * Escape a string for a JSON string literal
+ */
+inline std::string JsonEscape(const std::string &text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (const auto c : text) {
+        switch (c) {
+        case '"':
+            escaped += "\\\"";
+            break;
+        case '\\':
+            escaped += "\\\\";
+            break;
+        case '\n':
+            escaped += "\\n";
+            break;
+        case '\t':
+            escaped += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof code, "\\u%04x",
+                              static_cast<unsigned>(c));
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
+}
+
+template <typename T>
+void WriteJsonArray(std::ostream &os, const std::vector<T> &values) {
+    os << "[";
+    for (size_t idx = 0; idx < values.size(); ++idx)
+        os << (idx ? ", " : "") << values[idx];
+    os << "]";
+}
+
+inline void WriteJson(std::ostream &os, const QueryTrace &trace) {
+    os << "{\"sequence\": " << trace.sequence << ", \"query\": \""
+       << JsonEscape(trace.query) << "\", \"total_us\": "
+       << trace.total_ns / 1e3 << ", \"encoder_states\": ";
+    WriteJsonArray(os, trace.encoder_states);
+    os << ", \"model_states\": ";
+    WriteJsonArray(os, trace.model_states);
+    os << ", \"init_tried\": " << trace.init_tried
+       << ", \"init_pruned\": " << trace.init_pruned << ", \"beams\": [";
+    for (size_t idx = 0; idx < trace.beams.size(); ++idx) {
+        const auto &beam = trace.beams[idx];
+        os << (idx ? ", " : "") << "{\"olabels\": ";
+        WriteJsonArray(os, beam.olabels);
+        os << ", \"model_state\": " << beam.model_state
+           << ", \"cost\": " << beam.cost << "}";
+    }
+    os << "], \"searches\": [";
+    for (size_t idx = 0; idx < trace.searches.size(); ++idx) {
+        const auto &search = trace.searches[idx];
+        os << (idx ? ", " : "") << "{\"state\": " << search.state
+           << ", \"us\": " << search.ns / 1e3 << ", \"frontier_sizes\": ";
+        WriteJsonArray(os, search.frontier_sizes);
+        os << ", \"hypotheses\": " << search.hypotheses
+           << ", \"stopped\": " << (search.stopped ? "true" : "false")
+           << "}";
+    }
+    os << "]}";
+}
+
+/**
+ * Fixed-size ring of the latest traces kept, shared by all threads
+ * Each slot holds an atomic pointer that is only ever exchanged, so whoever
+ * takes a trace out of a slot owns it exclusively; adding never blocks and
+ * overwrites the oldest trace once the ring is full.
+ */
+class TraceRing {
+  public:
+    explicit TraceRing(size_t capacity)
+        : capacity{std::max<size_t>(capacity, 1)},
+          slots{new std::atomic<QueryTrace *>[this->capacity]} {
+        for (size_t idx = 0; idx < this->capacity; ++idx)
+            slots[idx].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~TraceRing() {
+        for (size_t idx = 0; idx < capacity; ++idx)
+            delete slots[idx].exchange(nullptr, std::memory_order_acquire);
+    }
+
+    TraceRing(const TraceRing &) = delete;
+    TraceRing &operator=(const TraceRing &) = delete;
+
+    void Add(std::unique_ptr<QueryTrace> trace) {
+        const auto sequence = next.fetch_add(1, std::memory_order_relaxed);
+        trace->sequence = sequence;
+        delete slots[sequence % capacity].exchange(
+            trace.release(), std::memory_order_acq_rel);
+    }
+
+    /**
+     * Take every trace out of the ring, oldest first
+     */
+    std::vector<std::unique_ptr<QueryTrace>> Drain() {
+        std::vector<std::unique_ptr<QueryTrace>> traces;
+        for (size_t idx = 0; idx < capacity; ++idx) {
+            std::unique_ptr<QueryTrace> trace{
+                slots[idx].exchange(nullptr, std::memory_order_acq_rel)};
+            if (trace) traces.push_back(std::move(trace));
+        }
+        std::sort(traces.begin(), traces.end(),
+                  [](const std::unique_ptr<QueryTrace> &a,
+                     const std::unique_ptr<QueryTrace> &b) {
+                      return a->sequence < b->sequence;
+                  });
+        return traces;
+    }
+
+    /**
+     * Drain the ring into a JSON array
+     */
+    std::string DumpJson() {
+        std::ostringstream oss;
+        oss << "[";
+        const auto traces = Drain();
+        for (size_t idx = 0; idx < traces.size(); ++idx) {
+            oss << (idx ? ",\n " : "");
+            WriteJson(oss, *traces[idx]);
+        }
+        oss << "]";
+        return oss.str();
+    }
+
+  private:
+    const size_t capacity;
+    std::unique_ptr<std::atomic<QueryTrace *>[]> slots;
+    std::atomic<uint64_t> next{0};
+};
+
+} // namespace qbz
+
+#endif // QUERYBLAZER_TRACE_H
@@ -10,6 +10,12 @@
 
 #include "common.h"
 #include "fst/fstlib.h"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <queue>
+#include <utility>
+#include <vector>
 
 namespace qbz {
 
@@ -89,6 +95,84 @@ float MakeExitTransitions(const FST &graph, Matcher &matcher, int in_state,
     return cost;
 }
 
+/**
+ * Top emitting transitions of a backoff model state, up to branch_factor,
+ * with phi (backoff) transitions resolved; an ilabel reachable with fewer phi
+ * transitions shadows the same ilabel further down the backoff chain
+ * @param model: deterministic model graph with phi transitions
+ * @tparam Arc: constructible from fst::StdArc, with a float weight
+ */
+template <typename Arc, typename FST>
+std::vector<Arc> TopArcs(const FST &model, int state, size_t branch_factor) {
+    std::vector<Arc> arcs;
+    // ilabels taken so far are marked with a stamp unique to this call, so
+    // that the vocabulary-sized array is allocated once per thread rather
+    // than once per call
+    thread_local std::vector<uint32_t> stamps;
+    thread_local uint32_t stamp = 0;
+    const auto num_ilabels =
+        static_cast<size_t>(model.InputSymbols()->AvailableKey());
+    if (stamps.size() < num_ilabels) stamps.resize(num_ilabels, 0);
+    if (++stamp == 0) {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        stamp = 1;
+    }
+
+    using Backoff = std::pair<int, float>;
+    std::queue<Backoff> queue;
+    queue.emplace(state, 0);
+    while (!queue.empty()) {
+        auto phi_state = queue.front().first;
+        auto cost = queue.front().second;
+        queue.pop();
+
+        fst::ArcIterator<fst::StdFst> aiter{model, phi_state};
+        for (; !aiter.Done(); aiter.Next()) {
+            Arc arc{aiter.Value()};
+            if (arc.ilabel == IDX_PHI) {
+                queue.emplace(arc.nextstate, cost + arc.weight);
+            } else if (stamps.at(arc.ilabel) != stamp) {
+                stamps.at(arc.ilabel) = stamp;
+            } else
+                continue; // fewer-phi-transition already exists for the
+                          // ilabel
+
+            arc.weight = arc.weight + cost;
+            arcs.push_back(arc);
+        }
+
+        if (arcs.size() > branch_factor)
+            std::partial_sort(arcs.begin(), arcs.begin() + branch_factor,
+                              arcs.end(), [](const Arc &a, const Arc &b) {
+                                  return a.weight < b.weight;
+                              });
+
+        // if phi transition is not within the top arcs, we are done
+        auto it = std::find_if(arcs.begin(), arcs.end(), [](const Arc &a) {
+            return a.ilabel == IDX_PHI;
+        });
+
+        if (arcs.size() > branch_factor &&
+            std::distance(arcs.begin(), it) >= branch_factor) {
+            arcs.erase(arcs.begin() + branch_factor, arcs.end());
+            arcs.shrink_to_fit();
+            QBZ_ASSERT(std::find_if(arcs.begin(), arcs.end(),
+                                    [](const Arc &a) {
+                                        return a.olabel == IDX_EPSILON;
+                                    }) == arcs.end(),
+                       "Non-emitting transition within top arcs");
+            return arcs;
+        }
+
+        // swap with the last element and remove so that it is O(1)
+        QBZ_ASSERT(it != arcs.end(), "phi transition not found");
+        std::swap(arcs.back(), *it);
+        arcs.erase(arcs.end() - 1);
+    }
+
+    QBZ_ASSERT(false, "This must not be reached");
+}
+
 } // namespace qbz
 
 #endif // QUERYBLAZER_EMITTINGPHI_H